@@ -1,50 +1,434 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "aes.h"
 #include "types.h"
 #include "utils.h"
+#include "error.h"
 
-/* Allocate a new context. */
-aes_ctx_t *new_aes_ctx(const void *key, unsigned int key_size, aes_mode_t mode) {
-    aes_ctx_t *ctx;
-    
-    if ((ctx = malloc(sizeof(*ctx))) == NULL) {
-        FATAL_ERROR("Failed to allocate aes_ctx_t!");
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_HAVE_AESNI
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+#define AES_CTR_BLOCKS_IN_FLIGHT 8
+
+#ifdef AES_HAVE_AESNI
+static int has_aesni;
+static pthread_once_t has_aesni_once = PTHREAD_ONCE_INIT;
+
+static void aes_detect_aesni(void) {
+    __builtin_cpu_init();
+    has_aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+}
+
+static int aes_cpu_has_aesni(void) {
+    pthread_once(&has_aesni_once, aes_detect_aesni);
+    return has_aesni;
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i aes_expand_key_step(__m128i key, __m128i gen) {
+    gen = _mm_shuffle_epi32(gen, 0xFF);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, gen);
+}
+
+#define AES_EXPAND_KEY(rk, i, rcon) \
+    rk[i] = aes_expand_key_step(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+__attribute__((target("aes,sse2")))
+static void aes_aesni_expand_key(unsigned char round_keys[11][0x10], const void *key_data) {
+    __m128i rk[11];
+    rk[0] = _mm_loadu_si128((const __m128i *)key_data);
+    AES_EXPAND_KEY(rk, 1, 0x01);
+    AES_EXPAND_KEY(rk, 2, 0x02);
+    AES_EXPAND_KEY(rk, 3, 0x04);
+    AES_EXPAND_KEY(rk, 4, 0x08);
+    AES_EXPAND_KEY(rk, 5, 0x10);
+    AES_EXPAND_KEY(rk, 6, 0x20);
+    AES_EXPAND_KEY(rk, 7, 0x40);
+    AES_EXPAND_KEY(rk, 8, 0x80);
+    AES_EXPAND_KEY(rk, 9, 0x1B);
+    AES_EXPAND_KEY(rk, 10, 0x36);
+    for (int i = 0; i < 11; i++)
+        _mm_storeu_si128((__m128i *)round_keys[i], rk[i]);
+}
+
+/* Counter blocks are big-endian 128-bit, kept as host order halves. */
+__attribute__((target("aes,sse2")))
+static inline __m128i aes_ctr_block(uint64_t *hi, uint64_t *lo) {
+    __m128i block = _mm_set_epi64x((long long)__builtin_bswap64(*lo), (long long)__builtin_bswap64(*hi));
+    if (++*lo == 0)
+        ++*hi;
+    return block;
+}
+
+#define AES_CTR_ROUND8(op, k) do { \
+    b0 = op(b0, k); b1 = op(b1, k); b2 = op(b2, k); b3 = op(b3, k); \
+    b4 = op(b4, k); b5 = op(b5, k); b6 = op(b6, k); b7 = op(b7, k); \
+} while (0)
+
+#define AES_CTR_STORE(j, b) \
+    _mm_storeu_si128((__m128i *)(dst + j * 0x10), _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)(src + j * 0x10))))
+
+/* Keeps AES_CTR_BLOCKS_IN_FLIGHT independent blocks in the AES unit to hide aesenc latency.
+   Round keys are reloaded every round, 8 blocks and 11 round keys don't fit in 16 xmm registers. */
+__attribute__((target("aes,sse2")))
+static void aes_ctr_aesni(const aes_ctr_key_t *key, uint64_t *hi, uint64_t *lo, unsigned char *dst, const unsigned char *src, size_t l) {
+    const __m128i *rk = (const __m128i *)key->round_keys;
+
+    while (l >= AES_CTR_BLOCKS_IN_FLIGHT * 0x10) {
+        __m128i k = _mm_loadu_si128(&rk[0]);
+        __m128i b0 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b1 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b2 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b3 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b4 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b5 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b6 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        __m128i b7 = _mm_xor_si128(aes_ctr_block(hi, lo), k);
+        for (int r = 1; r < 10; r++) {
+            k = _mm_loadu_si128(&rk[r]);
+            AES_CTR_ROUND8(_mm_aesenc_si128, k);
+        }
+        k = _mm_loadu_si128(&rk[10]);
+        AES_CTR_ROUND8(_mm_aesenclast_si128, k);
+        AES_CTR_STORE(0, b0);
+        AES_CTR_STORE(1, b1);
+        AES_CTR_STORE(2, b2);
+        AES_CTR_STORE(3, b3);
+        AES_CTR_STORE(4, b4);
+        AES_CTR_STORE(5, b5);
+        AES_CTR_STORE(6, b6);
+        AES_CTR_STORE(7, b7);
+        src += AES_CTR_BLOCKS_IN_FLIGHT * 0x10;
+        dst += AES_CTR_BLOCKS_IN_FLIGHT * 0x10;
+        l -= AES_CTR_BLOCKS_IN_FLIGHT * 0x10;
+    }
+
+    while (l > 0) {
+        unsigned char stream[0x10];
+        size_t n = l < 0x10 ? l : 0x10;
+        __m128i b = _mm_xor_si128(aes_ctr_block(hi, lo), _mm_loadu_si128(&rk[0]));
+        for (int r = 1; r < 10; r++)
+            b = _mm_aesenc_si128(b, _mm_loadu_si128(&rk[r]));
+        _mm_storeu_si128((__m128i *)stream, _mm_aesenclast_si128(b, _mm_loadu_si128(&rk[10])));
+        for (size_t i = 0; i < n; i++)
+            dst[i] = src[i] ^ stream[i];
+        src += n;
+        dst += n;
+        l -= n;
+    }
+}
+
+/* Multiply an XTS tweak by x in GF(2^128), little-endian as per IEEE P1619. */
+__attribute__((target("aes,sse2")))
+static inline __m128i aes_xts_next_tweak(__m128i t) {
+    __m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x93);
+    carry = _mm_and_si128(carry, _mm_set_epi32(1, 1, 1, 0x87));
+    return _mm_xor_si128(_mm_slli_epi32(t, 1), carry);
+}
+
+#define AES_XTS_BLOCK(j, t) \
+    b##j = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + j * 0x10)), t), k)
+
+#define AES_XTS_STORE(j, t) \
+    _mm_storeu_si128((__m128i *)(dst + j * 0x10), _mm_xor_si128(b##j, t))
+
+/* Nintendo tweaks are the sector number as a 128-bit big-endian integer.
+   Up to 8 sector tweaks are encrypted together, then each sector runs 8 blocks in flight. */
+__attribute__((target("aes,sse2")))
+static void aes_xts_aesni(const aes_xts_key_t *key, int decrypt, unsigned char *dst, const unsigned char *src, size_t l, uint64_t sector, size_t sector_size) {
+    const __m128i *rk = (const __m128i *)(decrypt ? key->data_dec_round_keys : key->data_round_keys);
+    const __m128i *tk = (const __m128i *)key->tweak_round_keys;
+    size_t num_sectors = l / sector_size;
+
+    while (num_sectors > 0) {
+        size_t batch = num_sectors < 8 ? num_sectors : 8;
+        __m128i tweaks[8];
+        __m128i k = _mm_loadu_si128(&tk[0]);
+        __m128i b0 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 0), 0), k);
+        __m128i b1 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 1), 0), k);
+        __m128i b2 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 2), 0), k);
+        __m128i b3 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 3), 0), k);
+        __m128i b4 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 4), 0), k);
+        __m128i b5 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 5), 0), k);
+        __m128i b6 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 6), 0), k);
+        __m128i b7 = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(sector + 7), 0), k);
+        for (int r = 1; r < 10; r++) {
+            k = _mm_loadu_si128(&tk[r]);
+            AES_CTR_ROUND8(_mm_aesenc_si128, k);
+        }
+        k = _mm_loadu_si128(&tk[10]);
+        AES_CTR_ROUND8(_mm_aesenclast_si128, k);
+        tweaks[0] = b0; tweaks[1] = b1; tweaks[2] = b2; tweaks[3] = b3;
+        tweaks[4] = b4; tweaks[5] = b5; tweaks[6] = b6; tweaks[7] = b7;
+
+        for (size_t s = 0; s < batch; s++) {
+            __m128i t = tweaks[s];
+            size_t left = sector_size;
+            while (left >= 8 * 0x10) {
+                __m128i t0 = t;
+                __m128i t1 = aes_xts_next_tweak(t0);
+                __m128i t2 = aes_xts_next_tweak(t1);
+                __m128i t3 = aes_xts_next_tweak(t2);
+                __m128i t4 = aes_xts_next_tweak(t3);
+                __m128i t5 = aes_xts_next_tweak(t4);
+                __m128i t6 = aes_xts_next_tweak(t5);
+                __m128i t7 = aes_xts_next_tweak(t6);
+                t = aes_xts_next_tweak(t7);
+                k = _mm_loadu_si128(&rk[0]);
+                AES_XTS_BLOCK(0, t0); AES_XTS_BLOCK(1, t1); AES_XTS_BLOCK(2, t2); AES_XTS_BLOCK(3, t3);
+                AES_XTS_BLOCK(4, t4); AES_XTS_BLOCK(5, t5); AES_XTS_BLOCK(6, t6); AES_XTS_BLOCK(7, t7);
+                if (decrypt) {
+                    for (int r = 1; r < 10; r++) {
+                        k = _mm_loadu_si128(&rk[r]);
+                        AES_CTR_ROUND8(_mm_aesdec_si128, k);
+                    }
+                    k = _mm_loadu_si128(&rk[10]);
+                    AES_CTR_ROUND8(_mm_aesdeclast_si128, k);
+                } else {
+                    for (int r = 1; r < 10; r++) {
+                        k = _mm_loadu_si128(&rk[r]);
+                        AES_CTR_ROUND8(_mm_aesenc_si128, k);
+                    }
+                    k = _mm_loadu_si128(&rk[10]);
+                    AES_CTR_ROUND8(_mm_aesenclast_si128, k);
+                }
+                AES_XTS_STORE(0, t0); AES_XTS_STORE(1, t1); AES_XTS_STORE(2, t2); AES_XTS_STORE(3, t3);
+                AES_XTS_STORE(4, t4); AES_XTS_STORE(5, t5); AES_XTS_STORE(6, t6); AES_XTS_STORE(7, t7);
+                src += 8 * 0x10;
+                dst += 8 * 0x10;
+                left -= 8 * 0x10;
+            }
+            while (left > 0) {
+                k = _mm_loadu_si128(&rk[0]);
+                AES_XTS_BLOCK(0, t);
+                for (int r = 1; r < 10; r++)
+                    b0 = decrypt ? _mm_aesdec_si128(b0, _mm_loadu_si128(&rk[r])) : _mm_aesenc_si128(b0, _mm_loadu_si128(&rk[r]));
+                b0 = decrypt ? _mm_aesdeclast_si128(b0, _mm_loadu_si128(&rk[10])) : _mm_aesenclast_si128(b0, _mm_loadu_si128(&rk[10]));
+                AES_XTS_STORE(0, t);
+                t = aes_xts_next_tweak(t);
+                src += 0x10;
+                dst += 0x10;
+                left -= 0x10;
+            }
+        }
+        sector += batch;
+        num_sectors -= batch;
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_xts_aesni_init(aes_xts_key_t *key, const unsigned char *key_data) {
+    aes_aesni_expand_key(key->data_round_keys, key_data);
+    aes_aesni_expand_key(key->tweak_round_keys, key_data + 0x10);
+    _mm_storeu_si128((__m128i *)key->data_dec_round_keys[0], _mm_loadu_si128((const __m128i *)key->data_round_keys[10]));
+    for (int i = 1; i < 10; i++)
+        _mm_storeu_si128((__m128i *)key->data_dec_round_keys[i], _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)key->data_round_keys[10 - i])));
+    _mm_storeu_si128((__m128i *)key->data_dec_round_keys[10], _mm_loadu_si128((const __m128i *)key->data_round_keys[0]));
+    key->use_aesni = 1;
+}
+#endif
+
+/* Set up a key for aes_ctr_crypt, picking AES-NI when the CPU has it. */
+void aes_ctr_key_init(aes_ctr_key_t *key, const void *key_data) {
+    memset(key, 0, sizeof(*key));
+    mbedtls_aes_init(&key->fallback);
+    if (mbedtls_aes_setkey_enc(&key->fallback, key_data, 128)) {
+        mbedtls_aes_free(&key->fallback);
+        nxci_fail("Failed to set key for AES context!");
+    }
+#ifdef AES_HAVE_AESNI
+    if (aes_cpu_has_aesni()) {
+        aes_aesni_expand_key(key->round_keys, key_data);
+        key->use_aesni = 1;
+    }
+#endif
+}
+
+void aes_ctr_key_free(aes_ctr_key_t *key) {
+    mbedtls_aes_free(&key->fallback);
+}
+
+/* CTR is symmetric, same call encrypts and decrypts. */
+void aes_ctr_crypt(const aes_ctr_key_t *key, unsigned char *ctr, void *dst, const void *src, size_t l) {
+    uint64_t hi = 0, lo = 0;
+    for (int i = 0; i < 8; i++) {
+        hi = (hi << 8) | ctr[i];
+        lo = (lo << 8) | ctr[8 + i];
+    }
+
+#ifdef AES_HAVE_AESNI
+    if (key->use_aesni) {
+        aes_ctr_aesni(key, &hi, &lo, (unsigned char *)dst, (const unsigned char *)src, l);
+        for (int i = 7; i >= 0; i--) {
+            ctr[i] = (unsigned char)(hi & 0xFF);
+            ctr[8 + i] = (unsigned char)(lo & 0xFF);
+            hi >>= 8;
+            lo >>= 8;
+        }
+        return;
+    }
+#endif
+
+    /* mbedtls_aes_crypt_ctr wants a mutable context, the key schedule itself is left untouched. */
+    size_t nc_off = 0;
+    unsigned char stream_block[0x10];
+    if (mbedtls_aes_crypt_ctr((mbedtls_aes_context *)&key->fallback, l, &nc_off, ctr, stream_block, (const unsigned char *)src, (unsigned char *)dst)) {
+        nxci_fail("Failed to run AES-CTR!");
+    }
+}
+
+#define AES_POOL_SIZE 16
+
+/* Idle contexts of the calling thread, keyed by key bytes and mode. */
+typedef struct {
+    aes_ctx_t *ctxs[AES_POOL_SIZE];
+    unsigned int num_ctxs;
+} aes_pool_t;
+
+static pthread_key_t aes_pool_key;
+static pthread_once_t aes_pool_once = PTHREAD_ONCE_INIT;
+static int aes_pool_key_failed; /* Raised after pthread_once, never unwound out of it. */
+static atomic_uint_fast64_t aes_key_expansions;
+
+static void aes_pool_destroy(void *arg) {
+    aes_pool_t *pool = arg;
+    for (unsigned int i = 0; i < pool->num_ctxs; i++) {
+        aes_ctx_cleanup(pool->ctxs[i]);
+        free(pool->ctxs[i]);
     }
+    free(pool);
+}
+
+static void aes_pool_key_init(void) {
+    aes_pool_key_failed = pthread_key_create(&aes_pool_key, aes_pool_destroy) != 0;
+}
+
+static aes_pool_t *aes_get_pool(void) {
+    pthread_once(&aes_pool_once, aes_pool_key_init);
+    if (aes_pool_key_failed) {
+        nxci_fail("Failed to create AES context pool!");
+    }
+    aes_pool_t *pool = pthread_getspecific(aes_pool_key);
+    if (pool == NULL) {
+        if ((pool = nxci_calloc(1, sizeof(*pool))) == NULL) {
+            nxci_fail("Failed to allocate AES context pool!");
+        }
+        pthread_setspecific(aes_pool_key, pool);
+    }
+    return pool;
+}
+
+/* Set up a caller-owned context, expanding the key schedules. */
+void aes_ctx_init(aes_ctx_t *ctx, const void *key, unsigned int key_size, aes_mode_t mode) {
+    memset(ctx, 0, sizeof(*ctx));
+    atomic_fetch_add_explicit(&aes_key_expansions, 1, memory_order_relaxed);
 
     mbedtls_cipher_init(&ctx->cipher_dec);
     mbedtls_cipher_init(&ctx->cipher_enc);
     
     if (mbedtls_cipher_setup(&ctx->cipher_dec, mbedtls_cipher_info_from_type(mode))
         || mbedtls_cipher_setup(&ctx->cipher_enc, mbedtls_cipher_info_from_type(mode))) {
-        FATAL_ERROR("Failed to set up AES context!");
+        mbedtls_cipher_free(&ctx->cipher_dec);
+        mbedtls_cipher_free(&ctx->cipher_enc);
+        nxci_fail("Failed to set up AES context!");
     }
         
     if (mbedtls_cipher_setkey(&ctx->cipher_dec, key, key_size * 8, AES_DECRYPT)
         || mbedtls_cipher_setkey(&ctx->cipher_enc, key, key_size * 8, AES_ENCRYPT)) {
-        FATAL_ERROR("Failed to set key for AES context!");
+        mbedtls_cipher_free(&ctx->cipher_dec);
+        mbedtls_cipher_free(&ctx->cipher_enc);
+        nxci_fail("Failed to set key for AES context!");
+    }
+
+    ctx->mode = mode;
+    if (key_size <= sizeof(ctx->key)) {
+        memcpy(ctx->key, key, key_size);
+        ctx->key_size = key_size;
+    }
+    if (mode == AES_MODE_CTR)
+        aes_ctr_key_init(&ctx->ctr_key, key);
+#ifdef AES_HAVE_AESNI
+    if (mode == AES_MODE_XTS && key_size == 0x20 && aes_cpu_has_aesni())
+        aes_xts_aesni_init(&ctx->xts_key, key);
+#endif
+}
+
+void aes_ctx_cleanup(aes_ctx_t *ctx) {
+    mbedtls_cipher_free(&ctx->cipher_dec);
+    mbedtls_cipher_free(&ctx->cipher_enc);
+    if (ctx->mode == AES_MODE_CTR)
+        aes_ctr_key_free(&ctx->ctr_key);
+}
+
+uint64_t aes_get_key_expansion_count(void) {
+    return atomic_load_explicit(&aes_key_expansions, memory_order_relaxed);
+}
+
+/* Get a context, reusing an idle one with the same key schedule when possible. */
+aes_ctx_t *new_aes_ctx(const void *key, unsigned int key_size, aes_mode_t mode) {
+    aes_pool_t *pool = aes_get_pool();
+    aes_ctx_t *ctx;
+
+    for (unsigned int i = 0; i < pool->num_ctxs; i++) {
+        ctx = pool->ctxs[i];
+        if (ctx->mode == mode && ctx->key_size == key_size && memcmp(ctx->key, key, key_size) == 0) {
+            pool->ctxs[i] = pool->ctxs[--pool->num_ctxs];
+            memset(ctx->ctr, 0, sizeof(ctx->ctr));
+            return ctx;
+        }
     }
     
+    if ((ctx = nxci_malloc(sizeof(*ctx))) == NULL) {
+        nxci_fail("Failed to allocate aes_ctx_t!");
+    }
+    nxci_cleanup_t cleanup;
+    nxci_cleanup_push(&cleanup, free, ctx);
+    aes_ctx_init(ctx, key, key_size, mode);
+    nxci_cleanup_pop(&cleanup, 0);
+    
     return ctx;
 }
 
-/* Free an allocated context. */
+/* Release a context to the pool, the oldest idle context is dropped when it's full. */
 void free_aes_ctx(aes_ctx_t *ctx) {
     /* Explicitly allow NULL. */
     if (ctx == NULL) {
         return;
     }
-    
-    mbedtls_cipher_free(&ctx->cipher_dec);
-    mbedtls_cipher_free(&ctx->cipher_enc);
-    free(ctx);
+
+    aes_pool_t *pool = aes_get_pool();
+    if (ctx->key_size == 0) {
+        aes_ctx_cleanup(ctx);
+        free(ctx);
+        return;
+    }
+    if (pool->num_ctxs == AES_POOL_SIZE) {
+        aes_ctx_cleanup(pool->ctxs[0]);
+        free(pool->ctxs[0]);
+        memmove(&pool->ctxs[0], &pool->ctxs[1], (AES_POOL_SIZE - 1) * sizeof(pool->ctxs[0]));
+        pool->num_ctxs--;
+    }
+    pool->ctxs[pool->num_ctxs++] = ctx;
 }
 
 /* Set AES CTR or IV for a context. */
 void aes_setiv(aes_ctx_t *ctx, const void *iv, size_t l) {
+    if (ctx->mode == AES_MODE_CTR && l == sizeof(ctx->ctr)) {
+        memcpy(ctx->ctr, iv, l);
+        return;
+    }
     if (mbedtls_cipher_set_iv(&ctx->cipher_dec, iv, l)
         || mbedtls_cipher_set_iv(&ctx->cipher_enc, iv, l)) {
-        FATAL_ERROR("Failed to set IV for AES context!");
+        nxci_fail("Failed to set IV for AES context!");
     }
 }
 
@@ -56,14 +440,21 @@ void aes_calculate_cmac(void *dst, void *src, size_t size, const void *key) {
         || mbedtls_cipher_cmac_starts(&m_ctx, key, 0x80)
         || mbedtls_cipher_cmac_update(&m_ctx, src, size)
         || mbedtls_cipher_cmac_finish(&m_ctx, dst)) {
-            FATAL_ERROR("Failed to calculate CMAC!");
+            mbedtls_cipher_free(&m_ctx);
+            nxci_fail("Failed to calculate CMAC!");
     }
+    mbedtls_cipher_free(&m_ctx);
 }
 
 
 /* Encrypt with context. */
 void aes_encrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l) {
     size_t out_len = 0;
+
+    if (ctx->mode == AES_MODE_CTR) {
+        aes_ctr_crypt(&ctx->ctr_key, ctx->ctr, dst, src, l);
+        return;
+    }
     
     /* Prepare context */
     mbedtls_cipher_reset(&ctx->cipher_enc);
@@ -90,6 +481,11 @@ void aes_encrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l) {
 /* Decrypt with context. */
 void aes_decrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l) {
     size_t out_len = 0;
+
+    if (ctx->mode == AES_MODE_CTR) {
+        aes_ctr_crypt(&ctx->ctr_key, ctx->ctr, dst, src, l);
+        return;
+    }
     
     /* Prepare context */
     mbedtls_cipher_reset(&ctx->cipher_dec);
@@ -125,9 +521,17 @@ void aes_xts_encrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l, size_
     unsigned char tweak[0x10];
 
     if (l % sector_size != 0) {
-        FATAL_ERROR("Length must be multiple of sectors!");
+        nxci_fail("Length must be multiple of sectors!");
     }
 
+#ifdef AES_HAVE_AESNI
+    /* Sizes that aren't a multiple of the block size need ciphertext stealing, leave those to mbedtls. */
+    if (ctx->xts_key.use_aesni && sector_size % 0x10 == 0) {
+        aes_xts_aesni(&ctx->xts_key, 0, (unsigned char *)dst, (const unsigned char *)src, l, sector, sector_size);
+        return;
+    }
+#endif
+
     for (size_t i = 0; i < l; i += sector_size) {
         /* Workaround for Nintendo's custom sector...manually generate the tweak. */
         get_tweak(tweak, sector++);
@@ -141,8 +545,16 @@ void aes_xts_decrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l, size_
     unsigned char tweak[0x10];
 
     if (l % sector_size != 0) {
-        FATAL_ERROR("Length must be multiple of sectors!");
+        nxci_fail("Length must be multiple of sectors!");
+    }
+
+#ifdef AES_HAVE_AESNI
+    /* Sizes that aren't a multiple of the block size need ciphertext stealing, leave those to mbedtls. */
+    if (ctx->xts_key.use_aesni && sector_size % 0x10 == 0) {
+        aes_xts_aesni(&ctx->xts_key, 1, (unsigned char *)dst, (const unsigned char *)src, l, sector, sector_size);
+        return;
     }
+#endif
 
     for (size_t i = 0; i < l; i += sector_size) {
         /* Workaround for Nintendo's custom sector...manually generate the tweak. */
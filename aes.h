@@ -1,6 +1,8 @@
 #ifndef NXCI_AES_H
 #define NXCI_AES_H
 
+#include <stdint.h>
+#include "mbedtls/aes.h"
 #include "mbedtls/cipher.h"
 #include "mbedtls/cmac.h"
 
@@ -17,20 +19,49 @@ typedef enum {
 } aes_operation_t;
 
 /* Define structs. */
+typedef struct {
+    unsigned char round_keys[11][0x10]; /* AES-NI key schedule. */
+    mbedtls_aes_context fallback; /* Portable path. */
+    int use_aesni;
+} aes_ctr_key_t;
+
+typedef struct {
+    unsigned char data_round_keys[11][0x10];
+    unsigned char data_dec_round_keys[11][0x10]; /* Equivalent inverse cipher schedule. */
+    unsigned char tweak_round_keys[11][0x10];
+    int use_aesni; /* Otherwise the mbedtls XTS context is used. */
+} aes_xts_key_t;
+
 typedef struct {
     mbedtls_cipher_context_t cipher_enc;
     mbedtls_cipher_context_t cipher_dec;
+    aes_mode_t mode;
+    unsigned char key[0x20]; /* Pool lookup key. */
+    unsigned int key_size;
+    aes_ctr_key_t ctr_key; /* CTR mode only. */
+    aes_xts_key_t xts_key; /* XTS mode only. */
+    unsigned char ctr[0x10];
 } aes_ctx_t;
 
 /* Function prototypes. */
 aes_ctx_t *new_aes_ctx(const void *key, unsigned int key_size, aes_mode_t mode);
 void free_aes_ctx(aes_ctx_t *ctx);
 
+/* Caller-owned (e.g. stack) contexts, bypass the pool. */
+void aes_ctx_init(aes_ctx_t *ctx, const void *key, unsigned int key_size, aes_mode_t mode);
+void aes_ctx_cleanup(aes_ctx_t *ctx);
+uint64_t aes_get_key_expansion_count(void);
+
 void aes_setiv(aes_ctx_t *ctx, const void *iv, size_t l);
 
 void aes_encrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l);
 void aes_decrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l);
 
+/* Bulk AES-128-CTR, ctr is the big-endian counter of the first block and is advanced past the data. */
+void aes_ctr_key_init(aes_ctr_key_t *key, const void *key_data);
+void aes_ctr_key_free(aes_ctr_key_t *key);
+void aes_ctr_crypt(const aes_ctr_key_t *key, unsigned char *ctr, void *dst, const void *src, size_t l);
+
 void aes_calculate_cmac(void *dst, void *src, size_t size, const void *key);
 
 void aes_xts_encrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l, size_t sector, size_t sector_size);
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include "arena.h"
+#include "utils.h"
+#include "error.h"
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static unsigned char *arena_block_data(arena_block_t *block) {
+    return (unsigned char *)block + ARENA_HEADER_SIZE;
+}
+
+/* Make the block after block (or the first one) current, it has to fit size. Called with the lock held. */
+static void arena_advance(arena_t *arena, arena_block_t *block, size_t size) {
+    arena_block_t *next = block != NULL ? block->next : arena->first;
+    if (next == NULL || next->size < size) {
+        /* Blocks kept from before a reset are reused, one too small stays behind the new one. */
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block_t *new_block = nxci_malloc(ARENA_HEADER_SIZE + block_size);
+        if (new_block == NULL) {
+            pthread_mutex_unlock(&arena->lock);
+            nxci_fail("Failed to allocate arena block!");
+        }
+        new_block->next = next;
+        new_block->size = block_size;
+        if (block != NULL)
+            block->next = new_block;
+        else
+            arena->first = new_block;
+        arena->num_blocks++;
+        arena->size += block_size;
+        next = new_block;
+    }
+    atomic_store(&next->used, 0);
+    atomic_store(&arena->cur, next);
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    while (1) {
+        arena_block_t *block = atomic_load(&arena->cur);
+        if (block != NULL) {
+            size_t offset = atomic_fetch_add(&block->used, size);
+            if (offset + size <= block->size) {
+                unsigned char *data = arena_block_data(block) + offset;
+                memset(data, 0, size);
+                return data;
+            }
+        }
+        pthread_mutex_lock(&arena->lock);
+        /* Someone else may have moved on already. */
+        if (atomic_load(&arena->cur) == block)
+            arena_advance(arena, block, size);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+char *arena_strdup(arena_t *arena, const char *str) {
+    size_t len = strlen(str);
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+char *arena_printf(arena_t *arena, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    char *str = arena_alloc(arena, len + 1);
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
+void arena_reset(arena_t *arena) {
+    if (arena->first != NULL)
+        atomic_store(&arena->first->used, 0);
+    atomic_store(&arena->cur, arena->first);
+}
+
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->first;
+    while (block != NULL) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    atomic_store(&arena->cur, NULL);
+    arena->num_blocks = 0;
+    arena->size = 0;
+}
+
+void arena_print_stats(FILE *f, arena_t *arena, const char *name) {
+    fprintf(f, "%s arena: %" PRIu64 " bytes in %" PRIu64 " blocks\n", name, arena->size, arena->num_blocks);
+}
@@ -0,0 +1,41 @@
+#ifndef NXCI_ARENA_H
+#define NXCI_ARENA_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "types.h"
+
+#define ARENA_BLOCK_SIZE 0x10000
+#define ARENA_ALIGN 16
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    atomic_size_t used; /* Can run past size, the block is full then. */
+} arena_block_t;
+
+/* Bump allocator for everything describing one cart: names, paths, hashes and NCA contexts.
+   Nothing is freed on its own, arena_reset drops it all at once and keeps the blocks for the next cart. */
+typedef struct {
+    _Atomic(arena_block_t *) cur;
+    arena_block_t *first;
+    pthread_mutex_t lock; /* Only taken to move on to another block. */
+    uint64_t num_blocks;
+    uint64_t size; /* Bytes in blocks. */
+} arena_t;
+
+#define ARENA_INITIALIZER {.lock = PTHREAD_MUTEX_INITIALIZER}
+
+/* Zeroed and ARENA_ALIGN aligned, safe to call from several threads at once. */
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+char *arena_printf(arena_t *arena, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* O(1), nothing allocated before it may be used afterwards. Not thread safe. */
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+void arena_print_stats(FILE *f, arena_t *arena, const char *name);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "scheduler.h"
+#include "filepath.h"
+#include "utils.h"
+
+typedef struct {
+    nxci_task_t task;
+    char input_path[MAX_PATH + 1];
+    char output_dir[MAX_PATH + 1];
+    const char *name; /* Output directory name, prefixes the cart's log lines. */
+    int skipped; /* Never submitted, error says why. */
+} batch_item_t;
+
+/* Kept in one place so it can still be freed after an error unwound batch_run. */
+typedef struct {
+    char **paths;
+    unsigned int num_paths;
+    unsigned int capacity;
+    batch_item_t *items;
+} batch_t;
+
+static pthread_mutex_t batch_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void batch_print(const char *name, const char *text) {
+    pthread_mutex_lock(&batch_log_lock);
+    /* Every line gets the cart's name, blank ones are dropped. */
+    while (*text != '\0') {
+        const char *end = strchr(text, '\n');
+        size_t len = end != NULL ? (size_t)(end - text) + 1 : strlen(text);
+        if (len > 1 || end == NULL)
+            printf("[%s] %.*s", name, (int)len, text);
+        text += len;
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&batch_log_lock);
+}
+
+static void batch_add(batch_t *batch, const char *path) {
+    if (batch->num_paths == batch->capacity) {
+        unsigned int capacity = batch->capacity != 0 ? batch->capacity * 2 : 16;
+        char **paths = realloc(batch->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            nxci_fail("Failed to allocate batch!");
+        }
+        batch->paths = paths;
+        batch->capacity = capacity;
+    }
+    if ((batch->paths[batch->num_paths] = strdup(path)) == NULL) {
+        nxci_fail("Failed to allocate batch!");
+    }
+    batch->num_paths++;
+}
+
+int batch_is_xci(const char *name) {
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".xci") == 0;
+}
+
+static int batch_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Inputs as given, directories replaced by the XCIs directly in them. */
+static void batch_collect(batch_t *batch, char **inputs, unsigned int num_inputs) {
+    for (unsigned int i = 0; i < num_inputs; i++) {
+        struct stat st;
+        if (stat(inputs[i], &st) != 0 || !S_ISDIR(st.st_mode)) {
+            batch_add(batch, inputs[i]);
+            continue;
+        }
+        DIR *dir = opendir(inputs[i]);
+        if (dir == NULL) {
+            nxci_fail("unable to open %s: %s", inputs[i], strerror(errno));
+        }
+        unsigned int first = batch->num_paths;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (!batch_is_xci(entry->d_name))
+                continue;
+            char path[MAX_PATH + 1];
+            snprintf(path, sizeof(path), "%s" OS_PATH_SEPARATOR "%s", inputs[i], entry->d_name);
+            batch_add(batch, path);
+        }
+        closedir(dir);
+        qsort(batch->paths + first, batch->num_paths - first, sizeof(char *), batch_compare);
+    }
+}
+
+static void batch_log(void *user, const char *text) {
+    batch_item_t *item = user;
+    batch_print(item->name, text);
+}
+
+static void batch_done(nxci_task_t *task, void *user) {
+    batch_item_t *item = user;
+    pthread_mutex_lock(&batch_log_lock);
+    if (task->status == NXCI_OK)
+        printf("[%s] Done! %s\n", item->name, task->job.nsp_path);
+    else
+        fprintf(stderr, "[%s] %s\n", item->name, task->job.error);
+    fflush(stdout);
+    pthread_mutex_unlock(&batch_log_lock);
+    if (task->status != NXCI_OK && !item->skipped) {
+        // The partial nsp is gone, only its directory is left
+        filepath_t dir_path;
+        filepath_set(&dir_path, item->output_dir);
+        os_rmdir(dir_path.os_path);
+    }
+    arena_free(&task->job.arena);
+}
+
+/* Output directory for path under output_root, named after its file and made unique within the batch. */
+static void batch_prepare(batch_item_t *items, unsigned int index, const char *path, const char *output_root) {
+    batch_item_t *item = &items[index];
+    char name[MAX_PATH + 1];
+    const char *base = path + strlen(path);
+    while (base > path && base[-1] != '/' && base[-1] != '\\')
+        base--;
+    snprintf(name, sizeof(name), "%s", base);
+    strip_ext(name);
+
+    snprintf(item->input_path, sizeof(item->input_path), "%s", path);
+    nxci_job_init(&item->task.job, item->input_path, item->output_dir);
+    item->task.job.log = batch_log;
+    item->task.job.user = item;
+    item->task.done = batch_done;
+    item->task.user = item;
+
+    size_t root_len = strlen(output_root) + 1;
+    if (root_len + strlen(name) + 8 >= MAX_PATH) {
+        snprintf(item->task.job.error, sizeof(item->task.job.error), "Output path too long for %s", path);
+        item->name = base;
+        item->task.status = NXCI_ERROR;
+        item->skipped = 1;
+        return;
+    }
+    for (unsigned int n = 1;; n++) {
+        if (n == 1)
+            snprintf(item->output_dir, sizeof(item->output_dir), "%s" OS_PATH_SEPARATOR "%s", output_root, name);
+        else
+            snprintf(item->output_dir, sizeof(item->output_dir), "%s" OS_PATH_SEPARATOR "%s_%u", output_root, name, n);
+        unsigned int i;
+        for (i = 0; i < index; i++) {
+            if (strcmp(items[i].output_dir, item->output_dir) == 0)
+                break;
+        }
+        if (i == index)
+            break;
+    }
+    item->name = item->output_dir + root_len;
+
+    filepath_t dir_path;
+    filepath_set(&dir_path, item->output_dir);
+    if (os_makedir(dir_path.os_path) != 0 && errno != EEXIST) {
+        snprintf(item->task.job.error, sizeof(item->task.job.error), "unable to create %s: %s", item->output_dir, strerror(errno));
+        item->task.status = NXCI_ERROR;
+        item->skipped = 1;
+    }
+}
+
+static void batch_free(batch_t *batch) {
+    for (unsigned int i = 0; i < batch->num_paths; i++)
+        free(batch->paths[i]);
+    free(batch->paths);
+    free(batch->items);
+}
+
+int batch_run(const nxci_settings_t *settings, char **inputs, unsigned int num_inputs, const char *output_root, unsigned int num_jobs, unsigned int per_device) {
+    batch_t batch = {0};
+    nxci_sched_t sched;
+
+    nxci_catch_t frame;
+    nxci_catch_enter(&frame);
+    if (setjmp(frame.env) == 0) {
+        batch_collect(&batch, inputs, num_inputs);
+        if (batch.num_paths == 0) {
+            nxci_fail("No XCI to convert");
+        }
+        filepath_t root_path;
+        filepath_set(&root_path, output_root);
+        if (os_makedir(root_path.os_path) != 0 && errno != EEXIST) {
+            nxci_fail("unable to create %s: %s", output_root, strerror(errno));
+        }
+        if ((batch.items = calloc(batch.num_paths, sizeof(batch_item_t))) == NULL) {
+            nxci_fail("Failed to allocate batch!");
+        }
+        batch_item_t *items = batch.items;
+        for (unsigned int i = 0; i < batch.num_paths; i++)
+            batch_prepare(items, i, batch.paths[i], output_root);
+
+        if (nxci_sched_init(&sched, settings, num_jobs, per_device) != NXCI_OK) {
+            nxci_fail("Failed to start conversion threads!");
+        }
+        printf("Converting %u carts into %s\n", batch.num_paths, output_root);
+        for (unsigned int i = 0; i < batch.num_paths; i++) {
+            if (items[i].skipped)
+                batch_done(&items[i].task, &items[i]);
+            else
+                nxci_sched_submit(&sched, &items[i].task);
+        }
+        nxci_sched_wait(&sched);
+        nxci_sched_free(&sched);
+        nxci_catch_leave(&frame);
+
+        int failed = 0;
+        for (unsigned int i = 0; i < batch.num_paths; i++) {
+            if (items[i].skipped || items[i].task.status != NXCI_OK)
+                failed++;
+        }
+        printf("Converted %u of %u carts\n", batch.num_paths - failed, batch.num_paths);
+        for (unsigned int i = 0; i < batch.num_paths; i++) {
+            if (items[i].skipped || items[i].task.status != NXCI_OK)
+                fprintf(stderr, "Failed: %s: %s\n", items[i].input_path, items[i].task.job.error);
+        }
+        batch_free(&batch);
+        return failed;
+    }
+    fprintf(stderr, "%s\n", frame.message);
+    batch_free(&batch);
+    return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef NXCI_BATCH_H
+#define NXCI_BATCH_H
+
+#include "types.h"
+#include "settings.h"
+
+/* Convert every input (directories contribute the XCIs in them) into its own directory under output_root,
+   named after the input. Returns the number of carts that failed, -1 if the batch couldn't run at all. */
+int batch_run(const nxci_settings_t *settings, char **inputs, unsigned int num_inputs, const char *output_root, unsigned int num_jobs, unsigned int per_device);
+
+/* Whether name ends in .xci, in any case. */
+int batch_is_xci(const char *name);
+/* Print text with every line prefixed by [name], whole lines never interleave with another cart's. */
+void batch_print(const char *name, const char *text);
+
+#endif
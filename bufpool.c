@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "bufpool.h"
+#include "utils.h"
+#include "error.h"
+
+typedef struct {
+    unsigned char *data;
+    uint64_t size;
+    int in_use;
+    int huge; /* Backed by hugetlbfs pages. */
+} bufpool_region_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signalled whenever a region is given back. */
+    uint64_t limit; /* 0 for no limit. */
+    uint64_t total; /* Bytes in regions, idle or not. */
+    uint64_t in_use;
+    bufpool_region_t regions[BUFPOOL_MAX_REGIONS];
+    unsigned int num_regions;
+    /* Stats. */
+    uint64_t peak;
+    uint64_t waits;
+    uint64_t shrunk; /* Requests granted less than they wanted. */
+    uint64_t huge_bytes;
+} bufpool_t;
+
+static bufpool_t bufpool = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static void *bufpool_map(uint64_t size, int *huge) {
+    *huge = 0;
+#ifdef _WIN32
+    return nxci_aligned_malloc(size, BUFPOOL_ALIGN);
+#else
+    void *data;
+#ifdef MAP_HUGETLB
+    /* Only works with hugepages reserved, fails straight away otherwise. */
+    if (size % BUFPOOL_HUGE_SIZE == 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED) {
+            *huge = 1;
+            return data;
+        }
+    }
+#endif
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (size >= BUFPOOL_HUGE_SIZE)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    return data;
+#endif
+}
+
+static void bufpool_unmap(bufpool_region_t *region) {
+#ifdef _WIN32
+    nxci_aligned_free(region->data);
+#else
+    munmap(region->data, region->size);
+#endif
+    bufpool.total -= region->size;
+    *region = bufpool.regions[--bufpool.num_regions];
+}
+
+void bufpool_set_limit(uint64_t max_memory) {
+    pthread_mutex_lock(&bufpool.lock);
+    bufpool.limit = max_memory;
+    pthread_mutex_unlock(&bufpool.lock);
+}
+
+uint64_t bufpool_get_limit(void) {
+    pthread_mutex_lock(&bufpool.lock);
+    uint64_t limit = bufpool.limit;
+    pthread_mutex_unlock(&bufpool.lock);
+    return limit;
+}
+
+/* Size in [min, want] a new region could have once idle regions are dropped, or 0 if it has to wait. */
+static uint64_t bufpool_room(uint64_t want, uint64_t min) {
+    if (bufpool.num_regions == BUFPOOL_MAX_REGIONS) {
+        unsigned int idle = 0;
+        for (unsigned int i = 0; i < bufpool.num_regions; i++)
+            idle += !bufpool.regions[i].in_use;
+        if (idle == 0)
+            return 0;
+    }
+    if (bufpool.limit == 0)
+        return want;
+    /* Bigger than the whole budget, goes through once nothing else is held. */
+    if (min > bufpool.limit)
+        return bufpool.in_use == 0 ? min : 0;
+    uint64_t room = bufpool.limit - bufpool.in_use;
+    if (room < min)
+        return 0;
+    uint64_t size = room < want ? room : want;
+    size &= ~(uint64_t)(BUFPOOL_ALIGN - 1);
+    if (size >= BUFPOOL_HUGE_SIZE)
+        size &= ~(uint64_t)(BUFPOOL_HUGE_SIZE - 1);
+    return size < min ? min : size;
+}
+
+static void *bufpool_take(bufpool_region_t *region, uint64_t want, uint64_t *size) {
+    region->in_use = 1;
+    bufpool.in_use += region->size;
+    if (region->size < want)
+        bufpool.shrunk++;
+    *size = region->size < want ? region->size : want;
+    return region->data;
+}
+
+void *bufpool_get(uint64_t want, uint64_t min, uint64_t *size) {
+    min = min != 0 ? align64(min, BUFPOOL_ALIGN) : BUFPOOL_ALIGN;
+    want = align64(want < min ? min : want, BUFPOOL_ALIGN);
+    pthread_mutex_lock(&bufpool.lock);
+    int waited = 0;
+    void *data;
+    while (1) {
+        /* Smallest idle region covering want, else the largest one covering min. */
+        bufpool_region_t *fit = NULL, *largest = NULL;
+        for (unsigned int i = 0; i < bufpool.num_regions; i++) {
+            bufpool_region_t *region = &bufpool.regions[i];
+            if (region->in_use || region->size < min)
+                continue;
+            if (region->size >= want && (fit == NULL || region->size < fit->size))
+                fit = region;
+            if (largest == NULL || region->size > largest->size)
+                largest = region;
+        }
+        if (fit != NULL) {
+            data = bufpool_take(fit, want, size);
+            break;
+        }
+
+        uint64_t new_size = bufpool_room(want, min);
+        if (new_size != 0 && (largest == NULL || new_size > largest->size)) {
+            /* Idle regions make way for the new one. */
+            for (unsigned int i = bufpool.num_regions; i-- > 0;) {
+                if (bufpool.num_regions < BUFPOOL_MAX_REGIONS && (bufpool.limit == 0 || bufpool.total + new_size <= bufpool.limit))
+                    break;
+                if (!bufpool.regions[i].in_use)
+                    bufpool_unmap(&bufpool.regions[i]);
+            }
+            bufpool_region_t *region = &bufpool.regions[bufpool.num_regions++];
+            memset(region, 0, sizeof(*region));
+            region->size = new_size;
+            if ((region->data = bufpool_map(new_size, &region->huge)) == NULL) {
+                bufpool.num_regions--;
+                pthread_mutex_unlock(&bufpool.lock);
+                nxci_fail("Failed to allocate %" PRIu64 " byte buffer!", new_size);
+            }
+            bufpool.total += new_size;
+            if (region->huge)
+                bufpool.huge_bytes += new_size;
+            if (bufpool.total > bufpool.peak)
+                bufpool.peak = bufpool.total;
+            data = bufpool_take(region, want, size);
+            break;
+        }
+        if (largest != NULL) {
+            data = bufpool_take(largest, want, size);
+            break;
+        }
+
+        if (!waited)
+            bufpool.waits++;
+        waited = 1;
+        pthread_cond_wait(&bufpool.cond, &bufpool.lock);
+    }
+    pthread_mutex_unlock(&bufpool.lock);
+    return data;
+}
+
+void bufpool_put(void *region) {
+    if (region == NULL)
+        return;
+    pthread_mutex_lock(&bufpool.lock);
+    for (unsigned int i = 0; i < bufpool.num_regions; i++) {
+        if (bufpool.regions[i].data == region) {
+            bufpool.regions[i].in_use = 0;
+            bufpool.in_use -= bufpool.regions[i].size;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&bufpool.cond);
+    pthread_mutex_unlock(&bufpool.lock);
+}
+
+void *bufpool_get_buffers(uint64_t *buffer_size, unsigned int *count) {
+    uint64_t size = align64(*buffer_size, BUFPOOL_ALIGN);
+    unsigned int n = *count != 0 ? *count : 1;
+    uint64_t min = size < BUFPOOL_MIN_BUFFER ? size : BUFPOOL_MIN_BUFFER;
+    uint64_t granted;
+    void *region = bufpool_get(size * n, min, &granted);
+    if (granted < size * n) {
+        /* Fewer buffers rather than tiny ones, then share out what was granted. */
+        if (n > granted / min)
+            n = granted / min;
+        size = (granted / n) & ~(uint64_t)(BUFPOOL_ALIGN - 1);
+    }
+    *buffer_size = size;
+    *count = n;
+    return region;
+}
+
+void bufpool_print_stats(FILE *f) {
+    pthread_mutex_lock(&bufpool.lock);
+    if (bufpool.limit != 0)
+        fprintf(f, "Buffer pool: %" PRIu64 " of %" PRIu64 " bytes at peak", bufpool.peak, bufpool.limit);
+    else
+        fprintf(f, "Buffer pool: %" PRIu64 " bytes at peak", bufpool.peak);
+    fprintf(f, ", %" PRIu64 " waits, %" PRIu64 " shrunk requests, %" PRIu64 " bytes on hugepages\n", bufpool.waits, bufpool.shrunk, bufpool.huge_bytes);
+    pthread_mutex_unlock(&bufpool.lock);
+}
@@ -0,0 +1,28 @@
+#ifndef NXCI_BUFPOOL_H
+#define NXCI_BUFPOOL_H
+
+#include <stdio.h>
+#include "types.h"
+
+#define BUFPOOL_ALIGN 0x1000 /* Regions and the buffers carved from them stay direct I/O aligned. */
+#define BUFPOOL_MIN_BUFFER 0x10000 /* Smallest copy buffer a stage is shrunk to under pressure. */
+#define BUFPOOL_HUGE_SIZE 0x200000
+#define BUFPOOL_MAX_REGIONS 64
+
+/* Every copy and hash stage takes its buffers from one region of this pool.
+   With a limit set, regions (idle cached ones included) never add up to more than it: stages get less than
+   they asked for, or wait for another stage to finish, instead of the process growing. */
+void bufpool_set_limit(uint64_t max_memory);
+uint64_t bufpool_get_limit(void);
+
+/* Region of at least min and at most want bytes, *size gets what was granted. Blocks until the budget allows it.
+   A thread must give its region back before asking for another, or stages could wait on each other forever. */
+void *bufpool_get(uint64_t want, uint64_t min, uint64_t *size);
+void bufpool_put(void *region);
+
+/* count buffers of buffer_size bytes in one region, both are lowered to what the budget grants. */
+void *bufpool_get_buffers(uint64_t *buffer_size, unsigned int *count);
+
+void bufpool_print_stats(FILE *f);
+
+#endif
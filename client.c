@@ -0,0 +1,231 @@
+#include <getopt.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Submits jobs to 4nxci --serve and prints what comes back, Ctrl-C cancels them. */
+
+#ifdef _WIN32
+
+int main(void) {
+    fprintf(stderr, "4nxci-client isn't supported on Windows\n");
+    return EXIT_FAILURE;
+}
+
+#else
+
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "error.h"
+
+typedef struct {
+    char path[PATH_MAX];
+    const char *name;
+    unsigned int percent;
+    int done;
+} client_job_t;
+
+static volatile sig_atomic_t client_interrupted;
+
+static void client_signal(int sig) {
+    (void)sig;
+    client_interrupted = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: 4nxci-client [options...] <convert|scan|verify> <filename.xci>...\n"
+        "Options:\n"
+        "--socket=PATH          Socket 4nxci --serve listens on (default: %s)\n"
+        "-o, --output=DIR       Directory the nsps are written to (default: .)\n"
+        "--priority=N           Jobs with a higher priority start first (default: 0)\n"
+        "Ctrl-C cancels the jobs, a second one leaves without waiting for them\n", NXCI_DEFAULT_SOCKET);
+    exit(EXIT_FAILURE);
+}
+
+static void client_print(const client_job_t *job, const char *text, size_t size) {
+    while (size != 0) {
+        const char *end = memchr(text, '\n', size);
+        size_t len = end != NULL ? (size_t)(end - text) + 1 : size;
+        if (len > 1 || end == NULL)
+            printf("[%s] %.*s%s", job->name, (int)len, text, end != NULL ? "" : "\n");
+        text += len;
+        size -= len;
+    }
+}
+
+static int client_submit(int fd, uint32_t id, uint32_t kind, int32_t priority, const char *input_path, const char *output_dir) {
+    char body[NXCI_MSG_MAX_SIZE];
+    nxci_msg_submit_t submit = {kind, priority};
+    size_t input_len = strlen(input_path) + 1, output_len = strlen(output_dir) + 1;
+    if (sizeof(submit) + input_len + output_len > sizeof(body))
+        return -1;
+    memcpy(body, &submit, sizeof(submit));
+    memcpy(body + sizeof(submit), input_path, input_len);
+    memcpy(body + sizeof(submit) + input_len, output_dir, output_len);
+    return nxci_msg_send(fd, NXCI_MSG_SUBMIT, id, body, sizeof(submit) + input_len + output_len);
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = NXCI_DEFAULT_SOCKET;
+    const char *output = ".";
+    int32_t priority = 0;
+
+    while (1) {
+        int option_index;
+        static struct option long_options[] =
+        {
+            {"socket", 1, NULL, 1},
+            {"output", 1, NULL, 'o'},
+            {"priority", 1, NULL, 2},
+            {NULL, 0, NULL, 0},
+        };
+        int c = getopt_long(argc, argv, "o:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 1:
+                socket_path = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 2:
+                priority = strtol(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind < 2)
+        usage();
+
+    static const char *kinds[] = {"convert", "scan", "verify"};
+    uint32_t kind;
+    for (kind = 0; kind < 3; kind++) {
+        if (strcmp(argv[optind], kinds[kind]) == 0)
+            break;
+    }
+    if (kind == 3)
+        usage();
+    optind++;
+
+    // The daemon may run from anywhere, so it gets absolute paths
+    char output_dir[PATH_MAX];
+    if (realpath(output, output_dir) == NULL) {
+        fprintf(stderr, "unable to open %s: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    unsigned int num_jobs = argc - optind;
+    client_job_t *jobs = calloc(num_jobs, sizeof(client_job_t));
+    if (jobs == NULL) {
+        fprintf(stderr, "Failed to allocate jobs!\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < num_jobs; i++) {
+        const char *input = argv[optind + i];
+        if (realpath(input, jobs[i].path) == NULL) {
+            fprintf(stderr, "unable to open %s: %s\n", input, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        const char *base = strrchr(jobs[i].path, '/');
+        jobs[i].name = base != NULL ? base + 1 : jobs[i].path;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "unable to connect to %s: %s\n", socket_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = client_signal;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (unsigned int i = 0; i < num_jobs; i++) {
+        if (client_submit(fd, i, kind, priority, jobs[i].path, kind == NXCI_JOB_CONVERT ? output_dir : "") != 0) {
+            fprintf(stderr, "Lost connection to %s\n", socket_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    unsigned int remaining = num_jobs, failed = 0;
+    int cancelled = 0;
+    while (remaining != 0) {
+        if (client_interrupted && !cancelled) {
+            fprintf(stderr, "Cancelling\n");
+            for (unsigned int i = 0; i < num_jobs; i++) {
+                if (!jobs[i].done)
+                    nxci_msg_send(fd, NXCI_MSG_CANCEL, i, NULL, 0);
+            }
+            cancelled = 1;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        nxci_msg_header_t header;
+        char body[NXCI_MSG_MAX_SIZE + 1];
+        if (nxci_msg_recv(fd, &header, body) != 0) {
+            fprintf(stderr, "Lost connection to %s\n", socket_path);
+            break;
+        }
+        if (header.id >= num_jobs)
+            continue;
+        client_job_t *job = &jobs[header.id];
+        body[header.size] = '\0';
+
+        if (header.type == NXCI_MSG_PROGRESS && header.size == sizeof(nxci_msg_progress_t)) {
+            nxci_msg_progress_t progress;
+            memcpy(&progress, body, sizeof(progress));
+            unsigned int percent = progress.total != 0 ? (unsigned int)(progress.done * 100 / progress.total) : 0;
+            if (percent / 10 != job->percent / 10)
+                printf("[%s] %u%%\n", job->name, percent);
+            job->percent = percent;
+        } else if (header.type == NXCI_MSG_LOG) {
+            client_print(job, body, header.size);
+        } else if (header.type == NXCI_MSG_DONE && header.size > sizeof(nxci_msg_done_t) && !job->done) {
+            nxci_msg_done_t done;
+            memcpy(&done, body, sizeof(done));
+            done.title_id[sizeof(done.title_id) - 1] = '\0';
+            const char *nsp_path = body + sizeof(done);
+            const char *error = nsp_path + strlen(nsp_path) + 1;
+            if (error >= body + header.size)
+                error = "";
+            if (done.status == NXCI_OK && nsp_path[0] != '\0') {
+                printf("[%s] Done! %s\n", job->name, nsp_path);
+            } else if (done.status == NXCI_OK) {
+                printf("[%s] Done!\n", job->name);
+            } else {
+                fprintf(stderr, "[%s] %s\n", job->name, error);
+                failed++;
+            }
+            job->done = 1;
+            remaining--;
+        }
+        fflush(stdout);
+    }
+    close(fd);
+    free(jobs);
+    return remaining == 0 && failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
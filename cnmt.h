@@ -56,7 +56,5 @@ typedef struct {
 	uint8_t padding[0xA8];
 } pfs0_t;
 
-extern cnmt_xml_t cnmt_xml;
-extern application_cnmt_content_t application_cnmt_contents[3];
 
 #endif
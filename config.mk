@@ -0,0 +1,3 @@
+CC = gcc
+CFLAGS = -O2 -Wall -Wextra -pedantic -std=gnu11 -fPIC
+LDFLAGS = -lmbedtls -lmbedx509 -lmbedcrypto
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "error.h"
+
+static _Thread_local nxci_catch_t *nxci_catch_top;
+static _Thread_local nxci_cleanup_t *nxci_cleanup_top;
+
+void nxci_catch_enter(nxci_catch_t *frame) {
+    frame->prev = nxci_catch_top;
+    frame->cleanups = nxci_cleanup_top;
+    frame->status = NXCI_OK;
+    frame->message[0] = '\0';
+    nxci_catch_top = frame;
+}
+
+void nxci_catch_leave(nxci_catch_t *frame) {
+    nxci_catch_top = frame->prev;
+}
+
+static void nxci_unwind(nxci_status_t status, const char *fmt, va_list args) __attribute__((noreturn));
+
+static void nxci_unwind(nxci_status_t status, const char *fmt, va_list args) {
+    nxci_catch_t *frame = nxci_catch_top;
+    if (frame == NULL) {
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, "\n");
+        exit(EXIT_FAILURE);
+    }
+    /* Keep the first error, not one from a cleanup run because of it. */
+    if (frame->status == NXCI_OK) {
+        vsnprintf(frame->message, sizeof(frame->message), fmt, args);
+        frame->status = status;
+    }
+
+    /* A cleanup failing in turn unwinds to the same frame, so it's popped before it runs. */
+    while (nxci_cleanup_top != frame->cleanups) {
+        nxci_cleanup_t *cleanup = nxci_cleanup_top;
+        nxci_cleanup_top = cleanup->prev;
+        cleanup->func(cleanup->arg);
+    }
+    nxci_catch_top = frame->prev;
+    longjmp(frame->env, 1);
+}
+
+void nxci_fail(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    nxci_unwind(NXCI_ERROR, fmt, args);
+}
+
+void nxci_fail_status(nxci_status_t status, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    nxci_unwind(status, fmt, args);
+}
+
+void nxci_cleanup_push(nxci_cleanup_t *cleanup, void (*func)(void *arg), void *arg) {
+    cleanup->func = func;
+    cleanup->arg = arg;
+    cleanup->prev = nxci_cleanup_top;
+    nxci_cleanup_top = cleanup;
+}
+
+void nxci_cleanup_pop(nxci_cleanup_t *cleanup, int run) {
+    nxci_cleanup_top = cleanup->prev;
+    if (run)
+        cleanup->func(cleanup->arg);
+}
@@ -0,0 +1,49 @@
+#ifndef NXCI_ERROR_H
+#define NXCI_ERROR_H
+
+#include <setjmp.h>
+#include "types.h"
+
+#define NXCI_ERROR_SIZE 0x200
+
+typedef enum {
+    NXCI_OK = 0,
+    NXCI_ERROR,
+    NXCI_CANCELLED
+} nxci_status_t;
+
+/* Undone by nxci_fail when it unwinds past the frame that pushed it. */
+typedef struct nxci_cleanup {
+    void (*func)(void *arg);
+    void *arg;
+    struct nxci_cleanup *prev;
+} nxci_cleanup_t;
+
+/* Catch frame, errors raised on the thread while it is entered unwind to its setjmp:
+       nxci_catch_enter(&frame);
+       if (setjmp(frame.env) == 0) {
+           ...
+           nxci_catch_leave(&frame);
+       } else {
+           frame.status and frame.message say what failed, the frame is already left.
+       }
+   Without a frame nxci_fail prints the message and exits, like the tool always did. */
+typedef struct nxci_catch {
+    jmp_buf env;
+    struct nxci_catch *prev;
+    nxci_cleanup_t *cleanups; /* Cleanup stack when the frame was entered. */
+    nxci_status_t status;
+    char message[NXCI_ERROR_SIZE];
+} nxci_catch_t;
+
+void nxci_catch_enter(nxci_catch_t *frame);
+void nxci_catch_leave(nxci_catch_t *frame);
+
+void nxci_fail(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+void nxci_fail_status(nxci_status_t status, const char *fmt, ...) __attribute__((noreturn, format(printf, 2, 3)));
+
+/* Cleanups are popped in the reverse order they were pushed, run says whether func is called. */
+void nxci_cleanup_push(nxci_cleanup_t *cleanup, void (*func)(void *arg), void *arg);
+void nxci_cleanup_pop(nxci_cleanup_t *cleanup, int run);
+
+#endif
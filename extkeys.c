@@ -4,6 +4,7 @@
 #include "pki.h"
 #include "aes.h"
 #include "extkeys.h"
+#include "error.h"
 
 /**
  * Reads a line from file f and parses out the key and value from it.
@@ -152,14 +153,12 @@ static char hextoi(char c) {
 
 void parse_hex_key(unsigned char *key, const char *hex, unsigned int len) {
     if (strlen(hex) != 2 * len) {
-        fprintf(stderr, "Key (%s) must be %"PRIu32" hex digits!\n", hex, 2 * len);
-        exit(EXIT_FAILURE);
+        nxci_fail("Key (%s) must be %"PRIu32" hex digits!", hex, 2 * len);
     }
 
     for (unsigned int i = 0; i < 2 * len; i++) {
         if (!ishex(hex[i])) {
-            fprintf(stderr, "Key (%s) must be %"PRIu32" hex digits!\n", hex, 2 * len);
-            exit(EXIT_FAILURE);
+            nxci_fail("Key (%s) must be %"PRIu32" hex digits!", hex, 2 * len);
         }
     }
 
@@ -6,6 +6,7 @@
 
 #include "types.h"
 #include "filepath.h"
+#include "error.h"
 
 #include "ConvertUTF.h"
 
@@ -26,8 +27,7 @@ void os_strcpy(oschar_t *dst, const char *src) {
     UTF16 *targetEnd = (UTF16 *)(dst + dst_len);
 
     if (ConvertUTF8toUTF16(&sourceStart, sourceEnd, &targetStart, targetEnd, 0) != conversionOK) {
-        fprintf(stderr, "Failed to convert %s to UTF-16!\n", src);
-        exit(EXIT_FAILURE);
+        nxci_fail("Failed to convert %s to UTF-16!", src);
     }
 #else
     strcpy(dst, src);
@@ -2,33 +2,27 @@
 #include <stdio.h>
 #include "hfs0.h"
 #include "nca.h"
+#include "nsp.h"
+#include "lib4nxci.h"
+#include "ncacache.h"
 
 void hfs0_process(hfs0_ctx_t *ctx) {
     /* Read *just* safe amount. */
     hfs0_header_t raw_header; 
-    fseeko64(ctx->file, ctx->offset, SEEK_SET);
-    if (fread(&raw_header, 1, sizeof(raw_header), ctx->file) != sizeof(raw_header)) {
-        fprintf(stderr, "Failed to read HFS0 header!\n");
-        exit(EXIT_FAILURE);
+    if (nxci_io_read_at(ctx->io, &raw_header, sizeof(raw_header), ctx->offset) != sizeof(raw_header)) {
+        nxci_fail("Failed to read HFS0 header!");
     }
     
     if (raw_header.magic != MAGIC_HFS0) {
         memdump(stdout, "Sanity: ", &raw_header, sizeof(raw_header));
-        printf("Error: HFS0 is corrupt!\n");
-        exit(EXIT_FAILURE);
+        nxci_fail("Error: HFS0 is corrupt!");
     }
 
     uint64_t header_size = hfs0_get_header_size(&raw_header);
-    ctx->header = malloc(header_size);
-    if (ctx->header == NULL) {
-        fprintf(stderr, "Failed to allocate HFS0 header!\n");
-        exit(EXIT_FAILURE);
-    }
+    ctx->header = arena_alloc(ctx->tool_ctx->cart->arena, header_size);
     
-    fseeko64(ctx->file, ctx->offset, SEEK_SET);
-    if (fread(ctx->header, 1, header_size, ctx->file) != header_size) {
-        fprintf(stderr, "Failed to read HFS0 header!\n");
-        exit(EXIT_FAILURE);
+    if (nxci_io_read_at(ctx->io, ctx->header, header_size, ctx->offset) != header_size) {
+        nxci_fail("Failed to read HFS0 header!");
     }
     
     /* Weak file validation. */
@@ -38,51 +32,73 @@ void hfs0_process(hfs0_ctx_t *ctx) {
     for (unsigned int i = 0; i < ctx->header->num_files; i++) {
         hfs0_file_entry_t *cur_file = hfs0_get_file_entry(ctx->header, i);
         if (cur_file->offset < cur_ofs) {
-            printf("Error: HFS0 is corrupt!\n");
-            exit(EXIT_FAILURE);
+            nxci_fail("Error: HFS0 is corrupt!");
         }
         cur_ofs += cur_file->size;
     }
     hfs0_save(ctx);
 }
 
-int process_extracted_nca(filepath_t *filepath,nxci_ctx_t *tool)
+// Save an NCA straight from the partition, patching it on the way
+static void hfs0_save_nca(hfs0_ctx_t *ctx, hfs0_file_entry_t *cur_file, filepath_t *filepath)
 {
     nca_ctx_t nca_ctx;
-	 nca_init(&nca_ctx);
-	nca_ctx.tool_ctx = tool;
-	if (!(nca_ctx.file = os_fopen(filepath->os_path, OS_MODE_EDIT))) {
-	        fprintf(stderr, "unable to open %s: %s\n", filepath->os_path, strerror(errno));
-	        return 0;
-	    }
+    nca_init(&nca_ctx);
+    nca_ctx.tool_ctx = ctx->tool_ctx;
+    nca_ctx.io = ctx->io;
+    nca_ctx.file_offset = ctx->offset + hfs0_get_header_size(ctx->header) + cur_file->offset;
+    nca_ctx.file_size = cur_file->size;
 
-    nca_process(&nca_ctx,filepath->char_path);
+    nca_prepare(&nca_ctx);
+    nca_process(&nca_ctx, filepath);
     nca_free_section_contexts(&nca_ctx);
-    return 1;
+}
+
+/* Decrypt the header of every NCA in the partition, nca_ctxs and entries are indexed by nca_type_to_index. */
+void hfs0_prepare_ncas(hfs0_ctx_t *ctx, nca_ctx_t **nca_ctxs, uint32_t *entries)
+{
+    for (int index = 0; index < 4; index++)
+        nca_ctxs[index] = NULL;
+
+    for (uint32_t i = 0; i < ctx->header->num_files; i++) {
+        hfs0_file_entry_t *cur_file = hfs0_get_file_entry(ctx->header, i);
+        nca_ctx_t *nca_ctx = arena_alloc(ctx->tool_ctx->cart->arena, sizeof(nca_ctx_t));
+        nca_init(nca_ctx);
+        nca_ctx->tool_ctx = ctx->tool_ctx;
+        nca_ctx->io = ctx->io;
+        nca_ctx->file_offset = ctx->offset + hfs0_get_header_size(ctx->header) + cur_file->offset;
+        nca_ctx->file_size = cur_file->size;
+        if (ctx->tool_ctx->settings.cache_dir != NULL)
+            nca_ctx->is_cacheable = ncacache_key(ctx, i, nca_ctx->cache_key);
+        int index = nca_prepare(nca_ctx);
+        if (nca_ctxs[index] != NULL) {
+            nxci_fail("Duplicate %s NCA in secure partition!", nca_get_content_type(nca_ctx));
+        }
+        nca_ctxs[index] = nca_ctx;
+        entries[index] = i;
+    }
+    for (int index = 0; index < 4; index++) {
+        if (nca_ctxs[index] == NULL) {
+            nxci_fail("Secure partition is missing an NCA!");
+        }
+    }
 }
 
 void hfs0_save_file(hfs0_ctx_t *ctx, uint32_t i, filepath_t *dirpath) {
     if (i >= ctx->header->num_files) {
-        fprintf(stderr, "Could not save file %"PRId32"!\n", i);
-        exit(EXIT_FAILURE);
+        nxci_fail("Could not save file %"PRId32"!", i);
     }
     hfs0_file_entry_t *cur_file = hfs0_get_file_entry(ctx->header, i);
 
     if (strlen(hfs0_get_file_name(ctx->header, i)) >= MAX_PATH - strlen(dirpath->char_path) - 1) {
-        fprintf(stderr, "Filename too long in HFS0!\n");
-        exit(EXIT_FAILURE);
+        nxci_fail("Filename too long in HFS0!");
     }
 
     filepath_t filepath;
     filepath_copy(&filepath, dirpath);
     filepath_append(&filepath, "%s", hfs0_get_file_name(ctx->header, i));
-    printf("Saving %s to %s\n", hfs0_get_file_name(ctx->header, i), filepath.char_path);
-    uint64_t ofs = hfs0_get_header_size(ctx->header) + cur_file->offset;
-    save_file_section(ctx->file, ctx->offset + ofs, cur_file->size, &filepath);
-    if (!process_extracted_nca(&filepath,ctx->tool_ctx))
-    {
-    	exit(EXIT_FAILURE);
-    }
+    nxci_log(ctx->tool_ctx, "Saving %s to %s\n", hfs0_get_file_name(ctx->header, i), filepath.char_path);
+    hfs0_save_nca(ctx, cur_file, &filepath);
 }
 
 
@@ -24,7 +24,7 @@ typedef struct {
 } hfs0_file_entry_t;
 
 typedef struct {
-    FILE *file;
+    nxci_io_t *io;
     uint64_t offset;
     uint64_t size;
     nxci_ctx_t *tool_ctx;
@@ -49,11 +49,12 @@ static inline char *hfs0_get_file_name(hfs0_header_t *hdr, uint32_t i) {
     return hfs0_get_string_table(hdr) + hfs0_get_file_entry(hdr, i)->string_table_offset;
 }
 
-int process_extracted_nca(filepath_t *filepath,nxci_ctx_t *tool);
-
 void hfs0_process(hfs0_ctx_t *ctx);
 void hfs0_save(hfs0_ctx_t *ctx);
 
 void hfs0_save_file(hfs0_ctx_t *ctx, uint32_t i, filepath_t *dirpath);
 
+struct nca_ctx;
+void hfs0_prepare_ncas(hfs0_ctx_t *ctx, struct nca_ctx **nca_ctxs, uint32_t *entries);
+
 #endif
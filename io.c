@@ -0,0 +1,493 @@
+#define _GNU_SOURCE /* O_DIRECT */
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "io.h"
+#include "utils.h"
+#include "error.h"
+
+static const char *nxci_io_backend_names[] = {"stdio", "pread", "mmap", "uring"};
+
+/* Stdio: one FILE* whose position is shared, so every access seeks under the lock. */
+static size_t stdio_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    pthread_mutex_lock(&io->lock);
+    size_t read = 0;
+    if (fseeko64(io->file, ofs, SEEK_SET) == 0)
+        read = fread(buf, 1, count, io->file);
+    pthread_mutex_unlock(&io->lock);
+    return read;
+}
+
+static size_t stdio_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    pthread_mutex_lock(&io->lock);
+    size_t written = 0;
+    if (fseeko64(io->file, ofs, SEEK_SET) == 0)
+        written = fwrite(buf, 1, count, io->file);
+    pthread_mutex_unlock(&io->lock);
+    return written;
+}
+
+static uint64_t stdio_size(nxci_io_t *io) {
+    pthread_mutex_lock(&io->lock);
+    fseeko64(io->file, 0, SEEK_END);
+    uint64_t size = ftello64(io->file);
+    pthread_mutex_unlock(&io->lock);
+    return size;
+}
+
+static void stdio_hint(nxci_io_t *io, uint64_t ofs, uint64_t len, nxci_io_hint_t hint) {
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    static const int advice[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+    posix_fadvise(fileno(io->file), ofs, len, advice[hint]);
+#else
+    (void)io; (void)ofs; (void)len; (void)hint;
+#endif
+}
+
+static int stdio_close(nxci_io_t *io) {
+    int ret = fclose(io->file);
+    pthread_mutex_destroy(&io->lock);
+    return ret;
+}
+
+static const nxci_io_ops_t stdio_ops = {stdio_read_at, stdio_write_at, stdio_size, stdio_hint, stdio_close};
+
+#ifndef _WIN32
+/* Pread: positional syscalls, no locking needed. */
+static size_t pread_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    size_t read = 0;
+    while (read < count) {
+        ssize_t ret = pread(io->fd, (char *)buf + read, count - read, ofs + read);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        read += ret;
+    }
+    return read;
+}
+
+static size_t pread_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    size_t written = 0;
+    while (written < count) {
+        ssize_t ret = pwrite(io->fd, (const char *)buf + written, count - written, ofs + written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        written += ret;
+    }
+    return written;
+}
+
+static uint64_t pread_size(nxci_io_t *io) {
+    struct stat st;
+    if (fstat(io->fd, &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+static const int pread_advice[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+
+static void pread_hint(nxci_io_t *io, uint64_t ofs, uint64_t len, nxci_io_hint_t hint) {
+    posix_fadvise(io->fd, ofs, len, pread_advice[hint]);
+}
+
+static int pread_close(nxci_io_t *io) {
+    return close(io->fd);
+}
+
+static const nxci_io_ops_t pread_ops = {pread_read_at, pread_write_at, pread_size, pread_hint, pread_close};
+
+/* Direct: the fd bypasses the page cache, so offsets, sizes and buffers have to be NXCI_IO_DIRECT_ALIGN aligned.
+   Anything else goes through a bounce buffer, blocks a write only partly covers are read back and merged. */
+static unsigned char *direct_get_bounce(nxci_io_t *io) {
+    unsigned char *bounce = NULL;
+    pthread_mutex_lock(&io->pool_lock);
+    if (io->num_bounce != 0)
+        bounce = io->bounce[--io->num_bounce];
+    pthread_mutex_unlock(&io->pool_lock);
+    if (bounce == NULL && (bounce = nxci_aligned_malloc(NXCI_IO_BOUNCE_SIZE, NXCI_IO_DIRECT_ALIGN)) == NULL) {
+        nxci_fail("Failed to allocate I/O bounce buffer!");
+    }
+    return bounce;
+}
+
+static void direct_put_bounce(nxci_io_t *io, unsigned char *bounce) {
+    pthread_mutex_lock(&io->pool_lock);
+    if (io->num_bounce < NXCI_IO_BOUNCE_POOL_SIZE) {
+        io->bounce[io->num_bounce++] = bounce;
+        bounce = NULL;
+    }
+    pthread_mutex_unlock(&io->pool_lock);
+    nxci_aligned_free(bounce);
+}
+
+static int direct_is_aligned(const void *buf, size_t count, uint64_t ofs) {
+    return (((uintptr_t)buf | count | ofs) & (NXCI_IO_DIRECT_ALIGN - 1)) == 0;
+}
+
+static size_t direct_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    if (direct_is_aligned(buf, count, ofs))
+        return pread_read_at(io, buf, count, ofs);
+
+    unsigned char *bounce = direct_get_bounce(io);
+    size_t read = 0;
+    while (read < count) {
+        uint64_t window = (ofs + read) & ~(uint64_t)(NXCI_IO_DIRECT_ALIGN - 1);
+        size_t skip = ofs + read - window;
+        size_t len = count - read;
+        if (len > NXCI_IO_BOUNCE_SIZE - skip) len = NXCI_IO_BOUNCE_SIZE - skip;
+        size_t window_size = align64(skip + len, NXCI_IO_DIRECT_ALIGN);
+        size_t got = pread_read_at(io, bounce, window_size, window);
+        if (got <= skip)
+            break;
+        if (got - skip < len) len = got - skip;
+        memcpy((char *)buf + read, bounce + skip, len);
+        read += len;
+        if (got != window_size)
+            break; /* EOF. */
+    }
+    direct_put_bounce(io, bounce);
+    return read;
+}
+
+/* Read a block to merge a partial write into, zero past EOF. */
+static void direct_read_block(nxci_io_t *io, unsigned char *block, uint64_t ofs) {
+    size_t got = pread_read_at(io, block, NXCI_IO_DIRECT_ALIGN, ofs);
+    memset(block + got, 0, NXCI_IO_DIRECT_ALIGN - got);
+}
+
+static size_t direct_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    size_t written = 0;
+    if (direct_is_aligned(buf, count, ofs)) {
+        written = pread_write_at(io, buf, count, ofs);
+    } else {
+        unsigned char *bounce = direct_get_bounce(io);
+        while (written < count) {
+            uint64_t window = (ofs + written) & ~(uint64_t)(NXCI_IO_DIRECT_ALIGN - 1);
+            size_t skip = ofs + written - window;
+            size_t len = count - written;
+            if (len > NXCI_IO_BOUNCE_SIZE - skip) len = NXCI_IO_BOUNCE_SIZE - skip;
+            size_t window_size = align64(skip + len, NXCI_IO_DIRECT_ALIGN);
+            /* Partly covered blocks may be shared with a neighbouring write. */
+            int partial = skip != 0 || window_size != skip + len;
+            if (partial) {
+                pthread_mutex_lock(&io->lock);
+                if (skip != 0)
+                    direct_read_block(io, bounce, window);
+                if (window_size != skip + len && (skip == 0 || window_size > NXCI_IO_DIRECT_ALIGN))
+                    direct_read_block(io, bounce + window_size - NXCI_IO_DIRECT_ALIGN, window + window_size - NXCI_IO_DIRECT_ALIGN);
+            }
+            memcpy(bounce + skip, (const char *)buf + written, len);
+            size_t ret = pread_write_at(io, bounce, window_size, window);
+            if (partial)
+                pthread_mutex_unlock(&io->lock);
+            if (ret != window_size)
+                break;
+            written += len;
+        }
+        direct_put_bounce(io, bounce);
+    }
+
+    pthread_mutex_lock(&io->pool_lock);
+    if (ofs + written > io->end)
+        io->end = ofs + written;
+    pthread_mutex_unlock(&io->pool_lock);
+    return written;
+}
+
+static uint64_t direct_size(nxci_io_t *io) {
+    if (io->mode == NXCI_IO_READ)
+        return pread_size(io);
+    pthread_mutex_lock(&io->pool_lock);
+    uint64_t size = io->end;
+    pthread_mutex_unlock(&io->pool_lock);
+    return size;
+}
+
+static int direct_close(nxci_io_t *io) {
+    int ret = 0;
+    /* Whole blocks were written, drop what's past the real end. */
+    if (io->mode != NXCI_IO_READ)
+        ret = ftruncate(io->fd, io->end);
+    for (unsigned int i = 0; i < io->num_bounce; i++)
+        nxci_aligned_free(io->bounce[i]);
+    pthread_mutex_destroy(&io->lock);
+    pthread_mutex_destroy(&io->pool_lock);
+    if (close(io->fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+static const nxci_io_ops_t direct_ops = {direct_read_at, direct_write_at, direct_size, pread_hint, direct_close};
+
+/* Mmap: the whole (read-only) file is mapped once, reads are plain copies. */
+static size_t mmap_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    if (ofs >= io->map_size)
+        return 0;
+    if (count > io->map_size - ofs)
+        count = io->map_size - ofs;
+    memcpy(buf, io->map + ofs, count);
+    return count;
+}
+
+static size_t mmap_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    (void)io; (void)buf; (void)count; (void)ofs;
+    return 0;
+}
+
+static uint64_t mmap_size(nxci_io_t *io) {
+    return io->map_size;
+}
+
+static void mmap_hint(nxci_io_t *io, uint64_t ofs, uint64_t len, nxci_io_hint_t hint) {
+    static const int advice[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+    if (io->map == NULL || ofs >= io->map_size)
+        return;
+    if (len > io->map_size - ofs)
+        len = io->map_size - ofs;
+    /* madvise wants a page aligned start. */
+    uint64_t page_ofs = ofs & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise(io->map + page_ofs, len + ofs - page_ofs, advice[hint]);
+}
+
+static int mmap_close(nxci_io_t *io) {
+    if (io->map != NULL)
+        munmap(io->map, io->map_size);
+    return close(io->fd);
+}
+
+static const nxci_io_ops_t mmap_ops = {mmap_read_at, mmap_write_at, mmap_size, mmap_hint, mmap_close};
+#endif
+
+/* Open path with the requested backend, returns NULL (with errno set) on failure.
+   Backends that aren't available on this platform fall back to stdio, as does direct I/O on filesystems without it. */
+nxci_io_t *nxci_io_open(const oschar_t *path, nxci_io_mode_t mode, nxci_io_backend_t backend, unsigned int flags) {
+    nxci_io_t *io = nxci_calloc(1, sizeof(*io));
+    if (io == NULL) {
+        nxci_fail("Failed to allocate I/O context!");
+    }
+    io->mode = mode;
+    io->fd = -1;
+
+#ifndef _WIN32
+    /* The page cache is bypassed, so there's nothing to map. */
+    if ((flags & NXCI_IO_FLAG_DIRECT) && backend == NXCI_IO_MMAP)
+        backend = NXCI_IO_PREAD;
+
+    if (backend == NXCI_IO_PREAD || backend == NXCI_IO_MMAP || backend == NXCI_IO_URING) {
+        static const int oflags[] = {O_RDONLY, O_RDWR | O_CREAT | O_TRUNC, O_RDWR};
+#ifdef O_DIRECT
+        if (flags & NXCI_IO_FLAG_DIRECT) {
+            if ((io->fd = open(path, oflags[mode] | O_DIRECT, 0666)) >= 0)
+                io->flags |= NXCI_IO_FLAG_DIRECT;
+            else if (errno == EINVAL)
+                fprintf(stderr, "Warning: %s doesn't support direct I/O, using the page cache\n", path);
+        }
+#elif defined(F_NOCACHE)
+        /* No alignment rules here, the plain pread path is enough. */
+        if ((flags & NXCI_IO_FLAG_DIRECT) && (io->fd = open(path, oflags[mode], 0666)) >= 0)
+            fcntl(io->fd, F_NOCACHE, 1);
+#endif
+        if (io->fd < 0 && (io->fd = open(path, oflags[mode], 0666)) < 0) {
+            free(io);
+            return NULL;
+        }
+        io->backend = backend;
+        io->ops = &pread_ops;
+        if (io->flags & NXCI_IO_FLAG_DIRECT) {
+            pthread_mutex_init(&io->lock, NULL);
+            pthread_mutex_init(&io->pool_lock, NULL);
+            io->ops = &direct_ops;
+            if (mode == NXCI_IO_UPDATE)
+                io->end = pread_size(io);
+        } else if (backend == NXCI_IO_MMAP && mode == NXCI_IO_READ) {
+            io->ops = &mmap_ops;
+            io->map_size = pread_size(io);
+            if (io->map_size != 0) {
+                void *map = mmap(NULL, io->map_size, PROT_READ, MAP_SHARED, io->fd, 0);
+                if (map == MAP_FAILED) {
+                    int err = errno;
+                    close(io->fd);
+                    free(io);
+                    errno = err;
+                    return NULL;
+                }
+                io->map = map;
+            }
+        }
+        return io;
+    }
+#else
+    (void)flags;
+#endif
+
+    const oschar_t *modes[] = {OS_MODE_READ, OS_MODE_WRITE, OS_MODE_EDIT};
+    if ((io->file = os_fopen(path, modes[mode])) == NULL) {
+        free(io);
+        return NULL;
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    io->backend = NXCI_IO_STDIO;
+    io->ops = &stdio_ops;
+    return io;
+}
+
+static size_t no_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    (void)io; (void)buf; (void)count; (void)ofs;
+    return 0;
+}
+
+static uint64_t written_size(nxci_io_t *io) {
+    pthread_mutex_lock(&io->lock);
+    uint64_t size = io->end;
+    pthread_mutex_unlock(&io->lock);
+    return size;
+}
+
+static void no_hint(nxci_io_t *io, uint64_t ofs, uint64_t len, nxci_io_hint_t hint) {
+    (void)io; (void)ofs; (void)len; (void)hint;
+}
+
+/* Sequential: a pipe or terminal, writes have to come in order and nothing can be read back. */
+static size_t sequential_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    pthread_mutex_lock(&io->lock);
+    size_t written = 0;
+    if (ofs == io->end) {
+        written = fwrite(buf, 1, count, io->file);
+        io->end += written;
+    }
+    pthread_mutex_unlock(&io->lock);
+    return written;
+}
+
+static const nxci_io_ops_t sequential_ops = {no_read_at, sequential_write_at, written_size, no_hint, stdio_close};
+
+/* Write-only, takes ownership of file. */
+nxci_io_t *nxci_io_open_sequential(FILE *file) {
+    nxci_io_t *io = nxci_calloc(1, sizeof(*io));
+    if (io == NULL) {
+        nxci_fail("Failed to allocate I/O context!");
+    }
+    io->mode = NXCI_IO_WRITE;
+    io->fd = -1;
+    io->file = file;
+    pthread_mutex_init(&io->lock, NULL);
+    io->ops = &sequential_ops;
+    return io;
+}
+
+/* Memory: writes land in a buffer that grows as needed, a sink without one only counts them. */
+static size_t memory_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    pthread_mutex_lock(&io->lock);
+    if (io->map == NULL || ofs >= io->end)
+        count = 0;
+    else if (count > io->end - ofs)
+        count = io->end - ofs;
+    if (count != 0)
+        memcpy(buf, io->map + ofs, count);
+    pthread_mutex_unlock(&io->lock);
+    return count;
+}
+
+static size_t memory_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    pthread_mutex_lock(&io->lock);
+    if (io->map != NULL) {
+        if (ofs + count > io->map_size) {
+            uint64_t capacity = io->map_size * 2 > ofs + count ? io->map_size * 2 : ofs + count;
+            unsigned char *map = nxci_realloc(io->map, capacity);
+            if (map == NULL) {
+                pthread_mutex_unlock(&io->lock);
+                return 0;
+            }
+            memset(map + io->map_size, 0, capacity - io->map_size);
+            io->map = map;
+            io->map_size = capacity;
+        }
+        memcpy(io->map + ofs, buf, count);
+    }
+    if (ofs + count > io->end)
+        io->end = ofs + count;
+    pthread_mutex_unlock(&io->lock);
+    return count;
+}
+
+static int memory_close(nxci_io_t *io) {
+    free(io->map);
+    pthread_mutex_destroy(&io->lock);
+    return 0;
+}
+
+static const nxci_io_ops_t memory_ops = {memory_read_at, memory_write_at, written_size, no_hint, memory_close};
+
+/* The contents are io->map[0, io->end). */
+nxci_io_t *nxci_io_open_memory(uint64_t capacity) {
+    nxci_io_t *io = nxci_io_open_null();
+    io->map_size = capacity != 0 ? capacity : 1;
+    if ((io->map = nxci_calloc(1, io->map_size)) == NULL) {
+        nxci_io_close(io);
+        nxci_fail("Failed to allocate memory buffer!");
+    }
+    return io;
+}
+
+/* Discards everything, for passes that only want the hash of what would be written. */
+nxci_io_t *nxci_io_open_null(void) {
+    nxci_io_t *io = nxci_calloc(1, sizeof(*io));
+    if (io == NULL) {
+        nxci_fail("Failed to allocate I/O context!");
+    }
+    io->mode = NXCI_IO_WRITE;
+    io->fd = -1;
+    pthread_mutex_init(&io->lock, NULL);
+    io->ops = &memory_ops;
+    return io;
+}
+
+/* Close and free io, non-zero if buffered writes couldn't be flushed. */
+int nxci_io_close(nxci_io_t *io) {
+    if (io == NULL)
+        return 0;
+    int ret = io->ops->close(io);
+    free(io);
+    return ret;
+}
+
+void nxci_io_release(void *io) {
+    nxci_io_close(io);
+}
+
+/* Reserve size bytes of a writable file in one extent, best effort.
+   The file size is set too, so writers can fill it at any offset and in any order. */
+void nxci_io_preallocate(nxci_io_t *io, uint64_t size) {
+#ifdef __linux__
+    if (io->fd >= 0 && io->mode != NXCI_IO_READ) {
+        int ret;
+        do {
+            ret = fallocate(io->fd, 0, 0, size);
+        } while (ret != 0 && errno == EINTR);
+    }
+#else
+    (void)io; (void)size;
+#endif
+}
+
+int nxci_io_backend_from_name(const char *name, nxci_io_backend_t *backend) {
+    for (unsigned int i = 0; i < sizeof(nxci_io_backend_names) / sizeof(nxci_io_backend_names[0]); i++) {
+        if (!strcmp(name, nxci_io_backend_names[i])) {
+            *backend = (nxci_io_backend_t)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *nxci_io_backend_name(nxci_io_backend_t backend) {
+    return nxci_io_backend_names[backend];
+}
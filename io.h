@@ -0,0 +1,96 @@
+#ifndef NXCI_IO_H
+#define NXCI_IO_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "types.h"
+#include "filepath.h"
+
+typedef enum {
+    NXCI_IO_STDIO = 0, /* fseeko + fread/fwrite under a lock. */
+    NXCI_IO_PREAD, /* pread/pwrite, no shared file position. */
+    NXCI_IO_MMAP, /* Read-only files are mapped, writable ones fall back to pwrite. */
+    NXCI_IO_URING /* Pread, with copies queued on an io_uring. */
+} nxci_io_backend_t;
+
+typedef enum {
+    NXCI_IO_READ = 0,
+    NXCI_IO_WRITE, /* Create or truncate. */
+    NXCI_IO_UPDATE /* Existing file, read and write. */
+} nxci_io_mode_t;
+
+typedef enum {
+    NXCI_IO_HINT_NORMAL = 0,
+    NXCI_IO_HINT_SEQUENTIAL,
+    NXCI_IO_HINT_RANDOM,
+    NXCI_IO_HINT_WILLNEED,
+    NXCI_IO_HINT_DONTNEED
+} nxci_io_hint_t;
+
+#define NXCI_IO_FLAG_DIRECT 1 /* Bypass the page cache, mmap turns into pread. */
+
+#define NXCI_IO_DIRECT_ALIGN 0x1000
+#define NXCI_IO_BOUNCE_SIZE 0x100000
+#define NXCI_IO_BOUNCE_POOL_SIZE 8
+
+#ifdef _WIN32
+#define NXCI_IO_DEFAULT_BACKEND NXCI_IO_STDIO
+#else
+#define NXCI_IO_DEFAULT_BACKEND NXCI_IO_PREAD
+#endif
+
+typedef struct nxci_io nxci_io_t;
+
+/* Every call is positional, so one handle can be shared by any number of threads. */
+typedef struct {
+    size_t (*read_at)(nxci_io_t *io, void *buf, size_t count, uint64_t ofs);
+    size_t (*write_at)(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs);
+    uint64_t (*size)(nxci_io_t *io);
+    void (*hint)(nxci_io_t *io, uint64_t ofs, uint64_t len, nxci_io_hint_t hint);
+    int (*close)(nxci_io_t *io);
+} nxci_io_ops_t;
+
+struct nxci_io {
+    const nxci_io_ops_t *ops;
+    nxci_io_backend_t backend;
+    nxci_io_mode_t mode;
+    unsigned int flags; /* NXCI_IO_FLAG_*, as actually applied. */
+    FILE *file; /* Stdio. */
+    pthread_mutex_t lock; /* Stdio, guards the file position. Direct, guards partly written blocks. */
+    int fd; /* Pread and mmap. */
+    unsigned char *map; /* Mmap, NULL for empty or writable files. Memory, the buffer, NULL for a sink. */
+    uint64_t map_size;
+    pthread_mutex_t pool_lock; /* Direct, guards bounce and end. */
+    unsigned char *bounce[NXCI_IO_BOUNCE_POOL_SIZE]; /* Direct, idle aligned buffers for unaligned requests. */
+    unsigned int num_bounce;
+    uint64_t end; /* Direct, logical size of a writable file, it's truncated to this on close. Sequential and memory, bytes written. */
+};
+
+nxci_io_t *nxci_io_open(const oschar_t *path, nxci_io_mode_t mode, nxci_io_backend_t backend, unsigned int flags);
+nxci_io_t *nxci_io_open_sequential(FILE *file);
+nxci_io_t *nxci_io_open_memory(uint64_t capacity);
+nxci_io_t *nxci_io_open_null(void);
+int nxci_io_close(nxci_io_t *io);
+/* nxci_io_close for a cleanup, errors are ignored. */
+void nxci_io_release(void *io);
+void nxci_io_preallocate(nxci_io_t *io, uint64_t size);
+int nxci_io_backend_from_name(const char *name, nxci_io_backend_t *backend);
+const char *nxci_io_backend_name(nxci_io_backend_t backend);
+
+static inline size_t nxci_io_read_at(nxci_io_t *io, void *buf, size_t count, uint64_t ofs) {
+    return io->ops->read_at(io, buf, count, ofs);
+}
+
+static inline size_t nxci_io_write_at(nxci_io_t *io, const void *buf, size_t count, uint64_t ofs) {
+    return io->ops->write_at(io, buf, count, ofs);
+}
+
+static inline uint64_t nxci_io_size(nxci_io_t *io) {
+    return io->ops->size(io);
+}
+
+static inline void nxci_io_hint(nxci_io_t *io, uint64_t ofs, uint64_t len, nxci_io_hint_t hint) {
+    io->ops->hint(io, ofs, len, hint);
+}
+
+#endif
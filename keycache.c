@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "keycache.h"
+#include "version.h"
+#include "pki.h"
+#include "sha.h"
+
+void keycache_hash(unsigned char *hash, const void *keys, size_t size, const nca_keyset_t *base) {
+    nca_keyset_t keyset = *base;
+    keyset.derived_generations = 0;
+    sha_ctx_t sha_ctx;
+    sha_ctx_init(&sha_ctx, HASH_TYPE_SHA256, 0);
+    sha_update(&sha_ctx, keys, size);
+    sha_update(&sha_ctx, &keyset, sizeof(keyset));
+    sha_update(&sha_ctx, NXCI_VERSION, sizeof(NXCI_VERSION));
+    sha_get_hash(&sha_ctx, hash);
+    sha_ctx_cleanup(&sha_ctx);
+}
+
+int keycache_load(const char *path, const unsigned char *hash, nca_keyset_t *keyset) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    keycache_t cache;
+    size_t read = fread(&cache, 1, sizeof(cache), f);
+    fclose(f);
+    if (read != sizeof(cache) || cache.magic != KEYCACHE_MAGIC || cache.version != KEYCACHE_VERSION || cache.keyset_size != sizeof(nca_keyset_t) || memcmp(cache.source_hash, hash, sizeof(cache.source_hash)) != 0)
+        return -1;
+
+    memcpy(keyset, &cache.keyset, sizeof(*keyset));
+    keyset->derived_generations = 0;
+    pki_set_beta_nca0_exponent(cache.beta_nca0_exponent);
+    return 0;
+}
+
+void keycache_save(const char *path, const unsigned char *hash, const nca_keyset_t *keyset) {
+    keycache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.magic = KEYCACHE_MAGIC;
+    cache.version = KEYCACHE_VERSION;
+    cache.keyset_size = sizeof(nca_keyset_t);
+    memcpy(cache.source_hash, hash, sizeof(cache.source_hash));
+    memcpy(cache.beta_nca0_exponent, pki_get_beta_nca0_exponent(), sizeof(cache.beta_nca0_exponent));
+    memcpy(&cache.keyset, keyset, sizeof(cache.keyset));
+    cache.keyset.derived_generations = 0;
+
+    // Written aside and renamed over, so processes starting at the same time never see half a cache
+    char tmp_path[MAX_PATH + 0x20];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+#ifdef _WIN32
+    FILE *f = fopen(tmp_path, "wb");
+#else
+    // Holds the same secrets as keys.dat
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (f == NULL && fd >= 0)
+        close(fd);
+#endif
+    if (f == NULL)
+        return;
+    size_t written = fwrite(&cache, 1, sizeof(cache), f);
+    if (fclose(f) != 0 || written != sizeof(cache) || rename(tmp_path, path) != 0)
+        remove(tmp_path);
+}
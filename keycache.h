@@ -0,0 +1,30 @@
+#ifndef NXCI_KEYCACHE_H
+#define NXCI_KEYCACHE_H
+
+#include "types.h"
+#include "settings.h"
+
+#define KEYCACHE_MAGIC 0x4B43584E /* "NXCK" */
+#define KEYCACHE_VERSION 1
+
+/* A keyset as derived from keys.dat, saved next to it so later runs skip parsing and deriving.
+   Only valid for the keys.dat and build it was made from, see keycache_hash. Native byte order. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t keyset_size;
+    uint32_t _0xC;
+    unsigned char source_hash[0x20];
+    unsigned char beta_nca0_exponent[0x100];
+    nca_keyset_t keyset;
+} keycache_t;
+
+/* SHA-256 of the keys.dat contents, the keyset they're loaded over and the tool version. */
+void keycache_hash(unsigned char *hash, const void *keys, size_t size, const nca_keyset_t *base);
+
+/* Returns 0 and fills keyset if path holds the one derived for hash. */
+int keycache_load(const char *path, const unsigned char *hash, nca_keyset_t *keyset);
+/* Best effort, a cache that can't be written is just derived again next time. */
+void keycache_save(const char *path, const unsigned char *hash, const nca_keyset_t *keyset);
+
+#endif
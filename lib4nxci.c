@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "lib4nxci.h"
+#include "nsp.h"
+#include "xci.h"
+#include "nca.h"
+#include "sha.h"
+#include "pki.h"
+#include "extkeys.h"
+#include "keycache.h"
+#include "ncacache.h"
+#include "workpool.h"
+
+void nxci_settings_init(nxci_settings_t *settings, nca_keyset_t *keyset) {
+    memset(settings, 0, sizeof(*settings));
+    memset(keyset, 0, sizeof(*keyset));
+    settings->keyset = keyset;
+    pki_initialize_keyset(settings->keyset, KEYSET_RETAIL);
+    ncacache_keyset_hash(settings->keyset, settings->keyset_hash);
+    settings->copy.queue_depth = COPY_DEFAULT_QUEUE_DEPTH;
+    settings->copy.buffer_size = COPY_DEFAULT_BUFFER_SIZE;
+    settings->num_workers = workpool_default_threads();
+    settings->io_backend = NXCI_IO_DEFAULT_BACKEND;
+    settings->pipe_buffer_size = NSP_PIPE_DEFAULT_BUFFER;
+}
+
+nxci_status_t nxci_load_keys(nxci_settings_t *settings, const char *path, char *error, size_t error_size) {
+    filepath_t keypath;
+    filepath_set(&keypath, path);
+    FILE *keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
+    if (keyfile == NULL) {
+        snprintf(error, error_size, "unable to open %s\nmake sure to put your keyset in %s", path, path);
+        return NXCI_ERROR;
+    }
+
+    // keys.dat is only parsed and derived from when <keys.dat>.cache wasn't made from it
+    char cache_path[MAX_PATH + 0x10];
+    unsigned char hash[0x20];
+    int cacheable = 0;
+    snprintf(cache_path, sizeof(cache_path), "%s.cache", path);
+    if (fseeko64(keyfile, 0, SEEK_END) == 0) {
+        uint64_t size = ftello64(keyfile);
+        char *keys = size < 0x100000 ? malloc(size + 1) : NULL;
+        if (keys != NULL) {
+            fseeko64(keyfile, 0, SEEK_SET);
+            cacheable = fread(keys, 1, size + 1, keyfile) == size;
+            if (cacheable)
+                keycache_hash(hash, keys, size, settings->keyset);
+            free(keys);
+        }
+    }
+    if (cacheable && keycache_load(cache_path, hash, settings->keyset) == 0) {
+        fclose(keyfile);
+        ncacache_keyset_hash(settings->keyset, settings->keyset_hash);
+        return NXCI_OK;
+    }
+    fseeko64(keyfile, 0, SEEK_SET);
+
+    nxci_catch_t frame;
+    nxci_catch_enter(&frame);
+    if (setjmp(frame.env) == 0) {
+        extkeys_initialize_keyset(settings->keyset, keyfile);
+        pki_derive_master_keys(settings->keyset);
+        nxci_catch_leave(&frame);
+        ncacache_keyset_hash(settings->keyset, settings->keyset_hash);
+        if (cacheable)
+            keycache_save(cache_path, hash, settings->keyset);
+    } else {
+        snprintf(error, error_size, "%s", frame.message);
+    }
+    fclose(keyfile);
+    return frame.status;
+}
+
+void nxci_job_init(nxci_job_t *job, const char *input_path, const char *output_dir) {
+    memset(job, 0, sizeof(*job));
+    job->input_path = input_path;
+    job->output_dir = output_dir;
+    pthread_mutex_init(&job->arena.lock, NULL);
+}
+
+void nxci_job_free(nxci_job_t *job) {
+    arena_free(&job->arena);
+}
+
+void nxci_job_cancel(nxci_job_t *job) {
+    atomic_store(&job->cancelled, 1);
+}
+
+void nxci_log(nxci_ctx_t *tool_ctx, const char *fmt, ...) {
+    nxci_job_t *job = tool_ctx->job;
+    va_list args;
+    va_start(args, fmt);
+    if (job != NULL && job->log != NULL) {
+        char text[0x400];
+        vsnprintf(text, sizeof(text), fmt, args);
+        job->log(job->user, text);
+    } else {
+        vprintf(fmt, args);
+    }
+    va_end(args);
+}
+
+void nxci_job_add_total(nxci_job_t *job, uint64_t bytes) {
+    if (job != NULL)
+        atomic_fetch_add(&job->total, bytes);
+}
+
+void nxci_job_advance(nxci_job_t *job, uint64_t bytes) {
+    if (job == NULL)
+        return;
+    uint64_t done = atomic_fetch_add(&job->done, bytes) + bytes;
+    if (job->progress != NULL)
+        job->progress(job->user, done, atomic_load(&job->total));
+    if (atomic_load(&job->cancelled))
+        nxci_fail_status(NXCI_CANCELLED, "Cancelled");
+}
+
+typedef void (*nxci_cart_func_t)(nxci_ctx_t *tool_ctx, xci_ctx_t *xci_ctx);
+
+static void nxci_convert_cart(nxci_ctx_t *tool_ctx, xci_ctx_t *xci_ctx) {
+    nxci_job_t *job = tool_ctx->job;
+    if (tool_ctx->settings.extract_secure) {
+        // Secure partition is staged in 4nxci_extracted_xci, next to the nsp
+        if (job->output_dir != NULL) {
+            filepath_set(&tool_ctx->settings.secure_dir_path, job->output_dir);
+            filepath_append(&tool_ctx->settings.secure_dir_path, "4nxci_extracted_xci");
+        } else {
+            filepath_set(&tool_ctx->settings.secure_dir_path, "4nxci_extracted_xci");
+        }
+
+        xci_save(xci_ctx);
+        create_cnmt_xml(tool_ctx);
+        create_dummy_cert(tool_ctx);
+        create_dummy_tik(tool_ctx);
+        create_nsp(tool_ctx);
+    } else if (tool_ctx->settings.nsp_pipe != NULL) {
+        create_nsp_pipe(&xci_ctx->secure_ctx);
+    } else {
+        create_nsp_stream(&xci_ctx->secure_ctx);
+    }
+}
+
+static void nxci_scan_cart(nxci_ctx_t *tool_ctx, xci_ctx_t *xci_ctx) {
+    nxci_cart_t *cart = tool_ctx->cart;
+    hfs0_ctx_t *secure_ctx = &xci_ctx->secure_ctx;
+    uint32_t entries[4];
+    hfs0_prepare_ncas(secure_ctx, cart->nca_ctxs, entries);
+    nxci_log(tool_ctx, "Title ID: %s\n", cart->cnmt_xml.tid);
+    for (int index = 0; index < 4; index++) {
+        nca_ctx_t *nca_ctx = cart->nca_ctxs[index];
+        nxci_log(tool_ctx, "%s NCA: %s, %" PRIu64 " bytes, key generation %u\n", nca_get_content_type(nca_ctx),
+            hfs0_get_file_name(secure_ctx->header, entries[index]), nca_ctx->file_size, nca_ctx->crypto_type);
+    }
+}
+
+typedef struct {
+    hfs0_ctx_t *hfs0_ctx;
+    uint32_t index;
+    int valid;
+} nxci_verify_file_t;
+
+// NCAs are named after the first half of their SHA-256, 0 if name isn't an NCA's
+static int nxci_parse_nca_id(const char *name, unsigned char *id) {
+    for (int i = 0; i < 0x20; i++) {
+        char c = name[i];
+        int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (nibble < 0)
+            return 0;
+        if (i & 1)
+            id[i / 2] |= nibble;
+        else
+            id[i / 2] = nibble << 4;
+    }
+    return name[0x20] == '.';
+}
+
+static void nxci_verify_file(void *arg) {
+    nxci_verify_file_t *file = arg;
+    hfs0_ctx_t *ctx = file->hfs0_ctx;
+    hfs0_file_entry_t *entry = hfs0_get_file_entry(ctx->header, file->index);
+    const char *name = hfs0_get_file_name(ctx->header, file->index);
+    uint64_t offset = ctx->offset + hfs0_get_header_size(ctx->header) + entry->offset;
+
+    // HFS0 only hashes the start of each file, the whole of it is checked against its name
+    file->valid = entry->hashed_size == 0 || check_memory_hash_table(ctx->io, entry->hash, offset, entry->hashed_size, entry->hashed_size, 0) == VALIDITY_VALID;
+
+    copy_settings_t copy = ctx->tool_ctx->settings.copy;
+    copy.zero_copy = 0;
+    copy.reflink = 0;
+    nxci_io_t *out = nxci_io_open_null();
+    nxci_cleanup_t out_cleanup, sha_cleanup;
+    nxci_cleanup_push(&out_cleanup, nxci_io_release, out);
+    sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
+    nxci_cleanup_push(&sha_cleanup, (void (*)(void *))free_sha_ctx, sha_ctx);
+    copy_file_section(ctx->io, offset, entry->size, out, 0, NULL, sha_ctx, &copy);
+    unsigned char hash[0x20], id[0x10];
+    sha_get_hash(sha_ctx, hash);
+    nxci_cleanup_pop(&sha_cleanup, 1);
+    nxci_cleanup_pop(&out_cleanup, 1);
+
+    if (nxci_parse_nca_id(name, id) && memcmp(hash, id, sizeof(id)) != 0)
+        file->valid = 0;
+    nxci_log(ctx->tool_ctx, "%s: %s\n", name, file->valid ? "OK" : "corrupt");
+}
+
+static void nxci_verify_cart(nxci_ctx_t *tool_ctx, xci_ctx_t *xci_ctx) {
+    hfs0_ctx_t *secure_ctx = &xci_ctx->secure_ctx;
+    uint32_t num_files = secure_ctx->header->num_files;
+    nxci_verify_file_t *files = arena_alloc(tool_ctx->cart->arena, num_files * sizeof(*files));
+    void **file_ptrs = arena_alloc(tool_ctx->cart->arena, num_files * sizeof(*file_ptrs));
+    for (uint32_t i = 0; i < num_files; i++) {
+        files[i].hfs0_ctx = secure_ctx;
+        files[i].index = i;
+        files[i].valid = 0;
+        file_ptrs[i] = &files[i];
+        nxci_job_add_total(tool_ctx->job, hfs0_get_file_entry(secure_ctx->header, i)->size);
+    }
+    workpool_run(tool_ctx->settings.num_workers, nxci_verify_file, file_ptrs, num_files);
+
+    uint32_t corrupt = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        if (!files[i].valid)
+            corrupt++;
+    }
+    if (corrupt != 0) {
+        nxci_fail("%" PRIu32 " of %" PRIu32 " files in the secure partition are corrupt", corrupt, num_files);
+    }
+    nxci_log(tool_ctx, "All %" PRIu32 " files in the secure partition match their hashes\n", num_files);
+}
+
+/* Everything a job allocates comes from job->arena or is undone by a cleanup, so a failed one leaks nothing. */
+static nxci_status_t nxci_run(const nxci_settings_t *settings, nxci_job_t *job, nxci_cart_func_t func) {
+    job->title_id[0] = '\0';
+    job->nsp_path[0] = '\0';
+    job->error[0] = '\0';
+    atomic_store(&job->done, 0);
+    atomic_store(&job->total, 0);
+
+    nxci_catch_t frame;
+    nxci_catch_enter(&frame);
+    if (setjmp(frame.env) == 0) {
+        nxci_ctx_t *tool_ctx = arena_alloc(&job->arena, sizeof(nxci_ctx_t));
+        nxci_cart_t *cart = arena_alloc(&job->arena, sizeof(nxci_cart_t));
+        tool_ctx->settings = *settings;
+        tool_ctx->settings.copy.job = job;
+        tool_ctx->job = job;
+        tool_ctx->cart = cart;
+        cart->arena = &job->arena;
+        nxci_cleanup_t cart_cleanup, io_cleanup;
+        nxci_cleanup_push(&cart_cleanup, (void (*)(void *))nxci_cart_release, cart);
+
+        filepath_t input_path;
+        filepath_set(&input_path, job->input_path);
+        if (input_path.valid != VALIDITY_VALID) {
+            nxci_fail("Input path too long: %s", job->input_path);
+        }
+        if (!(tool_ctx->io = nxci_io_open(input_path.os_path, NXCI_IO_READ, settings->io_backend, settings->io_input_flags))) {
+            nxci_fail("unable to open %s: %s", job->input_path, strerror(errno));
+        }
+        nxci_cleanup_push(&io_cleanup, nxci_io_release, tool_ctx->io);
+
+        xci_ctx_t xci_ctx;
+        memset(&xci_ctx, 0, sizeof(xci_ctx));
+        xci_ctx.io = tool_ctx->io;
+        xci_ctx.tool_ctx = tool_ctx;
+
+        xci_process(&xci_ctx);
+        func(tool_ctx, &xci_ctx);
+        if (cart->cnmt_xml.tid != NULL)
+            snprintf(job->title_id, sizeof(job->title_id), "%s", cart->cnmt_xml.tid);
+
+        nxci_cleanup_pop(&io_cleanup, 1);
+        nxci_cleanup_pop(&cart_cleanup, 1);
+        nxci_catch_leave(&frame);
+    } else {
+        // The partial nsp was removed
+        job->nsp_path[0] = '\0';
+        snprintf(job->error, sizeof(job->error), "%s", frame.message);
+    }
+    arena_reset(&job->arena);
+    return frame.status;
+}
+
+nxci_status_t nxci_convert(const nxci_settings_t *settings, nxci_job_t *job) {
+    return nxci_run(settings, job, nxci_convert_cart);
+}
+
+nxci_status_t nxci_scan(const nxci_settings_t *settings, nxci_job_t *job) {
+    return nxci_run(settings, job, nxci_scan_cart);
+}
+
+nxci_status_t nxci_verify(const nxci_settings_t *settings, nxci_job_t *job) {
+    return nxci_run(settings, job, nxci_verify_cart);
+}
@@ -0,0 +1,57 @@
+#ifndef LIB4NXCI_H
+#define LIB4NXCI_H
+
+#include <stdatomic.h>
+#include "types.h"
+#include "settings.h"
+#include "arena.h"
+#include "error.h"
+#include "utils.h"
+
+/* Reentrant conversion API, the 4nxci tool is a client of it.
+   Settings are only read, so any number of conversions may share them and run at once. The keyset they point
+   to is shared too: each key generation is derived into it, once and under a lock, by the first conversion needing it.
+   Nothing calls exit(), errors and cancellation come back as an nxci_status_t. */
+
+typedef void (*nxci_log_func_t)(void *user, const char *text);
+typedef void (*nxci_progress_func_t)(void *user, uint64_t done, uint64_t total);
+
+typedef struct nxci_job {
+    const char *input_path;
+    const char *output_dir; /* The nsp and the --extract staging directory go there, NULL for the current directory. */
+    nxci_log_func_t log; /* Gets what the tool prints, newlines included. NULL prints to stdout. */
+    nxci_progress_func_t progress; /* Called on whichever thread copied the bytes, may be NULL. */
+    void *user;
+    atomic_int cancelled;
+    atomic_uint_fast64_t done; /* NCA bytes copied (or hashed) so far. */
+    atomic_uint_fast64_t total;
+    arena_t arena; /* Kept between conversions run with the job. */
+    /* Results. */
+    char title_id[17];
+    char nsp_path[MAX_PATH + 1]; /* Empty when the nsp went to settings.nsp_pipe. */
+    char error[NXCI_ERROR_SIZE];
+} nxci_job_t;
+
+/* Keys are loaded and derived into keyset, which has to outlive the settings and the conversions run with them. */
+void nxci_settings_init(nxci_settings_t *settings, nca_keyset_t *keyset);
+nxci_status_t nxci_load_keys(nxci_settings_t *settings, const char *path, char *error, size_t error_size);
+
+void nxci_job_init(nxci_job_t *job, const char *input_path, const char *output_dir);
+void nxci_job_free(nxci_job_t *job);
+/* Safe from any thread, the conversion stops at its next progress point with NXCI_CANCELLED. */
+void nxci_job_cancel(nxci_job_t *job);
+
+/* Convert job->input_path, job->error says why when NXCI_OK isn't returned. */
+nxci_status_t nxci_convert(const nxci_settings_t *settings, nxci_job_t *job);
+/* Read the cart's headers and log its title ID and NCAs, nothing is written. */
+nxci_status_t nxci_scan(const nxci_settings_t *settings, nxci_job_t *job);
+/* Hash every file of the secure partition against its HFS0 entry and NCA ID, nothing is written.
+   Fails unless all of them match, the log says which didn't. */
+nxci_status_t nxci_verify(const nxci_settings_t *settings, nxci_job_t *job);
+
+/* Used by the conversion itself. */
+void nxci_log(nxci_ctx_t *tool_ctx, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void nxci_job_add_total(nxci_job_t *job, uint64_t bytes);
+void nxci_job_advance(nxci_job_t *job, uint64_t bytes);
+
+#endif
@@ -3,93 +3,302 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lib4nxci.h"
 #include "nsp.h"
 #include "types.h"
 #include "utils.h"
 #include "settings.h"
-#include "pki.h"
-#include "xci.h"
-#include "extkeys.h"
-#include "cnmt.h"
+#include "aes.h"
+#include "sha.h"
+#include "pipeline.h"
+#include "io.h"
+#include "uring.h"
+#include "zerocopy.h"
+#include "bufpool.h"
+#include "workpool.h"
+#include "batch.h"
+#include "serve.h"
+#include "watch.h"
+#include "protocol.h"
 #include "version.h"
 
 /* 4NXCI by The-4n
    Based on hactool by SciresM
    */
-cnmt_xml_t cnmt_xml;
-nsp_create_info_t nsp_create_info[7];
-application_cnmt_content_t application_cnmt_contents[3];
 
 // Print Usage
 static void usage(void) {
     fprintf(stderr, 
     	"4NXCI %s by The-4n\n"
-        "Usage: %s <filename.xci>\n"
-    	"Make sure to put your keyset in keys.dat\n", NXCI_VERSION, USAGE_PROGRAM_NAME);
+        "Usage: %s [options...] <filename.xci>\n"
+        "       %s [options...] -o <output dir> <filename.xci|dir>...\n"
+        "       %s [options...] --serve[=socket]\n"
+        "       %s [options...] --watch=<dir> -o <output dir>\n"
+        "Options:\n"
+        "-x, --extract          Extract secure partition to 4nxci_extracted_xci before packing nsp\n"
+        "                       (default: stream NCAs from the XCI straight into the nsp)\n"
+        "--queue-depth=N        Number of buffers in flight between the reader, hasher and writer\n"
+        "                       threads, 0 or 1 copies on a single thread (default: %d)\n"
+        "--buffer-size=N        Size of each copy buffer in bytes (default: 0x%x)\n"
+        "-j, --workers=N        Number of NCAs processed concurrently (default: number of CPUs)\n"
+        "--io=BACKEND           File access: stdio, pread, mmap or uring (default: %s)\n"
+        "--direct-input         Read files with O_DIRECT, bypassing the page cache\n"
+        "--direct-output        Write files with O_DIRECT, bypassing the page cache\n"
+        "--zero-copy            Copy unpatched NCA ranges with copy_file_range/splice, hashing\n"
+        "                       them through a read-only mapping of the input\n"
+        "--reflink              Lay NCAs out on the same 4 KiB block offsets as in the source and\n"
+        "                       clone their unpatched blocks (btrfs, XFS), copying where unsupported\n"
+        "--stdout               Write the nsp to stdout in order (for pipes), progress goes to stderr\n"
+        "--pipe-buffer=N        With --stdout, bytes of NCAs kept in memory from the hash pass instead\n"
+        "                       of being read again (default: 0x%x)\n"
+        "--max-memory=N         Cap in bytes on copy and hash buffers, stages get smaller buffers or\n"
+        "                       wait for each other instead of growing (default: no limit)\n"
+        "--stats                Print heap allocation and AES key expansion counts when done\n"
+        "--cache=DIR            Keep each NCA's patches and hash in DIR, so converting it again takes\n"
+        "                       a single copy without hashing, and an nsp still as written is kept\n"
+        "Batch mode, used with several inputs, a directory of XCIs or -o:\n"
+        "-o, --output=DIR       Convert each cart into its own directory under DIR (default: .)\n"
+        "--jobs=N               Number of carts converted concurrently (default: number of CPUs)\n"
+        "--per-device=N         Carts converted concurrently per disk read or written (default: 1 on\n"
+        "                       rotational disks, no limit otherwise)\n"
+        "--serve[=SOCKET]       Keep keys and conversion threads loaded and run convert, scan and verify\n"
+        "                       jobs from 4nxci-client over a UNIX socket, --jobs and --per-device apply\n"
+        "                       (default: %s)\n"
+        "--watch=DIR            Convert the XCIs in DIR, then every one written or moved into it, each\n"
+        "                       into its own directory under -o's, which appears once the nsp is complete\n"
+        "--done=DIR             With --watch, move converted XCIs to DIR (default: leave them)\n"
+        "--failed=DIR           With --watch, move XCIs that failed to DIR, the error goes in <name>.error\n"
+        "                       (default: leave them)\n"
+    	"Make sure to put your keyset in keys.dat\n", NXCI_VERSION, USAGE_PROGRAM_NAME, USAGE_PROGRAM_NAME, USAGE_PROGRAM_NAME, USAGE_PROGRAM_NAME,
+        COPY_DEFAULT_QUEUE_DEPTH, COPY_DEFAULT_BUFFER_SIZE, nxci_io_backend_name(NXCI_IO_DEFAULT_BACKEND),
+        NSP_PIPE_DEFAULT_BUFFER, NXCI_DEFAULT_SOCKET);
     exit(EXIT_FAILURE);
 }
 
-int main(int argc, char **argv) {
-	//Compiler nag
-	(void)argc;
-
-    nxci_ctx_t tool_ctx;
-    char input_name[0x200];
-    filepath_t keypath;;
+static void print_stats(const nxci_settings_t *settings, arena_t *arena) {
+    printf("I/O backend: %s\n", nxci_io_backend_name(settings->io_backend));
+    printf("SHA-256 engine: %s\n", sha256_get_impl_name());
+    printf("Heap allocations: %" PRIu64 "\n", nxci_get_alloc_count());
+    printf("AES key expansions: %" PRIu64 "\n", aes_get_key_expansion_count());
+    uring_print_stats(stdout);
+    zerocopy_print_stats(stdout);
+    bufpool_print_stats(stdout);
+    if (arena != NULL)
+        arena_print_stats(stdout, arena, "Metadata");
+}
 
-    memset(&tool_ctx, 0, sizeof(tool_ctx));
-    memset(input_name, 0, sizeof(input_name));
-    memset(&cnmt_xml,0,sizeof(cnmt_xml));
-    memset(&cnmt_xml,0,sizeof(application_cnmt_contents));
-    filepath_init(&keypath);
+int main(int argc, char **argv) {
+    nxci_settings_t settings;
+    nca_keyset_t keyset;
+    nxci_job_t job;
+    char error[NXCI_ERROR_SIZE];
 
-    pki_initialize_keyset(&tool_ctx.settings.keyset, KEYSET_RETAIL);
+    nxci_settings_init(&settings, &keyset);
+    int nsp_stdout = 0;
+    const char *output_root = NULL;
+    unsigned int num_jobs = workpool_default_threads();
+    unsigned int per_device = 0;
+    const char *socket_path = NULL;
+    watch_options_t watch = {0};
 
     // Hardcode keyfile path
-    filepath_set(&keypath, "keys.dat");
+    if (nxci_load_keys(&settings, "keys.dat", error, sizeof(error)) != NXCI_OK) {
+        fprintf(stderr, "%s\n", error);
+        return EXIT_FAILURE;
+    }
     
-    // Try to populate default keyfile.
-    FILE *keyfile = NULL;
-    keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
-
-    if (keyfile != NULL) {
-        extkeys_initialize_keyset(&tool_ctx.settings.keyset, keyfile);
-        pki_derive_keys(&tool_ctx.settings.keyset);
-        fclose(keyfile);
+    while (1) {
+        int option_index;
+        int c;
+        static struct option long_options[] = 
+        {
+            {"extract", 0, NULL, 'x'},
+            {"queue-depth", 1, NULL, 1},
+            {"buffer-size", 1, NULL, 2},
+            {"workers", 1, NULL, 'j'},
+            {"stats", 0, NULL, 3},
+            {"io", 1, NULL, 4},
+            {"direct-input", 0, NULL, 5},
+            {"direct-output", 0, NULL, 6},
+            {"zero-copy", 0, NULL, 7},
+            {"reflink", 0, NULL, 8},
+            {"stdout", 0, NULL, 9},
+            {"pipe-buffer", 1, NULL, 10},
+            {"max-memory", 1, NULL, 11},
+            {"output", 1, NULL, 'o'},
+            {"jobs", 1, NULL, 12},
+            {"per-device", 1, NULL, 13},
+            {"serve", 2, NULL, 14},
+            {"watch", 1, NULL, 15},
+            {"done", 1, NULL, 16},
+            {"failed", 1, NULL, 17},
+            {"cache", 1, NULL, 18},
+            {NULL, 0, NULL, 0},
+        };
+
+        c = getopt_long(argc, argv, "xj:o:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) 
+        {
+            case 'x':
+                settings.extract_secure = 1;
+                break;
+            case 'j':
+                settings.num_workers = strtoul(optarg, NULL, 0);
+                if (settings.num_workers == 0) {
+                    fprintf(stderr, "Number of workers must be non-zero\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 1:
+                settings.copy.queue_depth = strtoul(optarg, NULL, 0);
+                if (settings.copy.queue_depth > PIPELINE_MAX_DEPTH) {
+                    fprintf(stderr, "Queue depth must be at most %d\n", PIPELINE_MAX_DEPTH);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 4:
+                if (!nxci_io_backend_from_name(optarg, &settings.io_backend)) {
+                    fprintf(stderr, "Unknown I/O backend %s, expected stdio, pread, mmap or uring\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 5:
+                settings.io_input_flags |= NXCI_IO_FLAG_DIRECT;
+                break;
+            case 6:
+                settings.io_output_flags |= NXCI_IO_FLAG_DIRECT;
+                break;
+            case 7:
+                settings.copy.zero_copy = 1;
+                break;
+            case 8:
+                settings.copy.reflink = 1;
+                break;
+            case 9:
+                nsp_stdout = 1;
+                break;
+            case 10:
+                settings.pipe_buffer_size = strtoull(optarg, NULL, 0);
+                break;
+            case 11:
+                bufpool_set_limit(strtoull(optarg, NULL, 0));
+                break;
+            case 3:
+                settings.print_stats = 1;
+                break;
+            case 'o':
+                output_root = optarg;
+                break;
+            case 12:
+                num_jobs = strtoul(optarg, NULL, 0);
+                if (num_jobs == 0) {
+                    fprintf(stderr, "Number of jobs must be non-zero\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 13:
+                per_device = strtoul(optarg, NULL, 0);
+                break;
+            case 14:
+                socket_path = optarg != NULL ? optarg : NXCI_DEFAULT_SOCKET;
+                break;
+            case 15:
+                watch.watch_dir = optarg;
+                break;
+            case 16:
+                watch.done_dir = optarg;
+                break;
+            case 17:
+                watch.failed_dir = optarg;
+                break;
+            case 18:
+                settings.cache_dir = optarg;
+                break;
+            case 2:
+                settings.copy.buffer_size = strtoull(optarg, NULL, 0);
+                if (settings.copy.buffer_size == 0) {
+                    fprintf(stderr, "Buffer size must be non-zero\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage();
+        }
     }
-    else {
-    	fprintf(stderr,"unable to open keys.dat\n"
-    			"make sure to put your keyset in keys.dat\n");
-    	return EXIT_FAILURE;
+
+    if (settings.cache_dir != NULL) {
+        filepath_t cache_path;
+        filepath_set(&cache_path, settings.cache_dir);
+        if (os_makedir(cache_path.os_path) != 0 && errno != EEXIST) {
+            fprintf(stderr, "unable to create %s: %s\n", settings.cache_dir, strerror(errno));
+            return EXIT_FAILURE;
+        }
     }
-    
-    if (argv[1] != NULL) {
-        // Copy input file.
-        strncpy(input_name, argv[1], sizeof(input_name));
-    } else
-        usage();
-    
-    if (!(tool_ctx.file = fopen(input_name, "rb"))) {
-        fprintf(stderr, "unable to open %s: %s\n", input_name, strerror(errno));
-        return EXIT_FAILURE;
+
+    if (watch.watch_dir != NULL) {
+        if (optind != argc || nsp_stdout || socket_path != NULL) {
+            fprintf(stderr, "--watch takes its carts from the watched directory\n");
+            return EXIT_FAILURE;
+        }
+        watch.output_root = output_root != NULL ? output_root : ".";
+        watch.num_jobs = num_jobs;
+        watch.per_device = per_device;
+        return watch_run(&settings, &watch) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
-    
-    xci_ctx_t xci_ctx;
-    memset(&xci_ctx, 0, sizeof(xci_ctx));
-    xci_ctx.file = tool_ctx.file;
-    xci_ctx.tool_ctx = &tool_ctx;
 
-    // Hardcode secure partition save path to "4nxci_extracted_nsp" directory
-    filepath_set(&xci_ctx.tool_ctx->settings.secure_dir_path, "4nxci_extracted_xci");
+    if (socket_path != NULL) {
+        if (optind != argc || nsp_stdout || output_root != NULL) {
+            fprintf(stderr, "--serve takes its carts from 4nxci-client\n");
+            return EXIT_FAILURE;
+        }
+        return serve_run(&settings, socket_path, num_jobs, per_device) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    xci_process(&xci_ctx);
+    if (optind >= argc)
+        usage();
+    struct stat st;
+    int batch = output_root != NULL || optind != argc - 1 || (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode));
 
-    create_cnmt_xml();
-    create_dummy_cert(xci_ctx.tool_ctx->settings.secure_dir_path);
-    create_dummy_tik(xci_ctx.tool_ctx->settings.secure_dir_path);
-    create_nsp();
+    if (batch) {
+        if (nsp_stdout) {
+            fprintf(stderr, "--stdout can't be combined with several carts\n");
+            return EXIT_FAILURE;
+        }
+        int failed = batch_run(&settings, argv + optind, argc - optind, output_root != NULL ? output_root : ".", num_jobs, per_device);
+        if (settings.print_stats)
+            print_stats(&settings, NULL);
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (nsp_stdout) {
+        if (settings.extract_secure) {
+            fprintf(stderr, "--stdout can't be combined with --extract\n");
+            return EXIT_FAILURE;
+        }
+        // The nsp keeps the real stdout, everything printed goes to stderr
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || (settings.nsp_pipe = fdopen(fd, "wb")) == NULL) {
+            fprintf(stderr, "unable to redirect stdout: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    nxci_job_init(&job, argv[optind], NULL);
+    if (nxci_convert(&settings, &job) != NXCI_OK) {
+        fprintf(stderr, "%s\n", job.error);
+        nxci_job_free(&job);
+        return EXIT_FAILURE;
+    }
 
-    fclose(tool_ctx.file);
     printf("Done!\n");
+    if (settings.print_stats)
+        print_stats(&settings, &job.arena);
+    nxci_job_free(&job);
     return EXIT_SUCCESS;
 }
@@ -11,6 +11,8 @@
 #include "extkeys.h"
 #include "filepath.h"
 #include "nsp.h"
+#include "lib4nxci.h"
+#include "ncacache.h"
 
 /* Initialize the context. */
 void nca_init(nca_ctx_t *ctx) {
@@ -68,7 +70,6 @@ void nca_update_ctr(unsigned char *ctr, uint64_t ofs) {
 
 /* Seek to an offset within a section. */
 void nca_section_fseek(nca_section_ctx_t *ctx, uint64_t offset) {
-        fseeko64(ctx->file, (ctx->offset + offset) & ~0xF, SEEK_SET);
         ctx->cur_seek = (ctx->offset + offset) & ~0xF;
         nca_update_ctr(ctx->ctr, ctx->offset + offset);
         ctx->sector_ofs = offset & 0xF;
@@ -78,9 +79,11 @@ size_t nca_section_fread(nca_section_ctx_t *ctx, void *buffer, size_t count) {
     size_t read = 0; /* XXX */
     char block_buf[0x10];
     if (ctx->sector_ofs) {
-    	if ((read = fread(block_buf, 1, 0x10, ctx->file)) != 0x10) {
+    	if ((read = nxci_io_read_at(ctx->io, block_buf, 0x10, ctx->file_offset + ctx->cur_seek)) != 0x10) {
         	return 0;
         }
+        if (ctx->plan)
+        	nca_patch_plan_apply(ctx->plan, ctx->cur_seek, block_buf, 0x10);
         aes_setiv(ctx->aes, ctx->ctr, 0x10);
         aes_decrypt(ctx->aes, block_buf, block_buf, 0x10);
         if (count + ctx->sector_ofs < 0x10) {
@@ -94,42 +97,111 @@ size_t nca_section_fread(nca_section_ctx_t *ctx, void *buffer, size_t count) {
         nca_section_fseek(ctx, ctx->cur_seek - ctx->offset + 0x10);
         return read_in_block + nca_section_fread(ctx, (char *)buffer + read_in_block, count - read_in_block);
     }
-    if ((read = fread(buffer, 1, count, ctx->file)) != count) {
+    if ((read = nxci_io_read_at(ctx->io, buffer, count, ctx->file_offset + ctx->cur_seek)) != count) {
     	return 0;
     }
+    if (ctx->plan)
+    	nca_patch_plan_apply(ctx->plan, ctx->cur_seek, buffer, count);
     aes_setiv(ctx->aes, ctx->ctr, 16);
     aes_decrypt(ctx->aes, buffer, buffer, count);
     nca_section_fseek(ctx, ctx->cur_seek - ctx->offset + count);
     return read;
 }
 
-size_t nca_section_fwrite(nca_section_ctx_t *ctx, void *buffer, size_t count, uint64_t offset) {
+/* Record an encrypted write to the section in its patch plan, the file itself is left untouched. */
+size_t nca_section_patch(nca_section_ctx_t *ctx, void *buffer, size_t count, uint64_t offset) {
 	nca_section_fseek(ctx,offset);
 	uint8_t sector_ofs = ctx->sector_ofs;
 	uint64_t temp_buff_size = sector_ofs + count;
-	unsigned char *temp_buff = (unsigned char*)malloc(temp_buff_size);
+	unsigned char *temp_buff = (unsigned char*)nxci_malloc(temp_buff_size);
+	if (temp_buff == NULL) {
+		nxci_fail("Failed to allocate NCA patch!");
+	}
+	nxci_cleanup_t temp_cleanup;
+	nxci_cleanup_push(&temp_cleanup, free, temp_buff);
 	nca_section_fseek(ctx,ctx->cur_seek - ctx->offset);
-	nca_section_fread(ctx,temp_buff,sector_ofs);
+	if (nca_section_fread(ctx,temp_buff,sector_ofs) != sector_ofs) {
+		nxci_fail("Failed to read NCA section!");
+	}
 	nca_section_fseek(ctx,ctx->cur_seek - ctx->offset);
 	memcpy(temp_buff+sector_ofs,buffer,count);
     aes_setiv(ctx->aes, ctx->ctr, 16);
     aes_encrypt(ctx->aes, temp_buff, temp_buff, temp_buff_size);
-	if (!fwrite(temp_buff, 1, temp_buff_size, ctx->file)) {
-		fprintf(stderr,"Unable to modify NCA");
-		return 0;
-	}
+	nca_patch_plan_add(ctx->plan, ctx->cur_seek, temp_buff, temp_buff_size);
+	nxci_cleanup_pop(&temp_cleanup, 1);
 	return count;
 }
 
+/* Add a range to the plan, keeping it sorted. Overlapping or adjacent ranges are merged, new data wins. */
+void nca_patch_plan_add(nca_patch_plan_t *plan, uint64_t offset, const void *data, uint64_t size) {
+	uint64_t start = offset;
+	uint64_t end = offset + size;
+	unsigned int first = 0;
+	while (first < plan->num_patches && plan->patches[first].offset + plan->patches[first].size < start)
+		first++;
+	unsigned int last = first;
+	while (last < plan->num_patches && plan->patches[last].offset <= end) {
+		if (plan->patches[last].offset < start)
+			start = plan->patches[last].offset;
+		if (plan->patches[last].offset + plan->patches[last].size > end)
+			end = plan->patches[last].offset + plan->patches[last].size;
+		last++;
+	}
+	if (first == last && plan->num_patches >= NCA_MAX_PATCHES) {
+		nxci_fail("Too many NCA patches!");
+	}
 
-static void nca_save(nca_ctx_t *ctx) {
-    /* Rewrite header */
-	fseeko64(ctx->file, 0, SEEK_SET);
-	if (!fwrite(&ctx->header, 1, 0xC00, ctx->file)) {
-		fprintf(stderr,"Unable to patch NCA header");
-		exit(EXIT_FAILURE);
+	unsigned char *merged = (unsigned char*)nxci_malloc(end - start);
+	if (merged == NULL) {
+		nxci_fail("Failed to allocate NCA patch!");
 	}
-    fclose(ctx->file);
+	for (unsigned int i = first; i < last; i++) {
+		memcpy(merged + (plan->patches[i].offset - start), plan->patches[i].data, plan->patches[i].size);
+		free(plan->patches[i].data);
+	}
+	memcpy(merged + (offset - start), data, size);
+
+	// Replace patches [first, last) with the merged one
+	unsigned int removed = last - first;
+	if (removed != 1)
+		memmove(&plan->patches[first + 1], &plan->patches[last], (plan->num_patches - last) * sizeof(nca_patch_t));
+	plan->num_patches = plan->num_patches - removed + 1;
+	plan->patches[first].offset = start;
+	plan->patches[first].size = end - start;
+	plan->patches[first].data = merged;
+}
+
+/* Overlay the plan onto buffer, which holds size bytes read from offset. */
+void nca_patch_plan_apply(nca_patch_plan_t *plan, uint64_t offset, void *buffer, uint64_t size) {
+	for (unsigned int i = 0; i < plan->num_patches; i++) {
+		nca_patch_t *patch = &plan->patches[i];
+		if (patch->offset >= offset + size)
+			break;
+		uint64_t start = patch->offset > offset ? patch->offset : offset;
+		uint64_t end = patch->offset + patch->size < offset + size ? patch->offset + patch->size : offset + size;
+		if (start < end)
+			memcpy((unsigned char*)buffer + (start - offset), patch->data + (start - patch->offset), end - start);
+	}
+}
+
+void nca_patch_plan_free(nca_patch_plan_t *plan) {
+	for (unsigned int i = 0; i < plan->num_patches; i++)
+		free(plan->patches[i].data);
+	plan->num_patches = 0;
+}
+
+/* Compute every change conversion makes to a prepared NCA (see nca_prepare).
+   Only the header and the ExeFS PFS0 metadata, npdm and hash table are read, header is re-encrypted. */
+void nca_patch_plan_build(nca_ctx_t *ctx, nca_patch_plan_t *plan) {
+	nxci_cleanup_t plan_cleanup;
+	memset(plan, 0, sizeof(*plan));
+	// Patches added before a failure are freed here, the caller only owns a complete plan
+	nxci_cleanup_push(&plan_cleanup, (void (*)(void *))nca_patch_plan_free, plan);
+	if (ctx->header.content_type == 0)
+		exefs_npdm_process(ctx, plan);
+	nca_encrypt_header(ctx);
+	nca_patch_plan_add(plan, 0, &ctx->header, 0xC00);
+	nxci_cleanup_pop(&plan_cleanup, 0);
 }
 
 char *nca_get_content_type(nca_ctx_t *ctx) {
@@ -150,8 +222,7 @@ char *nca_get_content_type(nca_ctx_t *ctx) {
             return "Data";
             break;
         default:
-        	fprintf(stderr, "Unknown NCA content type");
-        	exit(EXIT_FAILURE);
+        	nxci_fail("Unknown NCA content type");
     }
 }
 
@@ -173,8 +244,7 @@ int nca_type_to_index(uint8_t nca_type)
 		return 2;
 		break;
 	default:
-    	fprintf(stderr, "Unknown NCA content type");
-    	exit(EXIT_FAILURE);
+    	nxci_fail("Unknown NCA content type");
 	}
 }
 
@@ -191,13 +261,45 @@ int nca_type_to_cnmt_type(uint8_t nca_type)
 		return 5;
 		break;
 	default:
-    	fprintf(stderr, "Unknown NCA content type");
-    	exit(EXIT_FAILURE);
+    	nxci_fail("Unknown NCA content type");
+	}
+}
+
+/* Buffers exefs_npdm_process holds while reading a section, released even when it fails. */
+typedef struct {
+	nca_section_ctx_t *section;
+	pfs0_file_entry_t *file_entry_table;
+	unsigned char *block_data;
+	unsigned char *hash_table;
+} exefs_scratch_t;
+
+static void exefs_scratch_release(void *arg) {
+	exefs_scratch_t *scratch = arg;
+	free(scratch->hash_table);
+	free(scratch->block_data);
+	free(scratch->file_entry_table);
+	free_aes_ctx(scratch->section->aes);
+	scratch->section->aes = NULL;
+}
+
+/* Decrypted read of size bytes at offset within the section, a truncated or unreadable NCA fails. */
+static void exefs_read(nca_section_ctx_t *section, void *buffer, uint64_t size, uint64_t offset) {
+	nca_section_fseek(section, offset);
+	if (nca_section_fread(section, buffer, size) != size) {
+		nxci_fail("Failed to read ExeFS!");
+	}
+}
+
+static void *exefs_alloc(uint64_t size) {
+	void *buffer = size != 0 ? nxci_malloc(size) : NULL;
+	if (buffer == NULL) {
+		nxci_fail("Failed to allocate ExeFS buffer!");
 	}
+	return buffer;
 }
 
-// Corrupts ACID sig
-void exefs_npdm_process(nca_ctx_t *ctx)
+// Corrupts ACID sig, changes are recorded in plan
+void exefs_npdm_process(nca_ctx_t *ctx, nca_patch_plan_t *plan)
 {
 	pfs0_header_t pfs0_header;
 	npdm_t npdm_header;
@@ -210,6 +312,7 @@ void exefs_npdm_process(nca_ctx_t *ctx)
 	uint64_t file_raw_data_offset = 0;
 	uint64_t block_start_offset = 0;
 	uint64_t block_hash_table_offset = 0;
+	unsigned char block_hash[0x20];
 
 	nca_decrypt_key_area(ctx);
 
@@ -217,10 +320,26 @@ void exefs_npdm_process(nca_ctx_t *ctx)
 	for (int i = 0; i < 4; i++) {
 		if (ctx->header.section_entries[i].media_start_offset) {
 			if (ctx->header.fs_headers[i].partition_type == PARTITION_PFS0 && ctx->header.fs_headers[i].fs_type == FS_TYPE_PFS0 && ctx->header.fs_headers[i].crypt_type == CRYPT_CTR)  {
+				pfs0_superblock_t *superblock = &ctx->header.fs_headers[i].pfs0_superblock;
+				uint64_t section_size = 0;
+				if (ctx->header.section_entries[i].media_end_offset > ctx->header.section_entries[i].media_start_offset)
+					section_size = media_to_real(ctx->header.section_entries[i].media_end_offset - ctx->header.section_entries[i].media_start_offset);
+				// Sizes come from the cart, anything not fitting the section is rejected before it's allocated
+				if (superblock->block_size == 0 || superblock->block_size > section_size ||
+					superblock->hash_table_size == 0 || superblock->hash_table_size > section_size ||
+					superblock->pfs0_offset > section_size - sizeof(pfs0_header)) {
+					nxci_fail("Invalid ExeFS superblock!");
+				}
+
+				exefs_scratch_t scratch = {.section = &ctx->section_contexts[i]};
+				nxci_cleanup_t scratch_cleanup;
 				ctx->section_contexts[i].aes = new_aes_ctx(ctx->decrypted_keys[2], 16, AES_MODE_CTR);
+				nxci_cleanup_push(&scratch_cleanup, exefs_scratch_release, &scratch);
 				ctx->section_contexts[i].offset = media_to_real(ctx->header.section_entries[i].media_start_offset);
 				ctx->section_contexts[i].sector_ofs = 0;
-				ctx->section_contexts[i].file = ctx->file;
+				ctx->section_contexts[i].io = ctx->io;
+				ctx->section_contexts[i].file_offset = ctx->file_offset;
+				ctx->section_contexts[i].plan = plan;
 				ctx->section_contexts[i].crypt_type = CRYPT_CTR;
 				ctx->section_contexts[i].header = &ctx->header.fs_headers[i];
 	            uint64_t ofs = ctx->section_contexts[i].offset >> 4;
@@ -231,86 +350,76 @@ void exefs_npdm_process(nca_ctx_t *ctx)
 	            }
 
 				// Read and decrypt PFS0 header
-				pfs0_start_offset = ctx->header.fs_headers[i].pfs0_superblock.pfs0_offset;
-				nca_section_fseek(&ctx->section_contexts[i],pfs0_start_offset);
-				nca_section_fread(&ctx->section_contexts[i],&pfs0_header,sizeof(pfs0_header));
+				pfs0_start_offset = superblock->pfs0_offset;
+				exefs_read(&ctx->section_contexts[i],&pfs0_header,sizeof(pfs0_header),pfs0_start_offset);
 				// Read and decrypt file entry table
 				file_entry_table_offset = pfs0_start_offset + sizeof(pfs0_header);
 				file_entry_table_size = sizeof(pfs0_file_entry_t) * pfs0_header.num_files;
-				pfs0_file_entry_t *pfs0_file_entry_table = (pfs0_file_entry_t*)malloc(file_entry_table_size);
-				nca_section_fseek(&ctx->section_contexts[i],file_entry_table_offset);
-				nca_section_fread(&ctx->section_contexts[i],pfs0_file_entry_table,file_entry_table_size);
+				if (file_entry_table_size > section_size - file_entry_table_offset) {
+					nxci_fail("Invalid ExeFS PFS0 header!");
+				}
+				if (file_entry_table_size != 0) {
+					scratch.file_entry_table = exefs_alloc(file_entry_table_size);
+					exefs_read(&ctx->section_contexts[i],scratch.file_entry_table,file_entry_table_size,file_entry_table_offset);
+				}
 
 				// Looking for META magic
 				uint32_t magic = 0;
 				raw_data_offset = file_entry_table_offset + file_entry_table_size + pfs0_header.string_table_size;
 				for (unsigned int i2 = 0; i2 < pfs0_header.num_files; i2++) {
-					file_raw_data_offset = raw_data_offset + pfs0_file_entry_table[i2].offset;
-					nca_section_fseek(&ctx->section_contexts[i],file_raw_data_offset);
-					nca_section_fread(&ctx->section_contexts[i],&magic,sizeof(magic));
+					if (raw_data_offset > section_size || scratch.file_entry_table[i2].offset > section_size - raw_data_offset) {
+						nxci_fail("Invalid ExeFS PFS0 header!");
+					}
+					file_raw_data_offset = raw_data_offset + scratch.file_entry_table[i2].offset;
+					exefs_read(&ctx->section_contexts[i],&magic,sizeof(magic),file_raw_data_offset);
 					if (magic == MAGIC_META) {
 						// Read and decrypt npdm header
 						meta_offset = file_raw_data_offset;
-						nca_section_fseek(&ctx->section_contexts[i],meta_offset);
-						nca_section_fread(&ctx->section_contexts[i],&npdm_header,sizeof(npdm_header));
+						exefs_read(&ctx->section_contexts[i],&npdm_header,sizeof(npdm_header),meta_offset);
 
 						// Mix some water with acid (Corrupt ACID sig)
 						acid_offset = meta_offset + npdm_header.acid_offset;
+						if (acid_offset < superblock->pfs0_offset || acid_offset >= section_size) {
+							nxci_fail("Invalid ExeFS npdm!");
+						}
 						uint8_t acid_sig_byte = 0;
-						nca_section_fseek(&ctx->section_contexts[i],acid_offset);
-						nca_section_fread(&ctx->section_contexts[i],&acid_sig_byte,1);
+						exefs_read(&ctx->section_contexts[i],&acid_sig_byte,1,acid_offset);
 						if (acid_sig_byte == 0xFF)
 							acid_sig_byte -= 0x01;
 						else
 							acid_sig_byte += 0x01;
-						nca_section_fwrite(&ctx->section_contexts[i],&acid_sig_byte,0x01,acid_offset);
+						nca_section_patch(&ctx->section_contexts[i],&acid_sig_byte,0x01,acid_offset);
 
 						// Calculate new block hash
-						block_hash_table_offset = (0x20 * ((acid_offset - ctx->header.fs_headers[i].pfs0_superblock.pfs0_offset)/ ctx->header.fs_headers[i].pfs0_superblock.block_size)) + ctx->header.fs_headers[i].pfs0_superblock.hash_table_offset;
-						block_start_offset = (((acid_offset - ctx->header.fs_headers[i].pfs0_superblock.pfs0_offset) / ctx->header.fs_headers[i].pfs0_superblock.block_size) * ctx->header.fs_headers[i].pfs0_superblock.block_size) + ctx->header.fs_headers[i].pfs0_superblock.pfs0_offset;
-						unsigned char *block_data = (unsigned char*)malloc(ctx->header.fs_headers[i].pfs0_superblock.block_size);
-						unsigned char *block_hash = (unsigned char*)malloc(0x20);
-						nca_section_fseek(&ctx->section_contexts[i],block_start_offset);
-						nca_section_fread(&ctx->section_contexts[i],block_data,ctx->header.fs_headers[i].pfs0_superblock.block_size);
-						sha_ctx_t *pfs0_sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-						sha_update(pfs0_sha_ctx,block_data,ctx->header.fs_headers[i].pfs0_superblock.block_size);
-						sha_get_hash(pfs0_sha_ctx,block_hash);
-						nca_section_fwrite(&ctx->section_contexts[i],block_hash,0x20,block_hash_table_offset);
-						free(block_hash);
-						free(block_data);
+						block_hash_table_offset = (0x20 * ((acid_offset - superblock->pfs0_offset)/ superblock->block_size)) + superblock->hash_table_offset;
+						block_start_offset = (((acid_offset - superblock->pfs0_offset) / superblock->block_size) * superblock->block_size) + superblock->pfs0_offset;
+						scratch.block_data = exefs_alloc(superblock->block_size);
+						exefs_read(&ctx->section_contexts[i],scratch.block_data,superblock->block_size,block_start_offset);
+						sha256_hash_buffer(block_hash,scratch.block_data,superblock->block_size);
+						nca_section_patch(&ctx->section_contexts[i],block_hash,0x20,block_hash_table_offset);
 
 						// Calculate PFS0 sueperblock hash
-						sha_ctx_t *hash_table_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-						unsigned char *hash_table = (unsigned char*)malloc(ctx->header.fs_headers[i].pfs0_superblock.hash_table_size);
-						unsigned char *master_hash = (unsigned char*)malloc(0x20);
-						nca_section_fseek(&ctx->section_contexts[i],ctx->header.fs_headers[i].pfs0_superblock.hash_table_offset);
-						nca_section_fread(&ctx->section_contexts[i],hash_table,ctx->header.fs_headers[i].pfs0_superblock.hash_table_size);
-						sha_update(hash_table_ctx,hash_table,ctx->header.fs_headers[i].pfs0_superblock.hash_table_size);
-						sha_get_hash(hash_table_ctx,master_hash);
-						memcpy(&ctx->header.fs_headers[i].pfs0_superblock.master_hash,master_hash,0x20);
-						free(master_hash);
-						free(hash_table);
+						scratch.hash_table = exefs_alloc(superblock->hash_table_size);
+						exefs_read(&ctx->section_contexts[i],scratch.hash_table,superblock->hash_table_size,superblock->hash_table_offset);
+						sha256_hash_buffer(superblock->master_hash,scratch.hash_table,superblock->hash_table_size);
 
 						// Calculate section hash
-						unsigned char *section_hash = (unsigned char*)malloc(0x20);
-						sha_ctx_t *section_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-						sha_update(section_ctx,&ctx->header.fs_headers[i],0x200);
-						sha_get_hash(section_ctx,section_hash);
-						memcpy(&ctx->header.section_hashes[i],master_hash,0x20);
-						free(section_hash);
+						sha256_hash_buffer(ctx->header.section_hashes[i],&ctx->header.fs_headers[i],0x200);
 
 						break;
 					}
 				}
-				free(pfs0_file_entry_table);
+				nxci_cleanup_pop(&scratch_cleanup, 1);
 			}
 		}
 	}
 }
 
-// Heavily modify header and rebuild cnmt
-void cnmt_nca_process(nca_ctx_t *ctx, char *filepath)
+// Heavily modify header and rebuild cnmt, pfs0 receives the encrypted section
+void cnmt_nca_process(nca_ctx_t *ctx, pfs0_t *pfs0)
 {
+	nxci_cart_t *cart = ctx->tool_ctx->cart;
+
 	// Set header and pfs0 superblock values for cnmt.nca
 	ctx->header.nca_size = 0x1000;
 	ctx->header.section_entries[0].media_start_offset = 0x06;
@@ -321,7 +430,7 @@ void cnmt_nca_process(nca_ctx_t *ctx, char *filepath)
 	ctx->header.fs_headers[0].pfs0_superblock.pfs0_offset = 0x200;
 	ctx->header.fs_headers[0].pfs0_superblock.pfs0_size = 0x158;
 
-	pfs0_t pfs0 = {
+	*pfs0 = (pfs0_t) {
 			.hashtable.padding = {0},
 			.header.magic = 0x30534650,					// PFS0
 			.header.num_files = 0x01,					// Application_tid.cnmt
@@ -347,38 +456,36 @@ void cnmt_nca_process(nca_ctx_t *ctx, char *filepath)
 	};
 
 	// String table = Application_tid.cnmt
-	strcat(pfs0.string_table,"Application_");
-	strncat(pfs0.string_table,cnmt_xml.tid,16);
-	strcat(pfs0.string_table,".cnmt");
+	strcat(pfs0->string_table,"Application_");
+	strncat(pfs0->string_table,cart->cnmt_xml.tid,16);
+	strcat(pfs0->string_table,".cnmt");
 
-	memcpy(pfs0.application_cnmt_contents,application_cnmt_contents,sizeof(application_cnmt_contents));
+	memcpy(pfs0->application_cnmt_contents,cart->application_cnmt_contents,sizeof(cart->application_cnmt_contents));
 
 	// Calculate PFS0 hash
 	sha_ctx_t *pfs0_sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-	unsigned char *pfs0_hash_result = (unsigned char*)calloc(1,33);
-	sha_update(pfs0_sha_ctx,&pfs0.header,sizeof(pfs0.header));
-	sha_update(pfs0_sha_ctx,&pfs0.file_entry,sizeof(pfs0.file_entry));
-	sha_update(pfs0_sha_ctx,&pfs0.string_table,sizeof(pfs0.string_table));
-	sha_update(pfs0_sha_ctx,&pfs0.application_cnmt_header,sizeof(pfs0.application_cnmt_header));
-	sha_update(pfs0_sha_ctx,&pfs0.application_cnmt_contents,sizeof(pfs0.application_cnmt_contents));
-	sha_update(pfs0_sha_ctx,&pfs0.digest,sizeof(pfs0.digest));
+	unsigned char pfs0_hash_result[0x20];
+	sha_update(pfs0_sha_ctx,&pfs0->header,sizeof(pfs0->header));
+	sha_update(pfs0_sha_ctx,&pfs0->file_entry,sizeof(pfs0->file_entry));
+	sha_update(pfs0_sha_ctx,&pfs0->string_table,sizeof(pfs0->string_table));
+	sha_update(pfs0_sha_ctx,&pfs0->application_cnmt_header,sizeof(pfs0->application_cnmt_header));
+	sha_update(pfs0_sha_ctx,&pfs0->application_cnmt_contents,sizeof(pfs0->application_cnmt_contents));
+	sha_update(pfs0_sha_ctx,&pfs0->digest,sizeof(pfs0->digest));
 	sha_get_hash(pfs0_sha_ctx,pfs0_hash_result);
-	memcpy(pfs0.hashtable.hash,pfs0_hash_result,32);
-
-	cnmt_nca_save(ctx, &pfs0, filepath);
+	free_sha_ctx(pfs0_sha_ctx);
+	memcpy(pfs0->hashtable.hash,pfs0_hash_result,32);
 
 	// Calculate PFS0 superblock master hash
 	sha_ctx_t *pfs0_superblock_sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-	unsigned char *pfs0_superblock_hash_result = (unsigned char*)calloc(1,33);
+	unsigned char pfs0_superblock_hash_result[0x20];
 	sha_update(pfs0_superblock_sha_ctx,pfs0_hash_result,32);
 	sha_get_hash(pfs0_superblock_sha_ctx,pfs0_superblock_hash_result);
+	free_sha_ctx(pfs0_superblock_sha_ctx);
 	memcpy(ctx->header.fs_headers[0].pfs0_superblock.master_hash,pfs0_superblock_hash_result,32);
-	free(pfs0_superblock_hash_result);
-	free(pfs0_hash_result);
 
 	// Calculate section hash
 	sha_ctx_t *pfs0_section_sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-	unsigned char *pfs0_section_hash_result = (unsigned char*)calloc(1,33);
+	unsigned char pfs0_section_hash_result[0x20];
 	uint8_t pfs0_section_zeros[0x1B0] = { 0 };
 	sha_update(pfs0_section_sha_ctx,&ctx->header.fs_headers[0]._0x0,sizeof(ctx->header.fs_headers[0]._0x0));
 	sha_update(pfs0_section_sha_ctx,&ctx->header.fs_headers[0]._0x1,sizeof(ctx->header.fs_headers[0]._0x1));
@@ -395,13 +502,9 @@ void cnmt_nca_process(nca_ctx_t *ctx, char *filepath)
 	sha_update(pfs0_section_sha_ctx,&ctx->header.fs_headers[0].pfs0_superblock.pfs0_size,sizeof(ctx->header.fs_headers[0].pfs0_superblock.pfs0_size));
 	sha_update(pfs0_section_sha_ctx,&pfs0_section_zeros,sizeof(pfs0_section_zeros));
 	sha_get_hash(pfs0_section_sha_ctx,pfs0_section_hash_result);
+	free_sha_ctx(pfs0_section_sha_ctx);
 	memcpy(ctx->header.section_hashes[0],pfs0_section_hash_result,32);
-	free(pfs0_section_hash_result);
 
-}
-
-void cnmt_nca_save(nca_ctx_t *ctx, pfs0_t *pfs0, char *filepath)
-{
 	// Decrypt key area to get keys and encrypt new pfs0
 	nca_decrypt_key_area(ctx);
 	ctx->section_contexts[0].aes = new_aes_ctx(ctx->decrypted_keys[2], 16, AES_MODE_CTR);
@@ -415,37 +518,33 @@ void cnmt_nca_save(nca_ctx_t *ctx, pfs0_t *pfs0, char *filepath)
     }
 	aes_setiv(ctx->section_contexts[0].aes, ctx->section_contexts[0].ctr, 0x10);
 	aes_encrypt(ctx->section_contexts[0].aes, pfs0, pfs0, sizeof(*pfs0));
-	// Erase file contents and write PFS0
-	fclose(ctx->file);
-	ctx->file = fopen(filepath, "wb");
-	if (ctx->file == NULL) {
-	    fprintf(stderr, "Failed to open %s!\n", filepath);
-	    exit(EXIT_FAILURE);
-	}
-	uint8_t header_reserved[0xC00] = {0};
-	if (!fwrite(header_reserved, 0xC00 , 1 , ctx->file)) {
-		fprintf(stderr,"Unable to write cnmt");
-		exit(EXIT_FAILURE);
-	}
+	free_aes_ctx(ctx->section_contexts[0].aes);
+	ctx->section_contexts[0].aes = NULL;
+}
 
-	if (!fwrite(pfs0, sizeof(*pfs0) , 1, ctx->file)) {
-		fprintf(stderr,"Unable to write cnmt");
-		exit(EXIT_FAILURE);
+// Rebuild cnmt.nca and write it to out, hashing it on the way
+static uint64_t cnmt_nca_write(nca_ctx_t *ctx, nxci_io_t *out, uint64_t out_ofs, sha_ctx_t *sha_ctx)
+{
+	pfs0_t pfs0;
+	cnmt_nca_process(ctx, &pfs0);
+	nca_encrypt_header(ctx);
+	sha_update(sha_ctx,&ctx->header,0xC00);
+	sha_update(sha_ctx,&pfs0,sizeof(pfs0));
+	if (nxci_io_write_at(out, &ctx->header, 0xC00, out_ofs) != 0xC00) {
+		nxci_fail("Unable to write cnmt");
 	}
-	// Reopen in edit mode
-	fclose(ctx->file);
-	ctx->file = fopen(filepath, "rb+");
-	if (ctx->file == NULL) {
-	    fprintf(stderr, "Failed to open %s!\n", filepath);
-	    exit(EXIT_FAILURE);
+
+	if (nxci_io_write_at(out, &pfs0, sizeof(pfs0), out_ofs + 0xC00) != sizeof(pfs0)) {
+		nxci_fail("Unable to write cnmt");
 	}
+	return 0xC00 + sizeof(pfs0);
 }
-void nca_process(nca_ctx_t *ctx, char *filepath) {
+
+/* Decrypt header and set it up for conversion, returns the .cnmt.xml content index. */
+int nca_prepare(nca_ctx_t *ctx) {
     /* Decrypt header */
     if (!nca_decrypt_header(ctx)) {
-        fprintf(stderr, "Invalid NCA header! Are keys correct?\n");
-        exit(EXIT_FAILURE);
-        return;
+        nxci_fail("Invalid NCA header! Are keys correct?");
     }
 
     /* Sort out crypto type. */
@@ -460,131 +559,161 @@ void nca_process(nca_ctx_t *ctx, char *filepath) {
     ctx->header.distribution = 0;
 
     // Set required values for creating .cnmt.xml
+    nxci_cart_t *cart = ctx->tool_ctx->cart;
     int index = nca_type_to_index(ctx->header.content_type);
-    cnmt_xml.contents[index].type = nca_get_content_type(ctx);
-    cnmt_xml.contents[index].keygeneration = ctx->crypto_type;
-    if (index == 0) {
-    	exefs_npdm_process(ctx);
-    }
-    else if (index == 3) {
-    	char *tid = (char*)calloc(1,17);
+    cart->cnmt_xml.contents[index].type = nca_get_content_type(ctx);
+    cart->cnmt_xml.contents[index].keygeneration = ctx->crypto_type;
+    if (index == 3) {
     	//Convert tile id to hex
-    	sprintf(tid, "%016" PRIx64, ctx->header.title_id);
-    	cnmt_xml.tid = tid;
-    	cnmt_xml.filepath = (char*)calloc(1,strlen(filepath) + 1);
-    	strcpy(cnmt_xml.filepath,filepath);
-    	//Remove .nca and replace it with .xml
-    	strip_ext(cnmt_xml.filepath);
-    	strcat(cnmt_xml.filepath,".xml");
-
-    	cnmt_nca_process(ctx, filepath);
+    	cart->cnmt_xml.tid = arena_printf(cart->arena, "%016" PRIx64, ctx->header.title_id);
     }
+    return index;
+}
 
-    /* Re-encrypt header */
-    nca_encrypt_header(ctx);
-    printf("Patching %s\n",filepath);
-    nca_save(ctx);
-
-    // Calculate SHA-256 hash for .cnmt.xml
-	sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
-
-	// Get file size
-	FILE *file = fopen(filepath, "rb");
-	if (file == NULL) {
-	    fprintf(stderr, "Failed to open %s!\n", filepath);
-	    exit(EXIT_FAILURE);
-	}
-	fseeko64(file,0,SEEK_END);
-	uint64_t filesize = (uint64_t)ftello64(file);
-	fseeko64(file,0,SEEK_SET);
-
-    uint64_t read_size = 0x4000000; // 4 MB buffer.
-	unsigned char *buf = malloc(read_size);
-	if (buf == NULL) {
-	    fprintf(stderr, "Failed to allocate file-read buffer!\n");
-	    exit(EXIT_FAILURE);
-	}
-
-	uint64_t ofs = 0;
-	while (ofs < filesize) {
-	    if (ofs + read_size >= filesize) read_size = filesize - ofs;
-	    if (fread(buf, 1, read_size, file) != read_size) {
-	        fprintf(stderr, "Failed to read file!\n");
-	        exit(EXIT_FAILURE);
-	    }
-	    sha_update(sha_ctx,buf,read_size);
-	    ofs += read_size;
-	}
-	unsigned char *hash_result = (unsigned char*)calloc(1,33);
-	sha_get_hash(sha_ctx,hash_result);
-
+// Record hash and size of a patched NCA for .cnmt.xml, application.cnmt and nsp
+static void nca_set_content_info(nxci_cart_t *cart, int index, uint64_t filesize, unsigned char *hash_result)
+{
 	// Set file size for creating .cnmt.xml
-	cnmt_xml.contents[index].size = filesize;
+	cart->cnmt_xml.contents[index].size = filesize;
 	// Set file size for creating nsp
-	nsp_create_info[index].filesize = filesize;
-
-	// Set filepath for creating nsp
-	nsp_create_info[index].filepath = (char*)calloc(1,strlen(filepath) + 1);
-	strcpy(nsp_create_info[index].filepath,filepath);
-
+	cart->nsp_create_info[index].filesize = filesize;
 
 	// Convert hash to hex string
-	char *hash_hex = (char*)calloc(1,65);
+	char *hash_hex = arena_alloc(cart->arena,65);
 	hexBinaryString(hash_result,32,hash_hex,65);
-	cnmt_xml.contents[index].hash = hash_hex;
+	cart->cnmt_xml.contents[index].hash = hash_hex;
 
 	// Get id for creating .cnmt.xml, id = first 16 bytes of hash
-	strncpy(cnmt_xml.contents[index].id,hash_hex,32);
+	strncpy(cart->cnmt_xml.contents[index].id,hash_hex,32);
 
 	// Set new filename for creating nsp
-	if (index == 3) {
-		nsp_create_info[index].nsp_filename = (char*)calloc(1,42);
-		strcpy(nsp_create_info[index].nsp_filename,cnmt_xml.contents[index].id);
-		strcat(nsp_create_info[index].nsp_filename,".cnmt.nca");
-	}
-	else {
-		nsp_create_info[index].nsp_filename = (char*)calloc(1,37);
-		strcpy(nsp_create_info[index].nsp_filename,cnmt_xml.contents[index].id);
-		strcat(nsp_create_info[index].nsp_filename,".nca");
-	}
+	cart->nsp_create_info[index].nsp_filename = arena_printf(cart->arena,"%s%s",cart->cnmt_xml.contents[index].id,index == 3 ? ".cnmt.nca" : ".nca");
 
 	// Set required values for creating application.cnmt
 	if (index != 3)
 	{
 		uint8_t cnmt_type = nca_type_to_cnmt_type(index);
 		uint8_t padding = 0;
-		memcpy(&application_cnmt_contents[index].hash,hash_result,32);
-		memcpy(&application_cnmt_contents[index].ncaid,hash_result,16);
-		memcpy(&application_cnmt_contents[index].size,&filesize,6);
-		memcpy(&application_cnmt_contents[index].type,&cnmt_type,1);
-		memcpy(&application_cnmt_contents[index].padding, &padding ,1);
+		memcpy(&cart->application_cnmt_contents[index].hash,hash_result,32);
+		memcpy(&cart->application_cnmt_contents[index].ncaid,hash_result,16);
+		memcpy(&cart->application_cnmt_contents[index].size,&filesize,6);
+		memcpy(&cart->application_cnmt_contents[index].type,&cnmt_type,1);
+		memcpy(&cart->application_cnmt_contents[index].padding, &padding ,1);
+	}
+}
+
+/* Take the plan and hash of a prepared NCA from settings.cache_dir and record them, 0 if it isn't cached there.
+   A cached NCA is written by nca_write_patched with the plan, without hashing it again. */
+int nca_load_cached(nca_ctx_t *ctx, nca_patch_plan_t *plan)
+{
+	const char *dir = ctx->tool_ctx->settings.cache_dir;
+	unsigned char hash[0x20];
+	int index = nca_type_to_index(ctx->header.content_type);
+	// Meta NCA is rebuilt from the others, never cached
+	if (dir == NULL || !ctx->is_cacheable || index == 3 || ncacache_load(dir, ctx->cache_key, ctx->file_size, plan, hash) != 0)
+		return 0;
+	nca_set_content_info(ctx->tool_ctx->cart, index, ctx->file_size, hash);
+	return 1;
+}
+
+/* Patch a prepared NCA and write it to out in a single pass, hashing it on the way unless it's cached.
+   Meta NCA has to go last, as it's rebuilt from the other NCAs hashes.
+   Building the plan re-encrypts the header, pass plan (freed by the caller) to write the NCA again later. */
+void nca_stream(nca_ctx_t *ctx, nxci_io_t *out, uint64_t out_ofs, nca_patch_plan_t *plan)
+{
+	int index = nca_type_to_index(ctx->header.content_type);
+	nca_patch_plan_t local_plan;
+	nxci_cleanup_t plan_cleanup, sha_cleanup;
+	if (plan == NULL)
+		plan = &local_plan;
+	if (index != 3 && nca_load_cached(ctx, plan)) {
+		if (plan == &local_plan)
+			nxci_cleanup_push(&plan_cleanup, (void (*)(void *))nca_patch_plan_free, plan);
+		nca_write_patched(ctx, plan, out, out_ofs, NULL);
+		if (plan == &local_plan)
+			nxci_cleanup_pop(&plan_cleanup, 1);
+		return;
 	}
 
-	fclose(file);
-	free(buf);
-	free_sha_ctx(sha_ctx);
-	free(hash_result);
+	sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
+	nxci_cleanup_push(&sha_cleanup, (void (*)(void *))free_sha_ctx, sha_ctx);
+	unsigned char hash_result[0x20];
+	uint64_t filesize;
+	if (index == 3) {
+		// Rebuilt from scratch, nothing to read from the XCI
+		filesize = cnmt_nca_write(ctx, out, out_ofs, sha_ctx);
+		sha_get_hash(sha_ctx,hash_result);
+	}
+	else {
+		nca_patch_plan_build(ctx, plan);
+		if (plan == &local_plan)
+			nxci_cleanup_push(&plan_cleanup, (void (*)(void *))nca_patch_plan_free, plan);
+		nca_write_patched(ctx, plan, out, out_ofs, sha_ctx);
+		filesize = ctx->file_size;
+		sha_get_hash(sha_ctx,hash_result);
+		if (ctx->tool_ctx->settings.cache_dir != NULL && ctx->is_cacheable)
+			ncacache_save(ctx->tool_ctx->settings.cache_dir, ctx->cache_key, filesize, plan, hash_result);
+		if (plan == &local_plan)
+			nxci_cleanup_pop(&plan_cleanup, 1);
+	}
+	nxci_cleanup_pop(&sha_cleanup, 1);
+	nca_set_content_info(ctx->tool_ctx->cart, index, filesize, hash_result);
+}
+
+/* Save a prepared NCA read from ctx->io to filepath, patching and hashing it on the way.
+   Meta NCA has to go last, as it's rebuilt from the other NCAs hashes. */
+void nca_process(nca_ctx_t *ctx, filepath_t *filepath) {
+    nxci_cart_t *cart = ctx->tool_ctx->cart;
+    int index = nca_type_to_index(ctx->header.content_type);
+    if (index == 3) {
+    	//Remove .nca and replace it with .xml
+    	cart->cnmt_xml.filepath = arena_strdup(cart->arena,filepath->char_path);
+    	strip_ext(cart->cnmt_xml.filepath);
+    	strcat(cart->cnmt_xml.filepath,".xml");
+    }
+
+    nxci_io_t *out = nxci_io_open(filepath->os_path, NXCI_IO_WRITE, ctx->tool_ctx->settings.io_backend, ctx->tool_ctx->settings.io_output_flags);
+    if (out == NULL) {
+        nxci_fail("Failed to open %s!", filepath->char_path);
+    }
+    nxci_cleanup_t out_cleanup;
+    nxci_cleanup_push(&out_cleanup, nxci_io_release, out);
+    nca_stream(ctx, out, 0, NULL);
+    nxci_cleanup_pop(&out_cleanup, 0);
+    if (nxci_io_close(out) != 0) {
+        nxci_fail("Failed to write %s!", filepath->char_path);
+    }
+
+	// Set filepath for creating nsp
+	cart->nsp_create_info[index].filepath = arena_strdup(cart->arena,filepath->char_path);
+}
+
+/* Write a prepared NCA patched by plan (see nca_patch_plan_build) to out, sha_ctx hashes what's written. */
+void nca_write_patched(nca_ctx_t *ctx, nca_patch_plan_t *plan, nxci_io_t *out, uint64_t out_ofs, sha_ctx_t *sha_ctx) {
+	copy_file_section(ctx->io, ctx->file_offset, ctx->file_size, out, out_ofs, plan, sha_ctx, &ctx->tool_ctx->settings.copy);
 }
 
 void nca_decrypt_key_area(nca_ctx_t *ctx) {
     if (ctx->format_version == NCAVERSION_NCA0_BETA || ctx->format_version == NCAVERSION_NCA0) return;
-    aes_ctx_t *aes_ctx = new_aes_ctx(ctx->tool_ctx->settings.keyset.key_area_keys[ctx->crypto_type][ctx->header.kaek_ind], 16, AES_MODE_ECB);
+    if (ctx->crypto_type >= 0x20 || ctx->header.kaek_ind >= 3) {
+        nxci_fail("Invalid NCA key generation or key area key index!");
+    }
+    pki_derive_generation(ctx->tool_ctx->settings.keyset, ctx->crypto_type);
+    aes_ctx_t *aes_ctx = new_aes_ctx(ctx->tool_ctx->settings.keyset->key_area_keys[ctx->crypto_type][ctx->header.kaek_ind], 16, AES_MODE_ECB);
     aes_decrypt(aes_ctx, ctx->decrypted_keys, ctx->header.encrypted_keys, 0x40);
     free_aes_ctx(aes_ctx);
 }
 
 /* Decrypt NCA header. */
 int nca_decrypt_header(nca_ctx_t *ctx) {
-    fseeko64(ctx->file, 0, SEEK_SET);
-    if (fread(&ctx->header, 1, 0xC00, ctx->file) != 0xC00) {
-        fprintf(stderr, "Failed to read NCA header!\n");
-        return 0;
+    if (nxci_io_read_at(ctx->io, &ctx->header, 0xC00, ctx->file_offset) != 0xC00) {
+        nxci_fail("Failed to read NCA header!");
     }
     ctx->is_decrypted = 0;
     
     nca_header_t dec_header;
     
-    aes_ctx_t *hdr_aes_ctx = new_aes_ctx(ctx->tool_ctx->settings.keyset.header_key, 32, AES_MODE_XTS);
+    aes_ctx_t *hdr_aes_ctx = new_aes_ctx(ctx->tool_ctx->settings.keyset->header_key, 32, AES_MODE_XTS);
     aes_xts_decrypt(hdr_aes_ctx, &dec_header, &ctx->header, 0x400, 0, 0x200);
     
     
@@ -593,8 +722,8 @@ int nca_decrypt_header(nca_ctx_t *ctx) {
         aes_xts_decrypt(hdr_aes_ctx, &dec_header, &ctx->header, 0xC00, 0, 0x200);
         ctx->header = dec_header;
     } else {
-    	fprintf(stderr, "Invalid NCA magic!\n");
-    	exit(EXIT_FAILURE);
+    	free_aes_ctx(hdr_aes_ctx);
+    	nxci_fail("Invalid NCA magic!");
     }
     free_aes_ctx(hdr_aes_ctx);
     return ctx->format_version != NCAVERSION_UNKNOWN;
@@ -603,7 +732,7 @@ int nca_decrypt_header(nca_ctx_t *ctx) {
 // Encrypt NCA header
 void nca_encrypt_header(nca_ctx_t *ctx) {
 	nca_header_t enc_header;
-	aes_ctx_t *hdr_aes_ctx = new_aes_ctx(ctx->tool_ctx->settings.keyset.header_key, 32, AES_MODE_XTS);
+	aes_ctx_t *hdr_aes_ctx = new_aes_ctx(ctx->tool_ctx->settings.keyset->header_key, 32, AES_MODE_XTS);
 	aes_xts_encrypt(hdr_aes_ctx, &enc_header, &ctx->header, 0xC00, 0, 0x200);
 	ctx->header = enc_header;
 	free_aes_ctx(hdr_aes_ctx);
@@ -134,10 +134,27 @@ enum nca_version {
     NCAVERSION_NCA3
 };
 
+/* Encrypted replacement bytes for a range of an NCA. */
+typedef struct {
+    uint64_t offset; /* Offset within the NCA. */
+    uint64_t size;
+    unsigned char *data;
+} nca_patch_t;
+
+#define NCA_MAX_PATCHES 8
+
+/* Every modification conversion makes to an NCA, sorted by offset and non-overlapping.
+   Copiers overlay it on the original bytes, so the NCA itself is never rewritten in place. */
+typedef struct nca_patch_plan {
+    unsigned int num_patches;
+    nca_patch_t patches[NCA_MAX_PATCHES];
+} nca_patch_plan_t;
+
 typedef struct {
     int is_present;
     enum nca_section_type type;
-    FILE *file; /* Pointer to file. */
+    nxci_io_t *io; /* Shared with the NCA. */
+    uint64_t file_offset; /* Offset of the NCA within io. */
     uint64_t offset;
     uint64_t size;
     uint32_t section_num;
@@ -160,11 +177,13 @@ typedef struct {
     uint32_t sector_ofs;
     int physical_reads; /* Should reads be forced physical? */
     section_crypt_type_t crypt_type;
+    nca_patch_plan_t *plan; /* Patch plan section writes are recorded into, overlaid on reads. */
 } nca_section_ctx_t;
 
 typedef struct nca_ctx {
-    FILE *file; /* File for this NCA. */
-    size_t file_size;   
+    nxci_io_t *io; /* File for this NCA. */
+    uint64_t file_offset; /* Offset of the NCA within io, non-zero when read in place from an XCI. */
+    uint64_t file_size;
     unsigned char crypto_type;
     int has_rights_id;
     int is_decrypted;
@@ -178,10 +197,16 @@ typedef struct nca_ctx {
     nca_section_ctx_t section_contexts[4];
     npdm_t *npdm;
     nca_header_t header;
+    int is_cacheable; /* cache_key is set, see ncacache_key. */
+    unsigned char cache_key[0x20];
 } nca_ctx_t;
 
 void nca_init(nca_ctx_t *ctx);
-void nca_process(nca_ctx_t *ctx, char *filepath);
+int nca_prepare(nca_ctx_t *ctx);
+void nca_process(nca_ctx_t *ctx, filepath_t *filepath);
+void nca_write_patched(nca_ctx_t *ctx, nca_patch_plan_t *plan, nxci_io_t *out, uint64_t out_ofs, struct sha_ctx *sha_ctx);
+void nca_stream(nca_ctx_t *ctx, nxci_io_t *out, uint64_t out_ofs, nca_patch_plan_t *plan);
+int nca_load_cached(nca_ctx_t *ctx, nca_patch_plan_t *plan);
 int nca_decrypt_header(nca_ctx_t *ctx);
 void nca_encrypt_header(nca_ctx_t *ctx);
 void nca_free_section_contexts(nca_ctx_t *ctx);
@@ -189,13 +214,16 @@ char *nca_get_content_type(nca_ctx_t *ctx);
 int nca_type_to_index(uint8_t nca_type);
 int nca_type_to_cnmt_type(uint8_t nca_type);
 void nca_decrypt_key_area(nca_ctx_t *ctx);
-void cnmt_nca_process(nca_ctx_t *ctx, char *filepath);
-void cnmt_nca_save(nca_ctx_t *ctx, pfs0_t *pfs0, char *filepath);
+void cnmt_nca_process(nca_ctx_t *ctx, pfs0_t *pfs0);
 void nca_update_ctr(unsigned char *ctr, uint64_t ofs);
-void exefs_npdm_process(nca_ctx_t *ctx);
+void exefs_npdm_process(nca_ctx_t *ctx, nca_patch_plan_t *plan);
 void nca_process_pfs0_section(nca_section_ctx_t *ctx);
 void nca_section_fseek(nca_section_ctx_t *ctx, uint64_t offset);
 size_t nca_section_fread(nca_section_ctx_t *ctx, void *buffer, size_t count);
-size_t nca_section_fwrite(nca_section_ctx_t *ctx, void *buffer, size_t count, uint64_t offset);
+size_t nca_section_patch(nca_section_ctx_t *ctx, void *buffer, size_t count, uint64_t offset);
+void nca_patch_plan_build(nca_ctx_t *ctx, nca_patch_plan_t *plan);
+void nca_patch_plan_add(nca_patch_plan_t *plan, uint64_t offset, const void *data, uint64_t size);
+void nca_patch_plan_apply(nca_patch_plan_t *plan, uint64_t offset, void *buffer, uint64_t size);
+void nca_patch_plan_free(nca_patch_plan_t *plan);
 
 #endif
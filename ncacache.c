@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "ncacache.h"
+#include "version.h"
+#include "sha.h"
+
+void ncacache_keyset_hash(const nca_keyset_t *keyset, unsigned char *hash) {
+    nca_keyset_t copy = *keyset;
+    copy.derived_generations = 0;
+    sha256_hash_buffer(hash, &copy, sizeof(copy));
+}
+
+int ncacache_key(hfs0_ctx_t *ctx, uint32_t i, unsigned char *key) {
+    hfs0_file_entry_t *entry = hfs0_get_file_entry(ctx->header, i);
+    const char *name = hfs0_get_file_name(ctx->header, i);
+    uint64_t offset = ctx->offset + hfs0_get_header_size(ctx->header) + entry->offset;
+
+    // The HFS0 hash only covers the start of the file, that much at least has to match it
+    if (entry->hashed_size == 0 || entry->hashed_size > entry->size ||
+        check_memory_hash_table(ctx->io, entry->hash, offset, entry->hashed_size, entry->hashed_size, 0) != VALIDITY_VALID)
+        return 0;
+
+    sha_ctx_t sha_ctx;
+    sha_ctx_init(&sha_ctx, HASH_TYPE_SHA256, 0);
+    sha_update(&sha_ctx, entry->hash, sizeof(entry->hash));
+    sha_update(&sha_ctx, &entry->hashed_size, sizeof(entry->hashed_size));
+    sha_update(&sha_ctx, &entry->size, sizeof(entry->size));
+    sha_update(&sha_ctx, name, strlen(name) + 1);
+    sha_update(&sha_ctx, ctx->tool_ctx->settings.keyset_hash, sizeof(ctx->tool_ctx->settings.keyset_hash));
+    sha_update(&sha_ctx, NXCI_VERSION, sizeof(NXCI_VERSION));
+    sha_get_hash(&sha_ctx, key);
+    sha_ctx_cleanup(&sha_ctx);
+    return 1;
+}
+
+static void ncacache_path(char *path, size_t size, const char *dir, const unsigned char *key, const char *ext) {
+    char key_hex[0x41];
+    hexBinaryString((unsigned char *)key, 0x20, key_hex, sizeof(key_hex));
+    snprintf(path, size, "%s" OS_PATH_SEPARATOR "%s.%s", dir, key_hex, ext);
+}
+
+// Whole entry in one read, NULL if it's missing or too big to be one
+static unsigned char *ncacache_read(const char *path, uint64_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    unsigned char *data = NULL;
+    if (fseeko64(f, 0, SEEK_END) == 0) {
+        *size = ftello64(f);
+        if (*size <= NCACACHE_MAX_PLAN_SIZE && (data = malloc(*size + 1)) != NULL) {
+            fseeko64(f, 0, SEEK_SET);
+            if (fread(data, 1, *size + 1, f) != *size) {
+                free(data);
+                data = NULL;
+            }
+        }
+    }
+    fclose(f);
+    return data;
+}
+
+// Written aside and renamed over, concurrent conversions never see half an entry
+static void ncacache_write(const char *path, const void *data, size_t size) {
+    char tmp_path[MAX_PATH + 0x20];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL)
+        return;
+    size_t written = fwrite(data, 1, size, f);
+    if (fclose(f) != 0 || written != size || rename(tmp_path, path) != 0)
+        remove(tmp_path);
+}
+
+int ncacache_load(const char *dir, const unsigned char *key, uint64_t nca_size, nca_patch_plan_t *plan, unsigned char *hash) {
+    char path[MAX_PATH + 0x60];
+    uint64_t size;
+    ncacache_path(path, sizeof(path), dir, key, "plan");
+    unsigned char *data = ncacache_read(path, &size);
+    if (data == NULL)
+        return -1;
+
+    memset(plan, 0, sizeof(*plan));
+    ncacache_plan_t *header = (ncacache_plan_t *)data;
+    ncacache_patch_t *patches = (ncacache_patch_t *)(data + sizeof(*header));
+    unsigned char digest[0x20];
+    int valid = size >= sizeof(*header) && header->magic == NCACACHE_PLAN_MAGIC && header->version == NCACACHE_VERSION;
+    if (valid) {
+        sha256_hash_buffer(digest, header->key, size - offsetof(ncacache_plan_t, key));
+        valid = memcmp(digest, header->digest, sizeof(digest)) == 0;
+    }
+    valid = valid && memcmp(header->key, key, sizeof(header->key)) == 0 && header->nca_size == nca_size &&
+        header->num_patches <= NCA_MAX_PATCHES && size >= sizeof(*header) + header->num_patches * sizeof(ncacache_patch_t);
+    uint64_t data_offset = valid ? sizeof(*header) + header->num_patches * sizeof(ncacache_patch_t) : 0;
+    for (uint32_t i = 0; valid && i < header->num_patches; i++) {
+        // Sorted, non-overlapping and within the NCA, like nca_patch_plan_add leaves them
+        if (patches[i].size == 0 || patches[i].size > size - data_offset || patches[i].size > nca_size ||
+            patches[i].offset > nca_size - patches[i].size ||
+            (i != 0 && patches[i].offset < patches[i - 1].offset + patches[i - 1].size)) {
+            valid = 0;
+            break;
+        }
+        plan->patches[i].offset = patches[i].offset;
+        plan->patches[i].size = patches[i].size;
+        plan->patches[i].data = nxci_malloc(patches[i].size);
+        plan->num_patches = i + 1;
+        if (plan->patches[i].data == NULL) {
+            valid = 0;
+            break;
+        }
+        memcpy(plan->patches[i].data, data + data_offset, patches[i].size);
+        data_offset += patches[i].size;
+    }
+    if (valid && data_offset == size) {
+        memcpy(hash, header->hash, sizeof(header->hash));
+    } else {
+        nca_patch_plan_free(plan);
+        valid = 0;
+    }
+    free(data);
+    return valid ? 0 : -1;
+}
+
+void ncacache_save(const char *dir, const unsigned char *key, uint64_t nca_size, const nca_patch_plan_t *plan, const unsigned char *hash) {
+    uint64_t size = sizeof(ncacache_plan_t) + plan->num_patches * sizeof(ncacache_patch_t);
+    for (unsigned int i = 0; i < plan->num_patches; i++)
+        size += plan->patches[i].size;
+    if (size > NCACACHE_MAX_PLAN_SIZE)
+        return;
+    unsigned char *data = calloc(1, size);
+    if (data == NULL)
+        return;
+
+    ncacache_plan_t *header = (ncacache_plan_t *)data;
+    ncacache_patch_t *patches = (ncacache_patch_t *)(data + sizeof(*header));
+    header->magic = NCACACHE_PLAN_MAGIC;
+    header->version = NCACACHE_VERSION;
+    memcpy(header->key, key, sizeof(header->key));
+    header->nca_size = nca_size;
+    memcpy(header->hash, hash, sizeof(header->hash));
+    header->num_patches = plan->num_patches;
+    uint64_t data_offset = sizeof(*header) + plan->num_patches * sizeof(ncacache_patch_t);
+    for (unsigned int i = 0; i < plan->num_patches; i++) {
+        patches[i].offset = plan->patches[i].offset;
+        patches[i].size = plan->patches[i].size;
+        memcpy(data + data_offset, plan->patches[i].data, plan->patches[i].size);
+        data_offset += plan->patches[i].size;
+    }
+    sha256_hash_buffer(header->digest, header->key, size - offsetof(ncacache_plan_t, key));
+
+    char path[MAX_PATH + 0x60];
+    ncacache_path(path, sizeof(path), dir, key, "plan");
+    ncacache_write(path, data, size);
+    free(data);
+}
+
+int ncacache_nsp_key(nca_ctx_t **nca_ctxs, uint64_t align, unsigned char *key) {
+    sha_ctx_t sha_ctx;
+    sha_ctx_init(&sha_ctx, HASH_TYPE_SHA256, 0);
+    for (int index = 0; index < 4; index++) {
+        if (!nca_ctxs[index]->is_cacheable) {
+            sha_ctx_cleanup(&sha_ctx);
+            return 0;
+        }
+        // The layout follows the NCAs' offsets within the XCI when aligned for --reflink
+        uint64_t block_offset = nca_ctxs[index]->file_offset & (align - 1);
+        sha_update(&sha_ctx, nca_ctxs[index]->cache_key, sizeof(nca_ctxs[index]->cache_key));
+        sha_update(&sha_ctx, &block_offset, sizeof(block_offset));
+    }
+    sha_update(&sha_ctx, &align, sizeof(align));
+    sha_get_hash(&sha_ctx, key);
+    sha_ctx_cleanup(&sha_ctx);
+    return 1;
+}
+
+static void ncacache_nsp_stat(ncacache_nsp_t *record, const struct stat *st) {
+    record->size = st->st_size;
+    record->mtime = st->st_mtime;
+#ifdef _WIN32
+    record->mtime_nsec = 0;
+#else
+    record->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+    record->dev = st->st_dev;
+    record->ino = st->st_ino;
+}
+
+int ncacache_nsp_is_current(const char *dir, const unsigned char *key, const char *nsp_path) {
+    char path[MAX_PATH + 0x60];
+    uint64_t size;
+    struct stat st;
+    if (stat(nsp_path, &st) != 0)
+        return 0;
+    ncacache_path(path, sizeof(path), dir, key, "nsp");
+    unsigned char *data = ncacache_read(path, &size);
+    if (data == NULL)
+        return 0;
+
+    ncacache_nsp_t current;
+    memset(&current, 0, sizeof(current));
+    current.magic = NCACACHE_NSP_MAGIC;
+    current.version = NCACACHE_VERSION;
+    memcpy(current.key, key, sizeof(current.key));
+    ncacache_nsp_stat(&current, &st);
+    int is_current = size == sizeof(current) && memcmp(data, &current, sizeof(current)) == 0;
+    free(data);
+    return is_current;
+}
+
+void ncacache_nsp_save(const char *dir, const unsigned char *key, const char *nsp_path) {
+    struct stat st;
+    if (stat(nsp_path, &st) != 0)
+        return;
+    ncacache_nsp_t record;
+    memset(&record, 0, sizeof(record));
+    record.magic = NCACACHE_NSP_MAGIC;
+    record.version = NCACACHE_VERSION;
+    memcpy(record.key, key, sizeof(record.key));
+    ncacache_nsp_stat(&record, &st);
+
+    char path[MAX_PATH + 0x60];
+    ncacache_path(path, sizeof(path), dir, key, "nsp");
+    ncacache_write(path, &record, sizeof(record));
+}
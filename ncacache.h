@@ -0,0 +1,63 @@
+#ifndef NXCI_NCACACHE_H
+#define NXCI_NCACACHE_H
+
+#include "types.h"
+#include "settings.h"
+#include "hfs0.h"
+#include "nca.h"
+
+#define NCACACHE_PLAN_MAGIC 0x5043584E /* "NXCP" */
+#define NCACACHE_NSP_MAGIC 0x4E43584E /* "NXCN" */
+#define NCACACHE_VERSION 1
+#define NCACACHE_MAX_PLAN_SIZE 0x1000000
+
+/* What converting an NCA came to, saved in <cache_dir>/<key>.plan. The patched NCA is the original with the patches
+   laid over it, so it can be written again in one copy pass, without building the plan or hashing anything.
+   Followed by num_patches ncacache_patch_t, then their data. Native byte order. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char digest[0x20]; /* SHA-256 of the rest of the entry, a damaged one is ignored. */
+    unsigned char key[0x20];
+    uint64_t nca_size;
+    unsigned char hash[0x20]; /* SHA-256 of the patched NCA, the first half is its NCA ID. */
+    uint32_t num_patches;
+    uint32_t _0x74;
+} ncacache_plan_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} ncacache_patch_t;
+
+/* The nsp a cart was last converted to, saved in <cache_dir>/<cart key>.nsp.
+   It's up to date as long as the file at its path is still that one, unmodified. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char key[0x20];
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t dev;
+    uint64_t ino;
+} ncacache_nsp_t;
+
+/* Fingerprint of the keys a conversion starts with, part of every key. */
+void ncacache_keyset_hash(const nca_keyset_t *keyset, unsigned char *hash);
+
+/* Key of file i of the secure partition: its HFS0 hash, hashed size, size and name, the keyset and the tool version.
+   Returns 0 when the HFS0 hash doesn't match the file, which is then never cached. */
+int ncacache_key(hfs0_ctx_t *ctx, uint32_t i, unsigned char *key);
+
+/* Returns 0 and fills plan (freed with nca_patch_plan_free) and hash if the NCA is cached. */
+int ncacache_load(const char *dir, const unsigned char *key, uint64_t nca_size, nca_patch_plan_t *plan, unsigned char *hash);
+/* Best effort, like every write to the cache. */
+void ncacache_save(const char *dir, const unsigned char *key, uint64_t nca_size, const nca_patch_plan_t *plan, const unsigned char *hash);
+
+/* Key of the nsp made from nca_ctxs with entries aligned to align, 0 unless all of them are cacheable. */
+int ncacache_nsp_key(nca_ctx_t **nca_ctxs, uint64_t align, unsigned char *key);
+int ncacache_nsp_is_current(const char *dir, const unsigned char *key, const char *nsp_path);
+void ncacache_nsp_save(const char *dir, const unsigned char *key, const char *nsp_path);
+
+#endif
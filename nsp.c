@@ -2,165 +2,595 @@
 #include <stdint.h>
 #include <string.h>
 #include <libgen.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 #include "nsp.h"
 #include "dummy_files.h"
 #include "cnmt.h"
 #include "utils.h"
+#include "io.h"
+#include "sha.h"
+#include "workpool.h"
+#include "lib4nxci.h"
+#include "ncacache.h"
 
-/* Create .cnmt.xml
+/* Render .cnmt.xml into buf, returns its size
  The process is done without xml libs cause i don't want to add more dependency for now
   */
-void create_cnmt_xml()
-{
-	printf("Creating .cnmt.xml %s\n", cnmt_xml.filepath);
-	FILE *file = fopen(cnmt_xml.filepath,"wb");
-	fprintf(file,"<?xml version=\"1.0\" encoding=\"utf-8\"?>\x0D\x0A");
-	fprintf(file,"<ContentMeta>\x0D\x0A");
-	fprintf(file,"  <Type>Application</Type>\x0D\x0A");
-	fprintf(file,"  <Id>0x%s</Id>\x0D\x0A",cnmt_xml.tid);
-	fprintf(file,"  <Version>0</Version>\x0D\x0A");
-	fprintf(file,"  <RequiredDownloadSystemVersion>0</RequiredDownloadSystemVersion>\x0D\x0A");
+static uint64_t cnmt_xml_render(nxci_cart_t *cart, char *buf, size_t size)
+{
+	size_t len = 0;
+	len += snprintf(buf + len, size - len, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\x0D\x0A");
+	len += snprintf(buf + len, size - len, "<ContentMeta>\x0D\x0A");
+	len += snprintf(buf + len, size - len, "  <Type>Application</Type>\x0D\x0A");
+	len += snprintf(buf + len, size - len, "  <Id>0x%s</Id>\x0D\x0A",cart->cnmt_xml.tid);
+	len += snprintf(buf + len, size - len, "  <Version>0</Version>\x0D\x0A");
+	len += snprintf(buf + len, size - len, "  <RequiredDownloadSystemVersion>0</RequiredDownloadSystemVersion>\x0D\x0A");
 	for (int index=0;index<4;index++) {
-		fprintf(file,"  <Content>\x0D\x0A");
-		fprintf(file,"    <Type>%s</Type>\x0D\x0A", cnmt_xml.contents[index].type);
-		fprintf(file,"    <Id>%s</Id>\x0D\x0A", cnmt_xml.contents[index].id);
-		fprintf(file,"    <Size>%" PRIu64 "</Size>\x0D\x0A", cnmt_xml.contents[index].size);
-		fprintf(file,"    <Hash>%s</Hash>\x0D\x0A", cnmt_xml.contents[index].hash);
-		fprintf(file,"    <KeyGeneration>%u</KeyGeneration>\x0D\x0A", cnmt_xml.contents[index].keygeneration);
-		fprintf(file,"  </Content>\x0D\x0A");
+		len += snprintf(buf + len, size - len, "  <Content>\x0D\x0A");
+		len += snprintf(buf + len, size - len, "    <Type>%s</Type>\x0D\x0A", cart->cnmt_xml.contents[index].type);
+		len += snprintf(buf + len, size - len, "    <Id>%s</Id>\x0D\x0A", cart->cnmt_xml.contents[index].id);
+		len += snprintf(buf + len, size - len, "    <Size>%" PRIu64 "</Size>\x0D\x0A", cart->cnmt_xml.contents[index].size);
+		len += snprintf(buf + len, size - len, "    <Hash>%s</Hash>\x0D\x0A", cart->cnmt_xml.contents[index].hash);
+		len += snprintf(buf + len, size - len, "    <KeyGeneration>%u</KeyGeneration>\x0D\x0A", cart->cnmt_xml.contents[index].keygeneration);
+		len += snprintf(buf + len, size - len, "  </Content>\x0D\x0A");
 	}
 	// Hardcode Digest, it's an unknown value
-	fprintf(file,"  <Digest>0000000000000000000000000000000000000000000000000000000000000000</Digest>\x0D\x0A");
-	fprintf(file,"  <KeyGenerationMin>%u</KeyGenerationMin>\x0D\x0A",cnmt_xml.contents[3].keygeneration);
+	len += snprintf(buf + len, size - len, "  <Digest>0000000000000000000000000000000000000000000000000000000000000000</Digest>\x0D\x0A");
+	len += snprintf(buf + len, size - len, "  <KeyGenerationMin>%u</KeyGenerationMin>\x0D\x0A",cart->cnmt_xml.contents[3].keygeneration);
 	// Setting RequiredSystemVersion  to 1.0.0 firmware
-	fprintf(file,"  <RequiredSystemVersion>0</RequiredSystemVersion>\x0D\x0A");
+	len += snprintf(buf + len, size - len, "  <RequiredSystemVersion>0</RequiredSystemVersion>\x0D\x0A");
 	// PatchId is always equals to first 13 chars of title id + 800
-	fprintf(file,"  <PatchId>0x%.*s800</PatchId>\x0D\x0A",13,cnmt_xml.tid);
-	fprintf(file,"</ContentMeta>");
+	len += snprintf(buf + len, size - len, "  <PatchId>0x%.*s800</PatchId>\x0D\x0A",13,cart->cnmt_xml.tid);
+	len += snprintf(buf + len, size - len, "</ContentMeta>");
+	if (len >= size) {
+		nxci_fail("cnmt.xml buffer too small!");
+	}
+	return len;
+}
+
+/* Create .cnmt.xml */
+void create_cnmt_xml(nxci_ctx_t *tool_ctx)
+{
+	nxci_cart_t *cart = tool_ctx->cart;
+	nxci_log(tool_ctx, "Creating .cnmt.xml %s\n", cart->cnmt_xml.filepath);
+	char xml[CNMT_XML_MAX_SIZE];
+	uint64_t xml_size = cnmt_xml_render(cart, xml, sizeof(xml));
+	FILE *file = fopen(cart->cnmt_xml.filepath,"wb");
+	if (file == NULL) {
+		nxci_fail("unable to create .cnmt.xml");
+	}
+	if (fwrite(xml,1,xml_size,file) != xml_size) {
+		fclose(file);
+		nxci_fail("unable to create .cnmt.xml");
+	}
 
 	// Set file size for creating nsp
-	nsp_create_info[4].filesize = (uint64_t)ftello64(file);
+	cart->nsp_create_info[4].filesize = xml_size;
 	// Set file path for creating nsp
-	nsp_create_info[4].filepath = cnmt_xml.filepath;
-	nsp_create_info[4].nsp_filename = (char*)calloc(1,42);
+	cart->nsp_create_info[4].filepath = cart->cnmt_xml.filepath;
 	// Set new filename for creating nsp
-	strcpy(nsp_create_info[4].nsp_filename,cnmt_xml.contents[3].id);
-	strcat(nsp_create_info[4].nsp_filename,".cnmt.xml");
+	cart->nsp_create_info[4].nsp_filename = arena_printf(cart->arena,"%s.cnmt.xml",cart->cnmt_xml.contents[3].id);
 	fclose(file);
 
 }
 
-void create_dummy_cert(filepath_t filepath)
+void create_dummy_cert(nxci_ctx_t *tool_ctx)
 {
+	nxci_cart_t *cart = tool_ctx->cart;
 	filepath_t dummy_cert_path;
-	filepath_copy(&dummy_cert_path,&filepath);
+	filepath_copy(&dummy_cert_path,&tool_ctx->settings.secure_dir_path);
 	// cert filename is: title id (16 bytes) + key generation (16 bytes) + .cert
-	filepath_append(&dummy_cert_path,"%s000000000000000%u.cert",cnmt_xml.tid,cnmt_xml.contents[3].keygeneration);
-	printf("Creating dummy cert %s\n",dummy_cert_path.char_path);
+	filepath_append(&dummy_cert_path,"%s000000000000000%u.cert",cart->cnmt_xml.tid,cart->cnmt_xml.contents[3].keygeneration);
+	nxci_log(tool_ctx, "Creating dummy cert %s\n",dummy_cert_path.char_path);
 	FILE *file;
 	if (!(file = fopen(dummy_cert_path.char_path, "wb"))) {
-    	fprintf(stderr,"unable to create dummy cert\n");
-    	exit(EXIT_FAILURE);
+    	nxci_fail("unable to create dummy cert");
 	}
 	fwrite(dummy_cert,1,DUMMYCERTSIZE,file);
 	fclose(file);
 
 	// Set file size for creating nsp
-	nsp_create_info[5].filesize = DUMMYCERTSIZE;
+	cart->nsp_create_info[5].filesize = DUMMYCERTSIZE;
 	// Set file name for creating nsp
-	nsp_create_info[5].filepath = (char*)calloc(1,strlen(dummy_cert_path.char_path)+1);
-	strcpy(nsp_create_info[5].filepath,dummy_cert_path.char_path);
+	cart->nsp_create_info[5].filepath = arena_strdup(cart->arena,dummy_cert_path.char_path);
 	// Set new filename for creating nsp
-	nsp_create_info[5].nsp_filename = basename(nsp_create_info[5].filepath);
+	cart->nsp_create_info[5].nsp_filename = basename(cart->nsp_create_info[5].filepath);
 }
 
-void create_dummy_tik(filepath_t filepath)
+void create_dummy_tik(nxci_ctx_t *tool_ctx)
 {
+	nxci_cart_t *cart = tool_ctx->cart;
 	filepath_t dummy_tik_path;
-	filepath_copy(&dummy_tik_path,&filepath);
+	filepath_copy(&dummy_tik_path,&tool_ctx->settings.secure_dir_path);
 	// tik filename is: title id (16 bytes) + key generation (16 bytes) + .tik
-	filepath_append(&dummy_tik_path,"%s000000000000000%u.tik",cnmt_xml.tid,cnmt_xml.contents[3].keygeneration);
-	printf("Creating dummy tik %s\n\n",dummy_tik_path.char_path);
+	filepath_append(&dummy_tik_path,"%s000000000000000%u.tik",cart->cnmt_xml.tid,cart->cnmt_xml.contents[3].keygeneration);
+	nxci_log(tool_ctx, "Creating dummy tik %s\n\n",dummy_tik_path.char_path);
 	FILE *file;
 	if (!(file = fopen(dummy_tik_path.char_path, "wb"))) {
-		fprintf(stderr,"unable to create dummy tik\n");
-		exit(EXIT_FAILURE);
+		nxci_fail("unable to create dummy tik");
 	}
 	fwrite(dummy_tik,1,DUMMYTIKSIZE,file);
 	fclose(file);
 
 	// Set file size for creating nsp
-	nsp_create_info[6].filesize = DUMMYTIKSIZE;
+	cart->nsp_create_info[6].filesize = DUMMYTIKSIZE;
 	// Set file path for creating nsp
-	nsp_create_info[6].filepath = (char*)calloc(1,strlen(dummy_tik_path.char_path) + 1);
-	strcpy(nsp_create_info[6].filepath,dummy_tik_path.char_path);
+	cart->nsp_create_info[6].filepath = arena_strdup(cart->arena,dummy_tik_path.char_path);
 	// Set new filename for creating nsp
-	nsp_create_info[6].nsp_filename = basename(nsp_create_info[6].filepath);
+	cart->nsp_create_info[6].nsp_filename = basename(cart->nsp_create_info[6].filepath);
 }
 
-void create_nsp()
+// nsp file name is tid.nsp, it goes in the job's output directory
+static char *nsp_get_path(nxci_ctx_t *tool_ctx)
 {
-	// nsp file name is tid.nsp
-	char *nsp_path = (char*)calloc(1,21);
-	strcpy(nsp_path,cnmt_xml.tid);
-	strcat(nsp_path,".nsp");
-	printf("Creating nsp %s\n",nsp_path);
-	nsp_header_t nsp_header = { .magic = {0x50 , 0x46, 0x53,  0x30}, // PFS0
+	nxci_cart_t *cart = tool_ctx->cart;
+	if (tool_ctx->job->output_dir != NULL)
+		cart->nsp_path = arena_printf(cart->arena,"%s" OS_PATH_SEPARATOR "%s.nsp",tool_ctx->job->output_dir,cart->cnmt_xml.tid);
+	else
+		cart->nsp_path = arena_printf(cart->arena,"%s.nsp",cart->cnmt_xml.tid);
+	snprintf(tool_ctx->job->nsp_path, sizeof(tool_ctx->job->nsp_path), "%s", cart->nsp_path);
+	return cart->nsp_path;
+}
+
+/* Move an entry at offset forward until it sits at the same place within a block as its source
+   With --reflink every NCA is laid out like this so its unpatched blocks can be cloned, align is 1 otherwise */
+static uint64_t nsp_align_entry(uint64_t offset, uint64_t align, uint64_t src_offset)
+{
+	return offset + ((src_offset - offset) & (align - 1));
+}
+
+// header_size past sizeof(nsp_header_t) is string table padding, entry offsets come from nsp_create_info
+static void nsp_build_header(nxci_cart_t *cart, nsp_header_t *nsp_header, uint64_t header_size)
+{
+	*nsp_header = (nsp_header_t) { .magic = {0x50 , 0x46, 0x53,  0x30}, // PFS0
 								.files_count = 7, // Always 7 files
-								.string_table_size = 280, 	// Always 280 bytes
+								.string_table_size = 280 + header_size - sizeof(nsp_header_t), 	// 280 bytes of filenames
 								.string_table = {0},
 								.reserved = 0,
 	};
 
-	uint64_t offset = 0;
 	uint32_t filename_offset = 0;
 
 	for (int index=0;index<7;index++) {
-		nsp_header.file_entry_table[index].offset = offset;
-		nsp_header.file_entry_table[index].filename_offset = filename_offset;
-		nsp_header.file_entry_table[index].padding = 0;
-		nsp_header.file_entry_table[index].size = nsp_create_info[index].filesize;
-		offset += nsp_create_info[index].filesize;
-		strcpy(nsp_header.string_table + filename_offset,nsp_create_info[index].nsp_filename);
-		filename_offset += strlen(nsp_create_info[index].nsp_filename) + 1;
-	}
-
-	FILE *nsp_file;
-	if ((nsp_file = fopen(nsp_path, "wb")) == NULL) {
-    	fprintf(stderr,"unable to create nsp\n");
-    	exit(EXIT_FAILURE);
-	}
-	fwrite(&nsp_header,sizeof(nsp_header),1,nsp_file);
-
-	for (int index2=0;index2<7;index2++) {
-		FILE *nsp_data_file = fopen(nsp_create_info[index2].filepath, "rb");
-		printf("Packing %s into %s\n",nsp_create_info[index2].filepath, nsp_path);
-
-			if (nsp_data_file == NULL) {
-			    fprintf(stderr, "Failed to open %s!\n", nsp_create_info[index2].filepath);
-			    exit(EXIT_FAILURE);
-			}
-		    uint64_t read_size = 0x4000000; // 4 MB buffer.
-			unsigned char *buf = malloc(read_size);
-			if (buf == NULL) {
-			    fprintf(stderr, "Failed to allocate file-read buffer!\n");
-			    exit(EXIT_FAILURE);
-			}
-
-			uint64_t ofs = 0;
-			while (ofs < nsp_create_info[index2].filesize) {
-			    if (ofs + read_size >= nsp_create_info[index2].filesize) read_size = nsp_create_info[index2].filesize - ofs;
-			    if (fread(buf, 1, read_size, nsp_data_file) != read_size) {
-			        fprintf(stderr, "Failed to read file %s\n",nsp_create_info[index2].filepath);
-			        exit(EXIT_FAILURE);
-			    }
-			    fwrite(buf,read_size,1,nsp_file);
-			    ofs += read_size;
-			}
-		fclose(nsp_data_file);
-	}
-
-	fclose(nsp_file);
-	free(nsp_path);
-	printf("\n");
+		nsp_header->file_entry_table[index].offset = cart->nsp_create_info[index].offset - header_size;
+		nsp_header->file_entry_table[index].filename_offset = filename_offset;
+		nsp_header->file_entry_table[index].padding = 0;
+		nsp_header->file_entry_table[index].size = cart->nsp_create_info[index].filesize;
+		strcpy(nsp_header->string_table + filename_offset,cart->nsp_create_info[index].nsp_filename);
+		filename_offset += strlen(cart->nsp_create_info[index].nsp_filename) + 1;
+	}
+}
+
+typedef struct nsp_out {
+	nxci_io_t *io;
+	const char *path; /* NULL for settings.nsp_pipe. */
+	char *tmp_path; /* Written there and renamed to path once complete. */
+	nxci_cleanup_t cleanup;
+	struct nsp_out *next;
+} nsp_out_t;
+
+/* nsps being written by conversions of this process, two of them never write the same one. */
+static pthread_mutex_t nsp_writing_lock = PTHREAD_MUTEX_INITIALIZER;
+static nsp_out_t *nsp_writing;
+
+static int nsp_claim(nsp_out_t *out)
+{
+	pthread_mutex_lock(&nsp_writing_lock);
+	nsp_out_t *cur;
+	for (cur = nsp_writing; cur != NULL; cur = cur->next) {
+		if (strcmp(cur->path, out->path) == 0)
+			break;
+	}
+	if (cur == NULL) {
+		out->next = nsp_writing;
+		nsp_writing = out;
+	}
+	pthread_mutex_unlock(&nsp_writing_lock);
+	return cur == NULL;
+}
+
+static void nsp_unclaim(nsp_out_t *out)
+{
+	pthread_mutex_lock(&nsp_writing_lock);
+	for (nsp_out_t **link = &nsp_writing; *link != NULL; link = &(*link)->next) {
+		if (*link == out) {
+			*link = out->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&nsp_writing_lock);
+}
+
+// A failed conversion doesn't leave a partial nsp behind, nor touches an nsp already there
+static void nsp_discard(void *arg)
+{
+	nsp_out_t *out = arg;
+	nxci_io_close(out->io);
+	if (out->path != NULL) {
+		remove(out->tmp_path);
+		nsp_unclaim(out);
+	}
+}
+
+// Open the nsp for writing, settings.nsp_pipe if nsp_path is NULL
+static nxci_io_t *nsp_open(nsp_out_t *out, const char *nsp_path, nxci_ctx_t *tool_ctx)
+{
+	out->path = nsp_path;
+	if (nsp_path != NULL) {
+		if (!nsp_claim(out)) {
+			nxci_fail("%s is already being written by another conversion", nsp_path);
+		}
+		out->tmp_path = arena_printf(tool_ctx->cart->arena,"%s.%ld.partial",nsp_path,(long)getpid());
+		filepath_t filepath;
+		filepath_set(&filepath, out->tmp_path);
+		out->io = nxci_io_open(filepath.os_path, NXCI_IO_WRITE, tool_ctx->settings.io_backend, tool_ctx->settings.io_output_flags);
+		if (out->io == NULL)
+			nsp_unclaim(out);
+	} else {
+		out->io = nxci_io_open_sequential(tool_ctx->settings.nsp_pipe);
+	}
+	if (out->io == NULL) {
+		nxci_fail("unable to create nsp");
+	}
+	nxci_cleanup_push(&out->cleanup, nsp_discard, out);
+	return out->io;
+}
+
+static void nsp_close(nsp_out_t *out)
+{
+	nxci_cleanup_pop(&out->cleanup, 0);
+	int failed = nxci_io_close(out->io) != 0;
+	if (out->path != NULL) {
+#ifdef _WIN32
+		if (!failed)
+			remove(out->path);
+#endif
+		if (failed || rename(out->tmp_path, out->path) != 0) {
+			remove(out->tmp_path);
+			failed = 1;
+		}
+		nsp_unclaim(out);
+	}
+	if (failed) {
+		nxci_fail("Failed to write nsp!");
+	}
+}
+
+// Write a small in-memory nsp entry
+static void nsp_write_buffer(nxci_io_t *nsp_io, uint64_t offset, const void *buf, uint64_t size)
+{
+	if (nxci_io_write_at(nsp_io, buf, size, offset) != size) {
+		nxci_fail("Failed to write nsp!");
+	}
+}
+
+// Preallocate the nsp so parallel writers fill one extent, cloned NCAs bring their own blocks
+static void nsp_preallocate(nxci_io_t *nsp_io, uint64_t size, nxci_ctx_t *tool_ctx)
+{
+	if (!tool_ctx->settings.copy.reflink)
+		nxci_io_preallocate(nsp_io, size);
+}
+
+typedef struct {
+	int index;
+	const char *nsp_path;
+	nxci_io_t *nsp_io;
+	nxci_ctx_t *tool_ctx;
+} nsp_pack_job_t;
+
+// Copy one extracted file into its slot of the nsp
+static void nsp_pack_file(void *arg)
+{
+	nsp_pack_job_t *job = arg;
+	nxci_ctx_t *tool_ctx = job->tool_ctx;
+	nsp_create_info_t *info = &tool_ctx->cart->nsp_create_info[job->index];
+	filepath_t data_path;
+	filepath_set(&data_path, info->filepath);
+	nxci_io_t *data_io = nxci_io_open(data_path.os_path, NXCI_IO_READ, tool_ctx->settings.io_backend, tool_ctx->settings.io_input_flags);
+	nxci_log(tool_ctx, "Packing %s into %s\n",info->filepath, job->nsp_path);
+
+	if (data_io == NULL) {
+	    nxci_fail("Failed to open %s!", info->filepath);
+	}
+	nxci_cleanup_t data_cleanup;
+	nxci_cleanup_push(&data_cleanup, nxci_io_release, data_io);
+	copy_file_section(data_io, 0, info->filesize, job->nsp_io, info->offset, NULL, NULL, &tool_ctx->settings.copy);
+	nxci_cleanup_pop(&data_cleanup, 1);
+}
+
+/* Pack extracted files into nsp
+   Every offset is known from the file sizes, so the nsp is preallocated and all entries are written in parallel
+   Header goes last, an interrupted run never leaves a valid looking nsp behind */
+void create_nsp(nxci_ctx_t *tool_ctx)
+{
+	nxci_cart_t *cart = tool_ctx->cart;
+	char *nsp_path = nsp_get_path(tool_ctx);
+	nxci_log(tool_ctx, "Creating nsp %s\n",nsp_path);
+	// NCAs are cloned from the start of their files
+	uint64_t align = tool_ctx->settings.copy.reflink ? COPY_CLONE_ALIGN : 1;
+	uint64_t header_size = nsp_align_entry(sizeof(nsp_header_t), align, 0);
+	uint64_t offset = header_size;
+	for (int index=0;index<7;index++) {
+		if (index < 4)
+			offset = nsp_align_entry(offset, align, 0);
+		cart->nsp_create_info[index].offset = offset;
+		offset += cart->nsp_create_info[index].filesize;
+		nxci_job_add_total(tool_ctx->job, cart->nsp_create_info[index].filesize);
+	}
+
+	nsp_out_t out;
+	nxci_io_t *nsp_io = nsp_open(&out, nsp_path, tool_ctx);
+	nsp_preallocate(nsp_io, offset, tool_ctx);
+
+	nsp_pack_job_t jobs[7];
+	void *job_ptrs[7];
+	for (int index=0;index<7;index++) {
+		jobs[index].index = index;
+		jobs[index].nsp_path = nsp_path;
+		jobs[index].nsp_io = nsp_io;
+		jobs[index].tool_ctx = tool_ctx;
+		job_ptrs[index] = &jobs[index];
+	}
+	workpool_run(tool_ctx->settings.num_workers, nsp_pack_file, job_ptrs, 7);
+
+	nsp_header_t nsp_header;
+	nsp_build_header(cart, &nsp_header, header_size);
+	nsp_write_buffer(nsp_io, 0, &nsp_header, sizeof(nsp_header));
+
+	nsp_close(&out);
+	nxci_log(tool_ctx, "\n");
+}
+
+// Render cnmt.xml and lay out the entries following the meta NCA: cnmt.xml, cert and tik
+static void nsp_prepare_tail(nxci_cart_t *cart, char *xml, uint64_t offset)
+{
+	cart->nsp_create_info[4].filesize = cnmt_xml_render(cart, xml, CNMT_XML_MAX_SIZE);
+	cart->nsp_create_info[4].nsp_filename = arena_printf(cart->arena,"%s.cnmt.xml",cart->cnmt_xml.contents[3].id);
+	cart->nsp_create_info[4].offset = offset;
+	offset += cart->nsp_create_info[4].filesize;
+
+	// cert and tik filenames are: title id (16 bytes) + key generation (16 bytes)
+	cart->nsp_create_info[5].filesize = DUMMYCERTSIZE;
+	cart->nsp_create_info[5].nsp_filename = arena_printf(cart->arena,"%s000000000000000%u.cert",cart->cnmt_xml.tid,cart->cnmt_xml.contents[3].keygeneration);
+	cart->nsp_create_info[5].offset = offset;
+	offset += DUMMYCERTSIZE;
+
+	cart->nsp_create_info[6].filesize = DUMMYTIKSIZE;
+	cart->nsp_create_info[6].nsp_filename = arena_printf(cart->arena,"%s000000000000000%u.tik",cart->cnmt_xml.tid,cart->cnmt_xml.contents[3].keygeneration);
+	cart->nsp_create_info[6].offset = offset;
+}
+
+static void nsp_write_tail(nxci_cart_t *cart, nxci_io_t *nsp_io, const char *xml)
+{
+	nsp_write_buffer(nsp_io, cart->nsp_create_info[4].offset, xml, cart->nsp_create_info[4].filesize);
+	nsp_write_buffer(nsp_io, cart->nsp_create_info[5].offset, dummy_cert, DUMMYCERTSIZE);
+	nsp_write_buffer(nsp_io, cart->nsp_create_info[6].offset, dummy_tik, DUMMYTIKSIZE);
+}
+
+typedef struct {
+	nca_ctx_t *nca_ctx;
+	const char *nsp_path;
+	nxci_io_t *nsp_io;
+	uint64_t offset; /* Offset of the NCA within the nsp. */
+} nsp_stream_job_t;
+
+// Stream one NCA into its slot of the nsp, input and output are shared positional handles
+static void nsp_stream_nca(void *arg)
+{
+	nsp_stream_job_t *job = arg;
+	nxci_log(job->nca_ctx->tool_ctx, "Packing %s NCA into %s\n", nca_get_content_type(job->nca_ctx), job->nsp_path);
+	nca_stream(job->nca_ctx, job->nsp_io, job->offset, NULL);
+}
+
+/* Convert secure partition straight into nsp
+   Each NCA is read once from the XCI and written patched into the nsp, no staging files are used
+   The nsp layout only depends on NCA sizes, so Program, Control and LegalInformation NCAs are streamed into their slots in parallel
+   Header is written last once filenames (hashes) are known */
+void create_nsp_stream(hfs0_ctx_t *ctx)
+{
+	nxci_cart_t *cart = ctx->tool_ctx->cart;
+	nca_ctx_t **nca_ctxs = cart->nca_ctxs;
+	uint32_t entries[4];
+
+	// Decrypt all NCA headers first, cnmt needs every content before it can be built
+	hfs0_prepare_ncas(ctx, nca_ctxs, entries);
+
+	char *nsp_path = nsp_get_path(ctx->tool_ctx);
+	// With --reflink each NCA shares its block alignment within the XCI, so unpatched blocks can be cloned
+	uint64_t align = ctx->tool_ctx->settings.copy.reflink ? COPY_CLONE_ALIGN : 1;
+
+	// The nsp this cart was converted to last time is kept, as long as nothing touched it since
+	const char *cache_dir = ctx->tool_ctx->settings.cache_dir;
+	unsigned char nsp_key[0x20];
+	int cacheable = cache_dir != NULL && ncacache_nsp_key(nca_ctxs, align, nsp_key);
+	if (cacheable && ncacache_nsp_is_current(cache_dir, nsp_key, nsp_path)) {
+		nxci_log(ctx->tool_ctx, "%s is up to date\n", nsp_path);
+		return;
+	}
+
+	nxci_log(ctx->tool_ctx, "Creating nsp %s\n",nsp_path);
+	nsp_out_t out;
+	nxci_io_t *nsp_io = nsp_open(&out, nsp_path, ctx->tool_ctx);
+
+	// Header goes in front, filenames are not known yet
+	uint64_t header_size = nsp_align_entry(sizeof(nsp_header_t), align, nca_ctxs[0]->file_offset);
+	nsp_header_t nsp_header;
+	nsp_stream_job_t jobs[3];
+	void *job_ptrs[3];
+	uint64_t offset = header_size;
+	for (int index=0;index<3;index++) {
+		offset = nsp_align_entry(offset, align, nca_ctxs[index]->file_offset);
+		cart->nsp_create_info[index].offset = offset;
+		jobs[index].nca_ctx = nca_ctxs[index];
+		jobs[index].nsp_path = nsp_path;
+		jobs[index].nsp_io = nsp_io;
+		jobs[index].offset = offset;
+		job_ptrs[index] = &jobs[index];
+		offset += nca_ctxs[index]->file_size;
+		nxci_job_add_total(ctx->tool_ctx->job, nca_ctxs[index]->file_size);
+	}
+	// Meta NCA, cnmt.xml, cert and tik are a few KB appended past this
+	nsp_preallocate(nsp_io, offset, ctx->tool_ctx);
+	workpool_run(ctx->tool_ctx->settings.num_workers, nsp_stream_nca, job_ptrs, 3);
+
+	// Meta NCA needs the hashes of the others
+	nxci_log(ctx->tool_ctx, "Packing %s NCA into %s\n", cart->cnmt_xml.contents[3].type, nsp_path);
+	// Rebuilt, nothing to clone
+	cart->nsp_create_info[3].offset = offset;
+	nca_stream(nca_ctxs[3], nsp_io, offset, NULL);
+	offset += cart->nsp_create_info[3].filesize;
+
+	char xml[CNMT_XML_MAX_SIZE];
+	nsp_prepare_tail(cart, xml, offset);
+	nsp_write_tail(cart, nsp_io, xml);
+
+	nsp_build_header(cart, &nsp_header, header_size);
+	nsp_write_buffer(nsp_io, 0, &nsp_header, sizeof(nsp_header));
+
+	nsp_close(&out);
+	if (cacheable)
+		ncacache_nsp_save(cache_dir, nsp_key, nsp_path);
+	nxci_log(ctx->tool_ctx, "\n");
+}
+
+typedef struct {
+	nca_ctx_t *nca_ctx;
+	const char *type; /* The header is encrypted again once the NCA is written. */
+	nxci_io_t *buf_io; /* Patched NCA kept from the hash pass, NULL when it's read again. */
+	nca_patch_plan_t plan; /* Kept for the second pass. */
+	int cached; /* Plan and hash came from the cache, no hash pass. */
+} nsp_pipe_job_t;
+
+// Hash pass, the NCA is patched and hashed but only kept if it got a buffer
+static void nsp_pipe_hash_nca(void *arg)
+{
+	nsp_pipe_job_t *job = arg;
+	nxci_log(job->nca_ctx->tool_ctx, "Hashing %s NCA\n", job->type);
+	nxci_io_t *out = job->buf_io != NULL ? job->buf_io : nxci_io_open_null();
+	nxci_cleanup_t out_cleanup;
+	if (job->buf_io == NULL)
+		nxci_cleanup_push(&out_cleanup, nxci_io_release, out);
+	nca_stream(job->nca_ctx, out, 0, &job->plan);
+	if (job->buf_io == NULL)
+		nxci_cleanup_pop(&out_cleanup, 1);
+}
+
+// Buffers and plans kept for the second pass, whichever weren't written yet
+static void nsp_pipe_release(void *arg)
+{
+	nsp_pipe_job_t *jobs = arg;
+	for (int index=0;index<3;index++) {
+		if (jobs[index].buf_io != NULL)
+			nxci_io_close(jobs[index].buf_io);
+		nca_patch_plan_free(&jobs[index].plan);
+	}
+}
+
+/* Convert secure partition into an nsp written strictly in order to a pipe or stdout
+   Filenames in the header are content hashes, so every NCA is hashed in a first pass that writes nothing
+   NCAs fitting in --pipe-buffer are kept from that pass, the others are read and patched again while being written */
+void create_nsp_pipe(hfs0_ctx_t *ctx)
+{
+	nxci_ctx_t *tool_ctx = ctx->tool_ctx;
+	nxci_cart_t *cart = tool_ctx->cart;
+	nca_ctx_t **nca_ctxs = cart->nca_ctxs;
+	uint32_t entries[4];
+
+	hfs0_prepare_ncas(ctx, nca_ctxs, entries);
+	nsp_out_t out;
+	nxci_io_t *nsp_io = nsp_open(&out, NULL, tool_ctx);
+	nxci_log(tool_ctx, "Creating nsp on stdout\n");
+
+	uint64_t budget = tool_ctx->settings.pipe_buffer_size;
+	nsp_pipe_job_t jobs[3];
+	void *job_ptrs[3];
+	unsigned int num_hashed = 0;
+	nxci_cleanup_t jobs_cleanup;
+	memset(jobs, 0, sizeof(jobs));
+	nxci_cleanup_push(&jobs_cleanup, nsp_pipe_release, jobs);
+	for (int index=0;index<3;index++) {
+		jobs[index].nca_ctx = nca_ctxs[index];
+		jobs[index].type = nca_get_content_type(nca_ctxs[index]);
+		nxci_job_add_total(tool_ctx->job, nca_ctxs[index]->file_size);
+		// Cached NCAs are only read while being written
+		if ((jobs[index].cached = nca_load_cached(nca_ctxs[index], &jobs[index].plan)))
+			continue;
+		// Read once for the hash pass, again unless it's kept
+		if (nca_ctxs[index]->file_size <= budget) {
+			jobs[index].buf_io = nxci_io_open_memory(nca_ctxs[index]->file_size);
+			budget -= nca_ctxs[index]->file_size;
+		} else {
+			nxci_job_add_total(tool_ctx->job, nca_ctxs[index]->file_size);
+		}
+		job_ptrs[num_hashed++] = &jobs[index];
+	}
+	workpool_run(tool_ctx->settings.num_workers, nsp_pipe_hash_nca, job_ptrs, num_hashed);
+
+	// Meta NCA is a few KB, always kept
+	nxci_io_t *meta_io = nxci_io_open_memory(0x1000);
+	nxci_cleanup_t meta_cleanup;
+	nxci_cleanup_push(&meta_cleanup, nxci_io_release, meta_io);
+	nca_stream(nca_ctxs[3], meta_io, 0, NULL);
+
+	uint64_t offset = sizeof(nsp_header_t);
+	for (int index=0;index<4;index++) {
+		cart->nsp_create_info[index].offset = offset;
+		offset += cart->nsp_create_info[index].filesize;
+	}
+	char xml[CNMT_XML_MAX_SIZE];
+	nsp_prepare_tail(cart, xml, offset);
+
+	nsp_header_t nsp_header;
+	nsp_build_header(cart, &nsp_header, sizeof(nsp_header));
+	nsp_write_buffer(nsp_io, 0, &nsp_header, sizeof(nsp_header));
+
+	for (int index=0;index<3;index++) {
+		nxci_log(tool_ctx, "Packing %s NCA into stdout\n", jobs[index].type);
+		if (jobs[index].buf_io != NULL) {
+			nsp_write_buffer(nsp_io, cart->nsp_create_info[index].offset, jobs[index].buf_io->map, cart->nsp_create_info[index].filesize);
+			nxci_io_close(jobs[index].buf_io);
+			jobs[index].buf_io = NULL;
+			nca_patch_plan_free(&jobs[index].plan);
+			continue;
+		}
+		if (jobs[index].cached) {
+			nca_write_patched(nca_ctxs[index], &jobs[index].plan, nsp_io, cart->nsp_create_info[index].offset, NULL);
+			nca_patch_plan_free(&jobs[index].plan);
+			continue;
+		}
+		// Second pass has to produce exactly what was hashed, or the header already sent is wrong
+		unsigned char hash[0x20];
+		sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256,0);
+		nxci_cleanup_t sha_cleanup;
+		nxci_cleanup_push(&sha_cleanup, (void (*)(void *))free_sha_ctx, sha_ctx);
+		nca_write_patched(nca_ctxs[index], &jobs[index].plan, nsp_io, cart->nsp_create_info[index].offset, sha_ctx);
+		sha_get_hash(sha_ctx, hash);
+		nxci_cleanup_pop(&sha_cleanup, 1);
+		nca_patch_plan_free(&jobs[index].plan);
+		if (memcmp(hash, cart->application_cnmt_contents[index].hash, sizeof(hash)) != 0) {
+			nxci_fail("%s NCA changed between passes!", jobs[index].type);
+		}
+	}
+	nxci_cleanup_pop(&jobs_cleanup, 0);
+	nxci_log(tool_ctx, "Packing %s NCA into stdout\n", cart->cnmt_xml.contents[3].type);
+	nsp_write_buffer(nsp_io, cart->nsp_create_info[3].offset, meta_io->map, cart->nsp_create_info[3].filesize);
+	nxci_cleanup_pop(&meta_cleanup, 1);
+	nsp_write_tail(cart, nsp_io, xml);
+
+	nsp_close(&out);
+	nxci_log(tool_ctx, "\n");
+}
+
+void nxci_cart_release(nxci_cart_t *cart)
+{
+	for (int index=0;index<4;index++) {
+		if (cart->nca_ctxs[index] != NULL)
+			nca_free_section_contexts(cart->nca_ctxs[index]);
+	}
 }
@@ -4,12 +4,18 @@
 #include <inttypes.h>
 #include "filepath.h"
 #include "nca.h"
+#include "hfs0.h"
 #include "cnmt.h"
+#include "arena.h"
+
+#define CNMT_XML_MAX_SIZE 0x1000
+#define NSP_PIPE_DEFAULT_BUFFER 0x4000000 /* NCAs kept in memory by create_nsp_pipe instead of being read twice. */
 
 typedef struct {
 	char *filepath;
 	char *nsp_filename;
 	uint64_t filesize;
+	uint64_t offset; /* Where the entry starts in the nsp, header included. */
 } nsp_create_info_t;
 
 typedef struct {
@@ -28,11 +34,23 @@ typedef struct {
 	char string_table[0x118];
 } nsp_header_t;
 
-extern nsp_create_info_t nsp_create_info[7];
+/* Per conversion state, strings and NCA contexts are allocated from arena. */
+typedef struct nxci_cart {
+	cnmt_xml_t cnmt_xml;
+	nsp_create_info_t nsp_create_info[7];
+	application_cnmt_content_t application_cnmt_contents[3];
+	nca_ctx_t *nca_ctxs[4]; /* Secure partition NCAs by nca_type_to_index, set by hfs0_prepare_ncas. */
+	arena_t *arena;
+	char *nsp_path;
+} nxci_cart_t;
+
+void nxci_cart_release(nxci_cart_t *cart);
 
-void create_cnmt_xml();
-void create_dummy_cert(filepath_t filepath);
-void create_dummy_tik(filepath_t filepath);
-void create_nsp();
+void create_cnmt_xml(nxci_ctx_t *tool_ctx);
+void create_dummy_cert(nxci_ctx_t *tool_ctx);
+void create_dummy_tik(nxci_ctx_t *tool_ctx);
+void create_nsp(nxci_ctx_t *tool_ctx);
+void create_nsp_stream(hfs0_ctx_t *ctx);
+void create_nsp_pipe(hfs0_ctx_t *ctx);
 
 #endif
@@ -0,0 +1,211 @@
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pipeline.h"
+#include "nca.h"
+#include "sha.h"
+#include "bufpool.h"
+#include "lib4nxci.h"
+
+static void pipeline_ring_init(pipeline_ring_t *ring) {
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+}
+
+static void pipeline_ring_free(pipeline_ring_t *ring) {
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+}
+
+static int pipeline_ring_is_full(pipeline_ring_t *ring, unsigned int head) {
+    return head - atomic_load(&ring->tail) >= PIPELINE_RING_SIZE;
+}
+
+static int pipeline_ring_is_empty(pipeline_ring_t *ring, unsigned int tail) {
+    return atomic_load(&ring->head) == tail;
+}
+
+/* Spin a little, then sleep until the other side moves. Its store and our sleepers count are both seq_cst,
+   so either we see its progress or it sees us and signals under the lock. */
+static void pipeline_ring_wait(pipeline_ring_t *ring, int (*blocked)(pipeline_ring_t *, unsigned int), unsigned int index) {
+    for (unsigned int i = 0; i < PIPELINE_SPIN; i++) {
+        if (!blocked(ring, index))
+            return;
+        sched_yield();
+    }
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleepers, 1);
+    while (blocked(ring, index))
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    atomic_fetch_sub(&ring->sleepers, 1);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void pipeline_ring_wake(pipeline_ring_t *ring) {
+    if (atomic_load(&ring->sleepers) != 0) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+static void pipeline_ring_push(pipeline_ring_t *ring, pipeline_buf_t *buf) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= PIPELINE_RING_SIZE)
+        pipeline_ring_wait(ring, pipeline_ring_is_full, head);
+    ring->slots[head & (PIPELINE_RING_SIZE - 1)] = buf;
+    atomic_store(&ring->head, head + 1);
+    pipeline_ring_wake(ring);
+}
+
+static pipeline_buf_t *pipeline_ring_pop(pipeline_ring_t *ring) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+        pipeline_ring_wait(ring, pipeline_ring_is_empty, tail);
+    pipeline_buf_t *buf = ring->slots[tail & (PIPELINE_RING_SIZE - 1)];
+    atomic_store(&ring->tail, tail + 1);
+    pipeline_ring_wake(ring);
+    return buf;
+}
+
+static void pipeline_fail(pipeline_t *pipeline, const nxci_catch_t *frame) {
+    if (atomic_exchange(&pipeline->failed, 1) == 0) {
+        pipeline->status = frame->status;
+        memcpy(pipeline->message, frame->message, sizeof(pipeline->message));
+    }
+}
+
+static void *pipeline_reader(void *arg) {
+    pipeline_t *pipeline = arg;
+    nxci_catch_t frame;
+
+    nxci_catch_enter(&frame);
+    if (setjmp(frame.env) == 0) {
+        uint64_t ofs = 0;
+        while (ofs < pipeline->total_size && !atomic_load(&pipeline->failed)) {
+            pipeline_buf_t *buf = pipeline_ring_pop(&pipeline->free_ring);
+            buf->ofs = ofs;
+            buf->size = pipeline->total_size - ofs;
+            if (buf->size > pipeline->buffer_size) buf->size = pipeline->buffer_size;
+            if (nxci_io_read_at(pipeline->in, buf->data, buf->size, pipeline->ofs + ofs) != buf->size) {
+                nxci_fail("Failed to read file!");
+            }
+            pipeline_ring_push(&pipeline->read_ring, buf);
+            ofs += buf->size;
+        }
+        nxci_catch_leave(&frame);
+    } else {
+        pipeline_fail(pipeline, &frame);
+    }
+    pipeline_ring_push(&pipeline->read_ring, &pipeline->eof);
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg) {
+    pipeline_t *pipeline = arg;
+    pipeline_buf_t *buf;
+
+    while ((buf = pipeline_ring_pop(&pipeline->write_ring))->size != 0) {
+        /* After a failure buffers only go back to the reader, so it can see it and stop. */
+        if (!atomic_load(&pipeline->failed)) {
+            nxci_catch_t frame;
+            nxci_catch_enter(&frame);
+            if (setjmp(frame.env) == 0) {
+                if (nxci_io_write_at(pipeline->out, buf->data, buf->size, pipeline->out_ofs + buf->ofs) != buf->size) {
+                    nxci_fail("Failed to write file!");
+                }
+                nxci_catch_leave(&frame);
+            } else {
+                pipeline_fail(pipeline, &frame);
+            }
+        }
+        pipeline_ring_push(&pipeline->free_ring, buf);
+    }
+    return NULL;
+}
+
+/* Patch and hash on the calling thread, a cancelled job stops the pipeline like a failing stage. */
+static void pipeline_process(pipeline_t *pipeline, struct nca_patch_plan *plan, struct sha_ctx *sha, struct nxci_job *job) {
+    nxci_catch_t frame;
+    pipeline_buf_t *buf;
+
+    nxci_catch_enter(&frame);
+    if (setjmp(frame.env) == 0) {
+        while ((buf = pipeline_ring_pop(&pipeline->read_ring))->size != 0) {
+            if (plan != NULL)
+                nca_patch_plan_apply(plan, buf->ofs, buf->data, buf->size);
+            if (sha != NULL)
+                sha_update(sha, buf->data, buf->size);
+            /* The buffer belongs to the writer once pushed. */
+            uint64_t size = buf->size;
+            pipeline_ring_push(&pipeline->write_ring, buf);
+            nxci_job_advance(job, size);
+        }
+        nxci_catch_leave(&frame);
+    } else {
+        pipeline_fail(pipeline, &frame);
+        while ((buf = pipeline_ring_pop(&pipeline->read_ring))->size != 0)
+            pipeline_ring_push(&pipeline->write_ring, buf);
+    }
+    pipeline_ring_push(&pipeline->write_ring, &pipeline->eof);
+}
+
+/* Copy total_size bytes at ofs in `in` to out_ofs in out, patching and hashing on the calling thread. */
+void pipeline_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings) {
+    pipeline_t pipeline;
+    pipeline_buf_t bufs[PIPELINE_MAX_DEPTH];
+    unsigned int depth = settings->queue_depth;
+    pthread_t reader, writer;
+
+    if (depth > PIPELINE_MAX_DEPTH) depth = PIPELINE_MAX_DEPTH;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.in = in;
+    pipeline.out = out;
+    pipeline.ofs = ofs;
+    pipeline.out_ofs = out_ofs;
+    pipeline.total_size = total_size;
+    pipeline.buffer_size = align64(settings->buffer_size, PIPELINE_BUFFER_ALIGN);
+
+    /* Never allocate more buffers than the section needs. */
+    uint64_t num_bufs = (total_size + pipeline.buffer_size - 1) / pipeline.buffer_size;
+    if (num_bufs < depth) depth = num_bufs == 0 ? 1 : (unsigned int)num_bufs;
+
+    /* One pool region carved into the buffers, fewer or smaller ones under memory pressure. */
+    unsigned char *region = bufpool_get_buffers(&pipeline.buffer_size, &depth);
+    pipeline_ring_init(&pipeline.free_ring);
+    pipeline_ring_init(&pipeline.read_ring);
+    pipeline_ring_init(&pipeline.write_ring);
+    for (unsigned int i = 0; i < depth; i++) {
+        bufs[i].data = region + i * pipeline.buffer_size;
+        pipeline_ring_push(&pipeline.free_ring, &bufs[i]);
+    }
+
+    if (pthread_create(&reader, NULL, pipeline_reader, &pipeline) != 0) {
+        bufpool_put(region);
+        pipeline_ring_free(&pipeline.free_ring);
+        pipeline_ring_free(&pipeline.read_ring);
+        pipeline_ring_free(&pipeline.write_ring);
+        nxci_fail("Failed to start pipeline threads!");
+    }
+    if (pthread_create(&writer, NULL, pipeline_writer, &pipeline) != 0) {
+        /* Stop the reader and take the writer's place until the end marker. */
+        atomic_store(&pipeline.failed, 1);
+        snprintf(pipeline.message, sizeof(pipeline.message), "Failed to start pipeline threads!");
+        pipeline.status = NXCI_ERROR;
+        pipeline_buf_t *buf;
+        while ((buf = pipeline_ring_pop(&pipeline.read_ring))->size != 0)
+            pipeline_ring_push(&pipeline.free_ring, buf);
+        pthread_join(reader, NULL);
+    } else {
+        pipeline_process(&pipeline, plan, sha, settings->job);
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+    }
+
+    bufpool_put(region);
+    pipeline_ring_free(&pipeline.free_ring);
+    pipeline_ring_free(&pipeline.read_ring);
+    pipeline_ring_free(&pipeline.write_ring);
+    if (atomic_load(&pipeline.failed))
+        nxci_fail_status(pipeline.status, "%s", pipeline.message);
+}
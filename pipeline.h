@@ -0,0 +1,53 @@
+#ifndef NXCI_PIPELINE_H
+#define NXCI_PIPELINE_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "types.h"
+#include "utils.h"
+#include "io.h"
+#include "error.h"
+
+#define PIPELINE_BUFFER_ALIGN NXCI_IO_DIRECT_ALIGN
+#define PIPELINE_MAX_DEPTH 64
+#define PIPELINE_RING_SIZE 0x80 /* Power of two, holds every buffer plus the end marker. */
+#define PIPELINE_SPIN 16 /* Yields before a stage waiting on a ring goes to sleep. */
+
+typedef struct {
+    unsigned char *data; /* PIPELINE_BUFFER_ALIGN aligned. */
+    uint64_t ofs; /* Offset of data within the copied section. */
+    uint64_t size; /* 0 marks the end of the section. */
+} pipeline_buf_t;
+
+/* Lock-free single producer, single consumer ring. A stage that finds it full or empty for long sleeps on cond. */
+typedef struct {
+    atomic_uint head; /* Only written by producer. */
+    atomic_uint tail; /* Only written by consumer. */
+    atomic_uint sleepers; /* Stages waiting on cond, the other side only takes lock when there are some. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pipeline_buf_t *slots[PIPELINE_RING_SIZE];
+} pipeline_ring_t;
+
+/* Reader thread -> hash/patch stage (caller) -> writer thread. */
+typedef struct {
+    nxci_io_t *in;
+    nxci_io_t *out;
+    uint64_t ofs;
+    uint64_t out_ofs;
+    uint64_t total_size;
+    uint64_t buffer_size;
+    pipeline_ring_t free_ring; /* Writer -> reader. */
+    pipeline_ring_t read_ring; /* Reader -> hash/patch. */
+    pipeline_ring_t write_ring; /* Hash/patch -> writer. */
+    pipeline_buf_t eof;
+    /* A failing stage stops the reader and lets the others drain, the caller raises the error once they're joined. */
+    atomic_int failed;
+    nxci_status_t status;
+    char message[NXCI_ERROR_SIZE];
+} pipeline_t;
+
+void pipeline_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "aes.h"
 #include "pki.h"
 
@@ -483,7 +484,8 @@ const nca_keyset_t nca_keys_retail = {
         0x97, 0x3F, 0x0F, 0x35, 0x39, 0x53, 0xFB, 0xFA, 0xCD, 0xAB, 0xA8, 0x7A, 0x62, 0x9A, 0x3F, 0xF2,
         0x09, 0x27, 0x96, 0x3F, 0x07, 0x9A, 0x91, 0xF7, 0x16, 0xBF, 0xC6, 0x3A, 0x82, 0x5A, 0x4B, 0xCF,
         0x49, 0x50, 0x95, 0x8C, 0x55, 0x80, 0x7E, 0x39, 0xB1, 0x48, 0x05, 0x1E, 0x21, 0xC7, 0x24, 0x4F
-    }
+    },
+    0 /* Derived generations. */
 };
 
 const nca_keyset_t nca_keys_dev = {
@@ -903,10 +905,13 @@ const nca_keyset_t nca_keys_dev = {
         0xF3, 0x56, 0x8E, 0xEC, 0x8D, 0x51, 0x8A, 0x63, 0x3C, 0x04, 0x78, 0x23, 0x0E, 0x90, 0x0C, 0xB4,
         0xE7, 0x86, 0x3B, 0x4F, 0x8E, 0x13, 0x09, 0x47, 0x32, 0x0E, 0x04, 0xB8, 0x4D, 0x5B, 0xB0, 0x46,
         0x71, 0xB0, 0x5C, 0xF4, 0xAD, 0x63, 0x4F, 0xC5, 0xE2, 0xAC, 0x1E, 0xC4, 0x33, 0x96, 0x09, 0x7B
-    }
+    },
+    0 /* Derived generations. */
 };
 
 
+static pthread_mutex_t pki_derive_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void generate_kek(unsigned char *dst, const unsigned char *src, const unsigned char *master_key, const unsigned char *kek_seed, const unsigned char *key_seed) {
     unsigned char kek[0x10];
     unsigned char src_kek[0x10];
@@ -927,7 +932,7 @@ void generate_kek(unsigned char *dst, const unsigned char *src, const unsigned c
     }
 }
 
-void pki_derive_keys(nca_keyset_t *keyset) {
+void pki_derive_master_keys(nca_keyset_t *keyset) {
     unsigned char zeroes[0x100];
     unsigned char cmac[0x10];
     memset(zeroes, 0, 0x100);
@@ -1002,47 +1007,19 @@ void pki_derive_keys(nca_keyset_t *keyset) {
         aes_decrypt(master_gen_ctx, &keyset->master_keys[i], keyset->master_key_source, 0x10);
         free_aes_ctx(master_gen_ctx);
     }
-    for (unsigned int i = 0; i < 0x20; i++) {
-        if (memcmp(&keyset->master_keys[i], zeroes, 0x10) == 0) {
-            continue;
-        }
-        
-        aes_ctx_t *master_ctx = new_aes_ctx(&keyset->master_keys[i], 0x10, AES_MODE_ECB);
-        
-        /* Derive Key Area Encryption Keys */
-        if (memcmp(keyset->key_area_key_application_source, zeroes, 0x10) != 0) {
-            generate_kek(keyset->key_area_keys[i][0], keyset->key_area_key_application_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
-        }
-        if (memcmp(keyset->key_area_key_ocean_source, zeroes, 0x10) != 0) {
-            generate_kek(keyset->key_area_keys[i][1], keyset->key_area_key_ocean_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
-        }
-        if (memcmp(keyset->key_area_key_system_source, zeroes, 0x10) != 0) {
-            generate_kek(keyset->key_area_keys[i][2], keyset->key_area_key_system_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
-        }
-        
-        /* Derive Titlekek */
-        if (memcmp(keyset->titlekek_source, zeroes, 0x10) != 0) {
-            aes_decrypt(master_ctx, &keyset->titlekeks[i], keyset->titlekek_source, 0x10);
-        }
-        
-        /* Derive Package2 Key */
-        if (memcmp(keyset->package2_key_source, zeroes, 0x10) != 0) {
-            aes_decrypt(master_ctx, &keyset->package2_keys[i], keyset->package2_key_source, 0x10);
-        }
-        
-        /* Derive Header Key */
-        if (i == 0 && memcmp(keyset->header_kek_source, zeroes, 0x10) != 0 && memcmp(keyset->header_key_source, zeroes, 0x20) != 0) {
+    /* Header and SD card keys come from master key 0. */
+    if (memcmp(&keyset->master_keys[0], zeroes, 0x10) != 0) {
+        if (memcmp(keyset->header_kek_source, zeroes, 0x10) != 0 && memcmp(keyset->header_key_source, zeroes, 0x20) != 0) {
             unsigned char header_kek[0x10];
-            generate_kek(header_kek, keyset->header_kek_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
+            generate_kek(header_kek, keyset->header_kek_source, keyset->master_keys[0], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
             aes_ctx_t *header_ctx = new_aes_ctx(header_kek, 0x10, AES_MODE_ECB);
             aes_decrypt(header_ctx, keyset->header_key, keyset->header_key_source, 0x20);
             free_aes_ctx(header_ctx);
         }
         
-        /* Derive SD Card Key */
-        if (i == 0 && memcmp(keyset->sd_card_kek_source, zeroes, 0x10) != 0) {
+        if (memcmp(keyset->sd_card_kek_source, zeroes, 0x10) != 0) {
             unsigned char sd_kek[0x10];
-            generate_kek(sd_kek, keyset->sd_card_kek_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
+            generate_kek(sd_kek, keyset->sd_card_kek_source, keyset->master_keys[0], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
             aes_ctx_t *sd_ctx = new_aes_ctx(sd_kek, 0x10, AES_MODE_ECB);
 
             for (unsigned int k = 0; k < 2; k++) {
@@ -1053,10 +1030,64 @@ void pki_derive_keys(nca_keyset_t *keyset) {
             
             free_aes_ctx(sd_ctx);
         }
-        
-        free_aes_ctx(master_ctx);
     }
+    keyset->derived_generations = 0;
+}
 
+static void pki_derive_generation_keys(nca_keyset_t *keyset, unsigned int i) {
+    unsigned char zeroes[0x10];
+    memset(zeroes, 0, 0x10);
+    if (memcmp(&keyset->master_keys[i], zeroes, 0x10) == 0) {
+        return;
+    }
+    
+    aes_ctx_t *master_ctx = new_aes_ctx(&keyset->master_keys[i], 0x10, AES_MODE_ECB);
+    
+    /* Derive Key Area Encryption Keys */
+    if (memcmp(keyset->key_area_key_application_source, zeroes, 0x10) != 0) {
+        generate_kek(keyset->key_area_keys[i][0], keyset->key_area_key_application_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
+    }
+    if (memcmp(keyset->key_area_key_ocean_source, zeroes, 0x10) != 0) {
+        generate_kek(keyset->key_area_keys[i][1], keyset->key_area_key_ocean_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
+    }
+    if (memcmp(keyset->key_area_key_system_source, zeroes, 0x10) != 0) {
+        generate_kek(keyset->key_area_keys[i][2], keyset->key_area_key_system_source, keyset->master_keys[i], keyset->aes_kek_generation_source, keyset->aes_key_generation_source);
+    }
+    
+    /* Derive Titlekek */
+    if (memcmp(keyset->titlekek_source, zeroes, 0x10) != 0) {
+        aes_decrypt(master_ctx, &keyset->titlekeks[i], keyset->titlekek_source, 0x10);
+    }
+    
+    /* Derive Package2 Key */
+    if (memcmp(keyset->package2_key_source, zeroes, 0x10) != 0) {
+        aes_decrypt(master_ctx, &keyset->package2_keys[i], keyset->package2_key_source, 0x10);
+    }
+    
+    free_aes_ctx(master_ctx);
+}
+
+void pki_derive_generation(nca_keyset_t *keyset, unsigned int generation) {
+    if (generation >= 0x20) {
+        return;
+    }
+    /* Every conversion shares the keyset, only the first to need a generation takes the lock. */
+    if (atomic_load_explicit(&keyset->derived_generations, memory_order_acquire) & (1u << generation)) {
+        return;
+    }
+    pthread_mutex_lock(&pki_derive_lock);
+    if (!(atomic_load_explicit(&keyset->derived_generations, memory_order_relaxed) & (1u << generation))) {
+        pki_derive_generation_keys(keyset, generation);
+        atomic_fetch_or_explicit(&keyset->derived_generations, 1u << generation, memory_order_release);
+    }
+    pthread_mutex_unlock(&pki_derive_lock);
+}
+
+void pki_derive_keys(nca_keyset_t *keyset) {
+    pki_derive_master_keys(keyset);
+    for (unsigned int i = 0; i < 0x20; i++) {
+        pki_derive_generation(keyset, i);
+    }
 }
 
 void pki_print_keys(nca_keyset_t *keyset) {
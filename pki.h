@@ -11,6 +11,9 @@
 #define ZEROES_KAEKS {ZEROES_KEY, ZEROES_KEY, ZEROES_KEY}
 
 void pki_derive_keys(nca_keyset_t *keyset);
+/* Everything but the per-generation keys, which pki_derive_generation derives the first time they're needed. */
+void pki_derive_master_keys(nca_keyset_t *keyset);
+void pki_derive_generation(nca_keyset_t *keyset, unsigned int generation);
 void pki_print_keys(nca_keyset_t *keyset);
 void pki_initialize_keyset(nca_keyset_t *keyset, keyset_variant_t variant);
 
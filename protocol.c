@@ -0,0 +1,50 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "protocol.h"
+
+static int msg_write(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size != 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int msg_read(int fd, void *data, size_t size) {
+    char *p = data;
+    while (size != 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int nxci_msg_send(int fd, uint32_t type, uint32_t id, const void *body, uint32_t size) {
+    char msg[sizeof(nxci_msg_header_t) + NXCI_MSG_MAX_SIZE];
+    nxci_msg_header_t header = {type, id, size};
+    if (size > NXCI_MSG_MAX_SIZE)
+        return -1;
+    /* One write per message, callers serialize messages to the same fd. */
+    memcpy(msg, &header, sizeof(header));
+    if (size != 0)
+        memcpy(msg + sizeof(header), body, size);
+    return msg_write(fd, msg, sizeof(header) + size);
+}
+
+int nxci_msg_recv(int fd, nxci_msg_header_t *header, void *body) {
+    if (msg_read(fd, header, sizeof(*header)) != 0 || header->size > NXCI_MSG_MAX_SIZE)
+        return -1;
+    return msg_read(fd, body, header->size);
+}
@@ -0,0 +1,56 @@
+#ifndef NXCI_PROTOCOL_H
+#define NXCI_PROTOCOL_H
+
+#include <stdint.h>
+
+/* Framed messages between 4nxci --serve and its clients over a UNIX socket.
+   Every message is an nxci_msg_header_t followed by size bytes of body, all in the host's byte order.
+   id is picked by the client for each job it submits, every message about the job carries it. */
+
+#define NXCI_DEFAULT_SOCKET "4nxci.sock"
+#define NXCI_MSG_MAX_SIZE 0x1000
+
+typedef enum {
+    /* Client to daemon. */
+    NXCI_MSG_SUBMIT = 1, /* nxci_msg_submit_t, then the input path and the output directory, NUL terminated. */
+    NXCI_MSG_CANCEL, /* No body. */
+    /* Daemon to client. */
+    NXCI_MSG_ACCEPTED, /* No body, the job is queued. */
+    NXCI_MSG_PROGRESS, /* nxci_msg_progress_t. */
+    NXCI_MSG_LOG, /* Text, not NUL terminated. */
+    NXCI_MSG_DONE /* nxci_msg_done_t, then the nsp path and the error, NUL terminated. Last one about the job. */
+} nxci_msg_type_t;
+
+typedef enum {
+    NXCI_JOB_CONVERT = 0,
+    NXCI_JOB_SCAN,
+    NXCI_JOB_VERIFY
+} nxci_job_kind_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t id;
+    uint32_t size;
+} nxci_msg_header_t;
+
+typedef struct {
+    uint32_t kind;
+    int32_t priority; /* Higher first. */
+} nxci_msg_submit_t;
+
+typedef struct {
+    uint64_t done;
+    uint64_t total;
+} nxci_msg_progress_t;
+
+typedef struct {
+    int32_t status; /* nxci_status_t. */
+    char title_id[20]; /* Empty if it couldn't be read. */
+} nxci_msg_done_t;
+
+/* Both return 0, or -1 once the peer is gone or sent something malformed. */
+int nxci_msg_send(int fd, uint32_t type, uint32_t id, const void *body, uint32_t size);
+/* body gets at most NXCI_MSG_MAX_SIZE bytes. */
+int nxci_msg_recv(int fd, nxci_msg_header_t *header, void *body);
+
+#endif
@@ -3,6 +3,7 @@
 #include "rsa.h"
 #include "sha.h"
 #include "utils.h"
+#include "error.h"
 #include "types.h"
 
 #define RSA_2048_BYTES 0x100
@@ -50,15 +51,17 @@ int rsa2048_pss_verify(const void *data, size_t len, const unsigned char *signat
     mbedtls_mpi_read_binary(&modulus_mpi, modulus, RSA_2048_BYTES);
     mbedtls_mpi_exp_mod(&message_mpi, &signature_mpi, &e_mpi, &modulus_mpi, NULL);
 
-    if (mbedtls_mpi_write_binary(&message_mpi, m_buf, RSA_2048_BYTES) != 0) {
-        FATAL_ERROR("Failed to export exponentiated RSA message!");
-    }
+    int ret = mbedtls_mpi_write_binary(&message_mpi, m_buf, RSA_2048_BYTES);
 
     mbedtls_mpi_free(&signature_mpi);
     mbedtls_mpi_free(&modulus_mpi);
     mbedtls_mpi_free(&e_mpi);
     mbedtls_mpi_free(&message_mpi);
 
+    if (ret != 0) {
+        nxci_fail("Failed to export exponentiated RSA message!");
+    }
+
     /* There's no automated PSS verification as far as I can tell. */
     if (m_buf[RSA_2048_BYTES-1] != 0xBC) {
         return false;
@@ -114,14 +117,16 @@ int rsa2048_pkcs1_verify(const void *data, size_t len, const unsigned char *sign
     mbedtls_mpi_read_binary(&modulus_mpi, modulus, RSA_2048_BYTES);
     mbedtls_mpi_exp_mod(&message_mpi, &signature_mpi, &e_mpi, &modulus_mpi, NULL);
 
-    if (mbedtls_mpi_write_binary(&message_mpi, m_buf, RSA_2048_BYTES) != 0) {
-        FATAL_ERROR("Failed to export exponentiated RSA message!");
-    }
+    int ret = mbedtls_mpi_write_binary(&message_mpi, m_buf, RSA_2048_BYTES);
 
     mbedtls_mpi_free(&signature_mpi);
     mbedtls_mpi_free(&modulus_mpi);
     mbedtls_mpi_free(&e_mpi);
     mbedtls_mpi_free(&message_mpi);
+
+    if (ret != 0) {
+        nxci_fail("Failed to export exponentiated RSA message!");
+    }
     
     /* For RSA-2048, this prefix is just a constant. */
     const unsigned char pkcs1_hash_prefix[0xE0] = {
@@ -166,14 +171,16 @@ int rsa2048_oaep_decrypt_verify(void *out, size_t max_out_len, const unsigned ch
     mbedtls_mpi_read_binary(&modulus_mpi, modulus, RSA_2048_BYTES);
     mbedtls_mpi_exp_mod(&message_mpi, &signature_mpi, &exp_mpi, &modulus_mpi, NULL);
 
-    if (mbedtls_mpi_write_binary(&message_mpi, m_buf, RSA_2048_BYTES) != 0) {
-        FATAL_ERROR("Failed to export exponentiated RSA message!");
-    }
+    int ret = mbedtls_mpi_write_binary(&message_mpi, m_buf, RSA_2048_BYTES);
 
     mbedtls_mpi_free(&signature_mpi);
     mbedtls_mpi_free(&modulus_mpi);
     mbedtls_mpi_free(&exp_mpi);
     mbedtls_mpi_free(&message_mpi);
+
+    if (ret != 0) {
+        nxci_fail("Failed to export exponentiated RSA message!");
+    }
     
     /* There's no automated PSS verification as far as I can tell. */
     if (m_buf[0] != 0x00) {
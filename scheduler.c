@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+#include "scheduler.h"
+
+/* Whether dev is backed by a spinning disk, unknown devices aren't. */
+static int sched_rotational(dev_t dev) {
+#ifdef __linux__
+    /* Partitions only have a queue through their disk. */
+    static const char *formats[] = {"/sys/dev/block/%u:%u/queue/rotational", "/sys/dev/block/%u:%u/../queue/rotational"};
+    for (unsigned int i = 0; i < 2; i++) {
+        char path[0x80];
+        snprintf(path, sizeof(path), formats[i], major(dev), minor(dev));
+        FILE *f = fopen(path, "r");
+        if (f != NULL) {
+            int c = fgetc(f);
+            fclose(f);
+            return c == '1';
+        }
+    }
+#else
+    (void)dev;
+#endif
+    return 0;
+}
+
+/* Index of the device path is on, -1 if it can't be told. Called with the lock held. */
+static int sched_device(nxci_sched_t *sched, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+    for (unsigned int i = 0; i < sched->num_devices; i++) {
+        if (sched->devices[i].dev == st.st_dev)
+            return i;
+    }
+    nxci_sched_device_t *devices = realloc(sched->devices, (sched->num_devices + 1) * sizeof(*devices));
+    if (devices == NULL)
+        return -1;
+    sched->devices = devices;
+    nxci_sched_device_t *device = &devices[sched->num_devices];
+    device->dev = st.st_dev;
+    device->limit = sched->per_device != 0 ? sched->per_device : sched_rotational(st.st_dev) ? 1 : 0;
+    device->running = 0;
+    return sched->num_devices++;
+}
+
+static int sched_has_slot(nxci_sched_t *sched, nxci_task_t *task) {
+    for (unsigned int i = 0; i < 2; i++) {
+        if (task->devs[i] < 0)
+            continue;
+        nxci_sched_device_t *device = &sched->devices[task->devs[i]];
+        if (device->limit != 0 && device->running >= device->limit)
+            return 0;
+    }
+    return 1;
+}
+
+static void sched_hold(nxci_sched_t *sched, nxci_task_t *task, int count) {
+    for (unsigned int i = 0; i < 2; i++) {
+        if (task->devs[i] >= 0)
+            sched->devices[task->devs[i]].running += count;
+    }
+}
+
+/* Link to the task to start next: highest priority, then smallest input, then oldest. NULL if none can start. */
+static nxci_task_t **sched_pick(nxci_sched_t *sched) {
+    nxci_task_t **best = NULL;
+    for (nxci_task_t **link = &sched->pending; *link != NULL; link = &(*link)->next) {
+        nxci_task_t *task = *link;
+        if (!sched_has_slot(sched, task))
+            continue;
+        if (best == NULL || task->priority > (*best)->priority || (task->priority == (*best)->priority && task->size < (*best)->size))
+            best = link;
+    }
+    return best;
+}
+
+static void *sched_worker(void *arg) {
+    nxci_sched_t *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stopping) {
+        nxci_task_t **link = sched_pick(sched);
+        if (link == NULL) {
+            pthread_cond_wait(&sched->cond, &sched->lock);
+            continue;
+        }
+        nxci_task_t *task = *link;
+        *link = task->next;
+        sched_hold(sched, task, 1);
+        sched->running++;
+        pthread_mutex_unlock(&sched->lock);
+
+        task->status = task->run != NULL ? task->run(sched->settings, &task->job) : nxci_convert(sched->settings, &task->job);
+
+        pthread_mutex_lock(&sched->lock);
+        sched_hold(sched, task, -1);
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->lock);
+        if (task->done != NULL)
+            task->done(task, task->user);
+        pthread_mutex_lock(&sched->lock);
+        if (--sched->running == 0 && sched->pending == NULL)
+            pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+nxci_status_t nxci_sched_init(nxci_sched_t *sched, const nxci_settings_t *settings, unsigned int num_threads, unsigned int per_device) {
+    memset(sched, 0, sizeof(*sched));
+    sched->settings = settings;
+    sched->per_device = per_device;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    if (num_threads == 0) num_threads = 1;
+    if (num_threads > SCHED_MAX_THREADS) num_threads = SCHED_MAX_THREADS;
+    /* Fewer threads if some can't be started. */
+    while (sched->num_threads < num_threads && pthread_create(&sched->threads[sched->num_threads], NULL, sched_worker, sched) == 0)
+        sched->num_threads++;
+    if (sched->num_threads == 0) {
+        nxci_sched_free(sched);
+        return NXCI_ERROR;
+    }
+    return NXCI_OK;
+}
+
+void nxci_sched_submit(nxci_sched_t *sched, nxci_task_t *task) {
+    struct stat st;
+    task->size = stat(task->job.input_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+    task->status = NXCI_OK;
+    task->next = NULL;
+
+    pthread_mutex_lock(&sched->lock);
+    task->devs[0] = sched_device(sched, task->job.input_path);
+    task->devs[1] = task->run == NULL ? sched_device(sched, task->job.output_dir != NULL ? task->job.output_dir : ".") : -1;
+    if (task->devs[1] == task->devs[0])
+        task->devs[1] = -1;
+    nxci_task_t **link = &sched->pending;
+    while (*link != NULL)
+        link = &(*link)->next;
+    *link = task;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+int nxci_sched_cancel(nxci_sched_t *sched, nxci_task_t *task) {
+    pthread_mutex_lock(&sched->lock);
+    for (nxci_task_t **link = &sched->pending; *link != NULL; link = &(*link)->next) {
+        if (*link == task) {
+            *link = task->next;
+            if (sched->running == 0 && sched->pending == NULL)
+                pthread_cond_broadcast(&sched->idle);
+            pthread_mutex_unlock(&sched->lock);
+            return 1;
+        }
+    }
+    nxci_job_cancel(&task->job);
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+void nxci_sched_wait(nxci_sched_t *sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->pending != NULL || sched->running != 0)
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void nxci_sched_free(nxci_sched_t *sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = 1;
+    sched->pending = NULL;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    for (unsigned int i = 0; i < sched->num_threads; i++)
+        pthread_join(sched->threads[i], NULL);
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->devices);
+    sched->devices = NULL;
+}
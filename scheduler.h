@@ -0,0 +1,58 @@
+#ifndef NXCI_SCHEDULER_H
+#define NXCI_SCHEDULER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "types.h"
+#include "lib4nxci.h"
+
+#define SCHED_MAX_THREADS 64
+
+typedef struct nxci_task {
+    nxci_job_t job; /* Set up by whoever submits the task, callbacks included. */
+    int priority; /* Higher first, then smaller inputs first. */
+    nxci_status_t (*run)(const nxci_settings_t *settings, nxci_job_t *job); /* NULL for nxci_convert, others only read the input. */
+    nxci_status_t status;
+    void (*done)(struct nxci_task *task, void *user); /* Called on the worker once run, may free the task. */
+    void *user;
+    /* Scheduler state. */
+    uint64_t size;
+    int devs[2]; /* Input and output devices, -1 for none. */
+    struct nxci_task *next;
+} nxci_task_t;
+
+typedef struct {
+    dev_t dev;
+    unsigned int limit; /* 0 for no limit. */
+    unsigned int running;
+} nxci_sched_device_t;
+
+/* Runs conversions (or scans and verifications) on a fixed set of threads, every one sharing the same read-only settings.
+   A task only starts when both the device it reads from and the one it writes to have a slot left,
+   by default one conversion at a time on rotational disks and no limit elsewhere. */
+typedef struct {
+    const nxci_settings_t *settings;
+    unsigned int per_device; /* 0 picks by device type. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signalled when a task is queued or a device slot frees up. */
+    pthread_cond_t idle;
+    nxci_task_t *pending;
+    unsigned int running;
+    int stopping;
+    nxci_sched_device_t *devices;
+    unsigned int num_devices;
+    pthread_t threads[SCHED_MAX_THREADS];
+    unsigned int num_threads;
+} nxci_sched_t;
+
+nxci_status_t nxci_sched_init(nxci_sched_t *sched, const nxci_settings_t *settings, unsigned int num_threads, unsigned int per_device);
+void nxci_sched_submit(nxci_sched_t *sched, nxci_task_t *task);
+/* Drop task if it's still queued and return 1, its done callback isn't called.
+   Otherwise it is cancelled if running and 0 is returned. task must not have been freed by its done callback. */
+int nxci_sched_cancel(nxci_sched_t *sched, nxci_task_t *task);
+/* Wait until every submitted task is done. */
+void nxci_sched_wait(nxci_sched_t *sched);
+/* Tasks still queued are dropped without their done callback, running ones are waited for. */
+void nxci_sched_free(nxci_sched_t *sched);
+
+#endif
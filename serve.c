@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "serve.h"
+
+#ifdef _WIN32
+
+int serve_run(const nxci_settings_t *settings, const char *socket_path, unsigned int num_jobs, unsigned int per_device) {
+    (void)settings; (void)socket_path; (void)num_jobs; (void)per_device;
+    fprintf(stderr, "--serve isn't supported on Windows\n");
+    return -1;
+}
+
+#else
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scheduler.h"
+#include "protocol.h"
+#include "signals.h"
+#include "utils.h"
+
+typedef struct serve serve_t;
+typedef struct serve_client serve_client_t;
+
+typedef struct serve_task {
+    nxci_task_t task;
+    serve_client_t *client;
+    uint32_t id;
+    uint32_t kind;
+    unsigned int percent; /* Last progress sent. */
+    char input_path[MAX_PATH + 1];
+    char output_dir[MAX_PATH + 1];
+    struct serve_task *next;
+} serve_task_t;
+
+struct serve_client {
+    serve_t *server;
+    int fd;
+    pthread_mutex_t lock; /* Held while writing to fd, guards tasks and refs. */
+    unsigned int refs; /* Its reader thread and every task not done yet. */
+    serve_task_t *tasks;
+    struct serve_client *next;
+};
+
+struct serve {
+    nxci_sched_t sched;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signalled when a client is freed. */
+    serve_client_t *clients;
+};
+
+static const char *serve_kind_names[] = {"convert", "scan", "verify"};
+
+/* Called with the client locked, unlocks it. The last reference frees it. */
+static void serve_client_put(serve_client_t *client) {
+    int last = --client->refs == 0;
+    pthread_mutex_unlock(&client->lock);
+    if (!last)
+        return;
+
+    serve_t *server = client->server;
+    pthread_mutex_lock(&server->lock);
+    for (serve_client_t **link = &server->clients; *link != NULL; link = &(*link)->next) {
+        if (*link == client) {
+            *link = client->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+    close(client->fd);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+static void serve_log(void *user, const char *text) {
+    serve_task_t *t = user;
+    pthread_mutex_lock(&t->client->lock);
+    nxci_msg_send(t->client->fd, NXCI_MSG_LOG, t->id, text, strlen(text));
+    pthread_mutex_unlock(&t->client->lock);
+}
+
+/* Called for every buffer copied, only whole percents are sent on. */
+static void serve_progress(void *user, uint64_t done, uint64_t total) {
+    serve_task_t *t = user;
+    unsigned int percent = total != 0 ? (unsigned int)(done * 100 / total) : 0;
+    pthread_mutex_lock(&t->client->lock);
+    if (percent != t->percent) {
+        nxci_msg_progress_t progress = {done, total};
+        t->percent = percent;
+        nxci_msg_send(t->client->fd, NXCI_MSG_PROGRESS, t->id, &progress, sizeof(progress));
+    }
+    pthread_mutex_unlock(&t->client->lock);
+}
+
+static void serve_reply(serve_client_t *client, uint32_t id, nxci_status_t status, const char *title_id, const char *nsp_path, const char *error) {
+    char body[NXCI_MSG_MAX_SIZE];
+    nxci_msg_done_t done;
+    memset(&done, 0, sizeof(done));
+    done.status = status;
+    snprintf(done.title_id, sizeof(done.title_id), "%s", title_id);
+    memcpy(body, &done, sizeof(done));
+    size_t size = sizeof(done);
+    size += snprintf(body + size, sizeof(body) - size, "%s", nsp_path) + 1;
+    size += snprintf(body + size, sizeof(body) - size, "%s", error) + 1;
+    nxci_msg_send(client->fd, NXCI_MSG_DONE, id, body, size);
+}
+
+static void serve_done(nxci_task_t *task, void *user) {
+    serve_task_t *t = user;
+    serve_client_t *client = t->client;
+    printf("%s %s: %s\n", serve_kind_names[t->kind], t->input_path, task->status == NXCI_OK ? "done" : task->job.error);
+    fflush(stdout);
+
+    pthread_mutex_lock(&client->lock);
+    serve_reply(client, t->id, task->status, task->job.title_id, task->job.nsp_path, task->job.error);
+    for (serve_task_t **link = &client->tasks; *link != NULL; link = &(*link)->next) {
+        if (*link == t) {
+            *link = t->next;
+            break;
+        }
+    }
+    nxci_job_free(&task->job);
+    free(t);
+    serve_client_put(client);
+}
+
+/* Cancel the client's job id, or all of its jobs. Only called from its reader thread, nothing else drops tasks. */
+static void serve_cancel(serve_client_t *client, int all, uint32_t id) {
+    serve_task_t *dropped = NULL;
+    pthread_mutex_lock(&client->lock);
+    for (serve_task_t **link = &client->tasks; *link != NULL;) {
+        serve_task_t *t = *link;
+        if ((all || t->id == id) && nxci_sched_cancel(&client->server->sched, &t->task)) {
+            *link = t->next;
+            t->next = dropped;
+            dropped = t;
+        } else {
+            link = &t->next;
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    // Never started, so they're done here
+    while (dropped != NULL) {
+        serve_task_t *t = dropped;
+        dropped = t->next;
+        t->task.status = NXCI_CANCELLED;
+        snprintf(t->task.job.error, sizeof(t->task.job.error), "Cancelled");
+        serve_done(&t->task, t);
+    }
+}
+
+/* Both paths have to be NUL terminated within the body. */
+static const char *serve_submit_parse(const char *body, uint32_t size, nxci_msg_submit_t *submit, const char **input_path, const char **output_dir) {
+    if (size < sizeof(*submit))
+        return "Malformed request";
+    memcpy(submit, body, sizeof(*submit));
+    if (submit->kind > NXCI_JOB_VERIFY)
+        return "Unknown job type";
+    const char *end = body + size;
+    *input_path = body + sizeof(*submit);
+    const char *nul = memchr(*input_path, '\0', end - *input_path);
+    if (nul == NULL)
+        return "Malformed request";
+    *output_dir = nul + 1;
+    if (*output_dir >= end || memchr(*output_dir, '\0', end - *output_dir) == NULL)
+        return "Malformed request";
+    if (strlen(*input_path) > MAX_PATH || strlen(*output_dir) > MAX_PATH)
+        return "Path too long";
+    return NULL;
+}
+
+static void serve_submit(serve_client_t *client, uint32_t id, const char *body, uint32_t size) {
+    nxci_msg_submit_t submit;
+    const char *input_path, *output_dir;
+    const char *error = serve_submit_parse(body, size, &submit, &input_path, &output_dir);
+    serve_task_t *t = NULL;
+    if (error == NULL && (t = calloc(1, sizeof(serve_task_t))) == NULL)
+        error = "Failed to allocate job!";
+    if (error != NULL) {
+        pthread_mutex_lock(&client->lock);
+        serve_reply(client, id, NXCI_ERROR, "", "", error);
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
+
+    t->client = client;
+    t->id = id;
+    t->kind = submit.kind;
+    strcpy(t->input_path, input_path);
+    strcpy(t->output_dir, output_dir);
+    nxci_job_init(&t->task.job, t->input_path, t->output_dir[0] != '\0' ? t->output_dir : NULL);
+    t->task.job.log = serve_log;
+    t->task.job.progress = serve_progress;
+    t->task.job.user = t;
+    t->task.run = submit.kind == NXCI_JOB_SCAN ? nxci_scan : submit.kind == NXCI_JOB_VERIFY ? nxci_verify : NULL;
+    t->task.priority = submit.priority;
+    t->task.done = serve_done;
+    t->task.user = t;
+
+    pthread_mutex_lock(&client->lock);
+    t->next = client->tasks;
+    client->tasks = t;
+    client->refs++;
+    nxci_msg_send(client->fd, NXCI_MSG_ACCEPTED, id, NULL, 0);
+    pthread_mutex_unlock(&client->lock);
+    nxci_sched_submit(&client->server->sched, &t->task);
+}
+
+static void *serve_client_thread(void *arg) {
+    serve_client_t *client = arg;
+    nxci_msg_header_t header;
+    char body[NXCI_MSG_MAX_SIZE];
+    signals_block(NULL);
+
+    while (nxci_msg_recv(client->fd, &header, body) == 0) {
+        if (header.type == NXCI_MSG_SUBMIT)
+            serve_submit(client, header.id, body, header.size);
+        else if (header.type == NXCI_MSG_CANCEL)
+            serve_cancel(client, 0, header.id);
+        else
+            break;
+    }
+    // Nobody is left to get the results
+    serve_cancel(client, 1, 0);
+    pthread_mutex_lock(&client->lock);
+    serve_client_put(client);
+    return NULL;
+}
+
+static void serve_accept(serve_t *server, int fd) {
+    serve_client_t *client = calloc(1, sizeof(serve_client_t));
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+    client->server = server;
+    client->fd = fd;
+    client->refs = 1;
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_mutex_lock(&server->lock);
+    client->next = server->clients;
+    server->clients = client;
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_client_thread, client) != 0) {
+        pthread_mutex_lock(&client->lock);
+        serve_client_put(client);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* Bound and listening socket at path, -1 on error. A socket left behind by a daemon that died is replaced, a live one isn't. */
+static int serve_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "unable to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "Another 4nxci is already serving on %s\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    // Only the user running the daemon may submit jobs
+    mode_t mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound != 0 || listen(fd, 16) != 0) {
+        fprintf(stderr, "unable to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_run(const nxci_settings_t *settings, const char *socket_path, unsigned int num_jobs, unsigned int per_device) {
+    serve_t server;
+    memset(&server, 0, sizeof(server));
+
+    int fd = serve_listen(socket_path);
+    if (fd < 0)
+        return -1;
+
+    // Conversion threads start with the signals blocked
+    sigset_t old_signals;
+    signals_block(&old_signals);
+    int stop_fd = signals_init();
+    nxci_status_t status = stop_fd >= 0 ? nxci_sched_init(&server.sched, settings, num_jobs, per_device) : NXCI_ERROR;
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (status != NXCI_OK) {
+        fprintf(stderr, "Failed to start conversion threads!\n");
+        signals_free();
+        close(fd);
+        unlink(socket_path);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    printf("Serving on %s, %u jobs at once\n", socket_path, server.sched.num_threads);
+    fflush(stdout);
+
+    while (1) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        FD_SET(stop_fd, &fds);
+        if (select((fd > stop_fd ? fd : stop_fd) + 1, &fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "unable to wait for clients: %s\n", strerror(errno));
+            break;
+        }
+        if (FD_ISSET(stop_fd, &fds))
+            break;
+        int client_fd = accept(fd, NULL, NULL);
+        if (client_fd >= 0)
+            serve_accept(&server, client_fd);
+    }
+    printf("Stopping\n");
+    close(fd);
+    unlink(socket_path);
+
+    // Readers see their connection end and cancel its jobs, clients are still told
+    pthread_mutex_lock(&server.lock);
+    for (serve_client_t *client = server.clients; client != NULL; client = client->next)
+        shutdown(client->fd, SHUT_RD);
+    while (server.clients != NULL)
+        pthread_cond_wait(&server.cond, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+
+    nxci_sched_free(&server.sched);
+    pthread_cond_destroy(&server.cond);
+    pthread_mutex_destroy(&server.lock);
+    signals_free();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef NXCI_SERVE_H
+#define NXCI_SERVE_H
+
+#include "types.h"
+#include "settings.h"
+
+/* Take convert, scan and verify jobs over the UNIX socket at socket_path (see protocol.h) until SIGINT or SIGTERM,
+   running them on one scheduler that keeps its threads and the loaded keys for the daemon's lifetime.
+   Returns 0 once stopped, -1 if it couldn't start. */
+int serve_run(const nxci_settings_t *settings, const char *socket_path, unsigned int num_jobs, unsigned int per_device);
+
+#endif
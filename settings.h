@@ -1,8 +1,10 @@
 #ifndef NXCI_SETTINGS_H
 #define NXCI_SETTINGS_H
 #include <stdio.h>
+#include <stdatomic.h>
 #include "types.h"
 #include "filepath.h"
+#include "io.h"
 
 typedef enum {
     KEYSET_DEV,
@@ -46,6 +48,7 @@ typedef struct {
     unsigned char nca_hdr_fixed_key_modulus[0x100];      /* NCA header fixed key RSA pubk. */
     unsigned char acid_fixed_key_modulus[0x100];         /* ACID fixed key RSA pubk. */
     unsigned char package2_fixed_key_modulus[0x100];     /* Package2 Header RSA pubk. */
+    atomic_uint derived_generations;                     /* Bit per generation pki_derive_generation has done. */
 } nca_keyset_t;
 
 typedef struct {
@@ -54,7 +57,8 @@ typedef struct {
 } override_filepath_t;
 
 typedef struct {
-    nca_keyset_t keyset;
+    nca_keyset_t *keyset; /* Shared by every conversion run with these settings, generations are derived into it. */
+    unsigned char keyset_hash[0x20]; /* Of keyset before any generation is derived, part of every ncacache key. */
     filepath_t section_paths[4];
     filepath_t section_dir_paths[4];
     override_filepath_t exefs_path;
@@ -67,6 +71,16 @@ typedef struct {
     filepath_t update_dir_path;
     filepath_t normal_dir_path;
     filepath_t secure_dir_path;
+    int extract_secure; /* Stage secure partition in secure_dir_path instead of streaming it into the nsp. */
+    copy_settings_t copy;
+    unsigned int num_workers; /* Threads processing NCAs concurrently. */
+    nxci_io_backend_t io_backend;
+    unsigned int io_input_flags; /* NXCI_IO_FLAG_* for files read. */
+    unsigned int io_output_flags; /* NXCI_IO_FLAG_* for files written. */
+    int print_stats;
+    FILE *nsp_pipe; /* Write the nsp here strictly in order instead of to a file. */
+    uint64_t pipe_buffer_size; /* Bytes of NCAs create_nsp_pipe may keep from the hash pass. */
+    const char *cache_dir; /* NCA patch plans and hashes are kept there for later conversions (see ncacache.h), NULL for none. */
 } nxci_settings_t;
 
 enum hactool_file_type
@@ -89,15 +103,19 @@ enum hactool_file_type
 
 
 struct nca_ctx; /* This will get re-defined by nca.h. */
+struct nxci_cart;
+struct nxci_job;
 
 typedef struct {
     enum hactool_file_type file_type;
-    FILE *file;
+    nxci_io_t *io;
     FILE *base_file;
     nxci_basefile_t base_file_type;
     struct nca_ctx *base_nca_ctx;
     nxci_settings_t settings;
     uint32_t action;
+    struct nxci_cart *cart; /* Everything learned about the cart being converted. */
+    struct nxci_job *job;
 } nxci_ctx_t;
 
 #endif
@@ -1,85 +1,630 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "sha.h"
 #include "types.h"
 #include "utils.h"
+#include "error.h"
 
-/* Allocate new context. */
-sha_ctx_t *new_sha_ctx(hash_type_t type, int hmac) {
-    sha_ctx_t *ctx;
-    
-    if ((ctx = malloc(sizeof(*ctx))) == NULL) {
-        FATAL_ERROR("Failed to allocate sha_ctx_t!");
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA_HAVE_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*sha256_blocks_fn_t)(uint32_t state[8], const unsigned char *data, size_t num_blocks);
+
+static const uint32_t sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const uint32_t sha256_initial_state[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_S0(x) (SHA256_ROR(x, 2) ^ SHA256_ROR(x, 13) ^ SHA256_ROR(x, 22))
+#define SHA256_S1(x) (SHA256_ROR(x, 6) ^ SHA256_ROR(x, 11) ^ SHA256_ROR(x, 25))
+#define SHA256_G0(x) (SHA256_ROR(x, 7) ^ SHA256_ROR(x, 18) ^ ((x) >> 3))
+#define SHA256_G1(x) (SHA256_ROR(x, 17) ^ SHA256_ROR(x, 19) ^ ((x) >> 10))
+
+/* 64 rounds over a message schedule that already has the round constants added. */
+static inline void sha256_rounds(uint32_t state[8], const uint32_t *wk) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int t = 0; t < 64; t++) {
+        uint32_t t1 = h + SHA256_S1(e) + ((e & f) ^ (~e & g)) + wk[t];
+        uint32_t t2 = SHA256_S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
     }
-    
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_blocks_scalar(uint32_t state[8], const unsigned char *data, size_t num_blocks) {
+    uint32_t w[64];
+
+    while (num_blocks--) {
+        for (int t = 0; t < 16; t++)
+            w[t] = ((uint32_t)data[t * 4] << 24) | ((uint32_t)data[t * 4 + 1] << 16) | ((uint32_t)data[t * 4 + 2] << 8) | data[t * 4 + 3];
+        for (int t = 16; t < 64; t++)
+            w[t] = SHA256_G1(w[t - 2]) + w[t - 7] + SHA256_G0(w[t - 15]) + w[t - 16];
+        for (int t = 0; t < 64; t++)
+            w[t] += sha256_k[t];
+        sha256_rounds(state, w);
+        data += 0x40;
+    }
+}
+
+#ifdef SHA_HAVE_X86
+/* Intel SHA extensions, 4 rounds per sha256rnds2 pair. */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t num_blocks) {
+    const __m128i bswap_mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1); /* CDAB */
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); /* EFGH */
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+    while (num_blocks--) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[4];
+
+#ifdef __clang__
+#pragma unroll
+#else
+#pragma GCC unroll 16
+#endif
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 0x10)), bswap_mask);
+            } else {
+                __m128i msg = _mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]);
+                msg = _mm_add_epi32(msg, _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(msg, w[(i - 1) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += 0x40;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B); /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1); /* DCHG */
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0)); /* DCBA */
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8)); /* HGFE */
+}
+
+#define SHA256_AVX2_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+/* Next 4 schedule words from the previous 16, for two blocks at once (one per 128-bit lane). */
+__attribute__((target("avx2")))
+static inline __m256i sha256_avx2_schedule(__m256i x0, __m256i x1, __m256i x2, __m256i x3) {
+    __m256i w15 = _mm256_alignr_epi8(x1, x0, 4);
+    __m256i w7 = _mm256_alignr_epi8(x3, x2, 4);
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_AVX2_ROR(w15, 7), SHA256_AVX2_ROR(w15, 18)), _mm256_srli_epi32(w15, 3));
+    __m256i w = _mm256_add_epi32(_mm256_add_epi32(x0, w7), s0);
+
+    /* sigma1 of W[t-2], W[t-1] gives W[t], W[t+1], which in turn feed W[t+2], W[t+3]. */
+    __m256i v = _mm256_shuffle_epi32(x3, 0x0E);
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_AVX2_ROR(v, 17), SHA256_AVX2_ROR(v, 19)), _mm256_srli_epi32(v, 10));
+    w = _mm256_add_epi32(w, _mm256_blend_epi32(s1, _mm256_setzero_si256(), 0xCC));
+    v = _mm256_shuffle_epi32(w, 0x40);
+    s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_AVX2_ROR(v, 17), SHA256_AVX2_ROR(v, 19)), _mm256_srli_epi32(v, 10));
+    return _mm256_add_epi32(w, _mm256_blend_epi32(s1, _mm256_setzero_si256(), 0x33));
+}
+
+/* Message schedules of two blocks are built side by side in AVX2 lanes, rounds use BMI2 rotates. */
+__attribute__((target("avx2,bmi2")))
+static void sha256_blocks_avx2(uint32_t state[8], const unsigned char *data, size_t num_blocks) {
+    const __m256i bswap_mask = _mm256_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL, 0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    uint32_t wk[2][64];
+
+    while (num_blocks > 0) {
+        /* An odd trailing block is scheduled twice, only the first lane is used. */
+        const unsigned char *second = num_blocks > 1 ? data + 0x40 : data;
+        __m256i x[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(data + i * 0x10));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(second + i * 0x10));
+            x[i] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), bswap_mask);
+        }
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4)
+                x[i & 3] = sha256_avx2_schedule(x[i & 3], x[(i + 1) & 3], x[(i + 2) & 3], x[(i + 3) & 3]);
+            __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+            __m256i sum = _mm256_add_epi32(x[i & 3], k);
+            _mm_storeu_si128((__m128i *)&wk[0][i * 4], _mm256_castsi256_si128(sum));
+            _mm_storeu_si128((__m128i *)&wk[1][i * 4], _mm256_extracti128_si256(sum, 1));
+        }
+
+        sha256_rounds(state, wk[0]);
+        if (num_blocks == 1)
+            break;
+        sha256_rounds(state, wk[1]);
+        data += 0x80;
+        num_blocks -= 2;
+    }
+}
+
+#define SHA256_MB_LANES 8
+
+#define SHA256_MB_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static inline __m256i sha256_mb_load(const unsigned char *const *p, size_t ofs) {
+    uint32_t w[SHA256_MB_LANES];
+    for (int lane = 0; lane < SHA256_MB_LANES; lane++) {
+        const unsigned char *b = p[lane] + ofs;
+        w[lane] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    }
+    return _mm256_loadu_si256((const __m256i *)w);
+}
+
+/* Eight equal length messages at once, one per 32-bit AVX2 lane. */
+__attribute__((target("avx2")))
+static void sha256_mb_avx2(const unsigned char *const *msgs, size_t l, unsigned char *digests) {
+    unsigned char tails[SHA256_MB_LANES][0x80];
+    size_t full_len = l & ~(size_t)0x3F;
+    size_t num_blocks = (l + 9 + 0x3F) / 0x40;
+    uint64_t bits = (uint64_t)l * 8;
+    __m256i state[8];
+
+    /* Padding is identical in every lane, only the trailing message bytes differ. */
+    for (int lane = 0; lane < SHA256_MB_LANES; lane++) {
+        size_t tail_len = num_blocks * 0x40 - full_len;
+        memset(tails[lane], 0, sizeof(tails[lane]));
+        memcpy(tails[lane], msgs[lane] + full_len, l - full_len);
+        tails[lane][l - full_len] = 0x80;
+        for (int i = 0; i < 8; i++)
+            tails[lane][tail_len - 1 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    for (int i = 0; i < 8; i++)
+        state[i] = _mm256_set1_epi32((int)sha256_initial_state[i]);
+
+    for (size_t blk = 0; blk < num_blocks; blk++) {
+        const unsigned char *p[SHA256_MB_LANES];
+        size_t ofs = blk * 0x40;
+        for (int lane = 0; lane < SHA256_MB_LANES; lane++)
+            p[lane] = ofs < full_len ? msgs[lane] + ofs : tails[lane] + (ofs - full_len);
+
+        __m256i w[16];
+        __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+        __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t++) {
+            __m256i wt;
+            if (t < 16) {
+                wt = sha256_mb_load(p, t * 4);
+            } else {
+                __m256i w15 = w[(t - 15) & 0xF], w2 = w[(t - 2) & 0xF];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_MB_ROR(w15, 7), SHA256_MB_ROR(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_MB_ROR(w2, 17), SHA256_MB_ROR(w2, 19)), _mm256_srli_epi32(w2, 10));
+                wt = _mm256_add_epi32(_mm256_add_epi32(w[t & 0xF], s0), _mm256_add_epi32(w[(t - 7) & 0xF], s1));
+            }
+            w[t & 0xF] = wt;
+
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_MB_ROR(e, 6), SHA256_MB_ROR(e, 11)), SHA256_MB_ROR(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1), _mm256_add_epi32(ch, _mm256_add_epi32(wt, _mm256_set1_epi32((int)sha256_k[t]))));
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_MB_ROR(a, 2), SHA256_MB_ROR(a, 13)), SHA256_MB_ROR(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2 = _mm256_add_epi32(s0, maj);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+        state[0] = _mm256_add_epi32(state[0], a); state[1] = _mm256_add_epi32(state[1], b);
+        state[2] = _mm256_add_epi32(state[2], c); state[3] = _mm256_add_epi32(state[3], d);
+        state[4] = _mm256_add_epi32(state[4], e); state[5] = _mm256_add_epi32(state[5], f);
+        state[6] = _mm256_add_epi32(state[6], g); state[7] = _mm256_add_epi32(state[7], h);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t words[SHA256_MB_LANES];
+        _mm256_storeu_si256((__m256i *)words, state[i]);
+        for (int lane = 0; lane < SHA256_MB_LANES; lane++) {
+            unsigned char *out = digests + lane * 0x20 + i * 4;
+            out[0] = (unsigned char)(words[lane] >> 24);
+            out[1] = (unsigned char)(words[lane] >> 16);
+            out[2] = (unsigned char)(words[lane] >> 8);
+            out[3] = (unsigned char)words[lane];
+        }
+    }
+}
+#endif
+
+static sha256_blocks_fn_t sha256_blocks = sha256_blocks_scalar;
+static int sha256_use_mb = 0; /* Multi-buffer lanes beat one stream at a time. */
+static const char *sha256_impl_name = "scalar";
+static pthread_once_t sha256_dispatch_once = PTHREAD_ONCE_INIT;
+static int sha256_broken; /* Raised after pthread_once, never unwound out of it. */
+
+static void sha256_set_impl(sha256_blocks_fn_t fn, const char *name) {
+    sha256_blocks = fn;
+    sha256_impl_name = name;
+}
+
+/* Pick the fastest implementation the CPU has, falling back to scalar if it fails the self test. */
+static void sha256_dispatch_init(void) {
+#ifdef SHA_HAVE_X86
+    unsigned int eax, ebx, ecx, edx;
+    int has_sha = 0;
+    __builtin_cpu_init();
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        has_sha = (ebx >> 29) & 1;
+    if (has_sha && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3"))
+        sha256_set_impl(sha256_blocks_shani, "sha-ni");
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"))
+        sha256_set_impl(sha256_blocks_avx2, "avx2");
+    /* A single SHA-NI stream is about as fast as eight AVX2 lanes. */
+    sha256_use_mb = !has_sha && __builtin_cpu_supports("avx2");
+#endif
+    if (sha256_use_mb && sha256_self_test() != 0) {
+        fprintf(stderr, "Warning: multi-buffer SHA-256 failed self test, hashing one buffer at a time\n");
+        sha256_use_mb = 0;
+    }
+    if (sha256_blocks != sha256_blocks_scalar && sha256_self_test() != 0) {
+        fprintf(stderr, "Warning: %s SHA-256 failed self test, using scalar code\n", sha256_impl_name);
+        sha256_set_impl(sha256_blocks_scalar, "scalar");
+    }
+    sha256_broken = sha256_self_test() != 0;
+}
+
+static void sha256_dispatch(void) {
+    pthread_once(&sha256_dispatch_once, sha256_dispatch_init);
+    if (sha256_broken) {
+        nxci_fail("SHA-256 self test failed!");
+    }
+}
+
+const char *sha256_get_impl_name(void) {
+    sha256_dispatch();
+    return sha256_impl_name;
+}
+
+static void sha256_init(sha_ctx_t *ctx) {
+    memcpy(ctx->state, sha256_initial_state, sizeof(ctx->state));
+    ctx->block_len = 0;
+    ctx->total_len = 0;
+}
+
+static void sha256_update(sha_ctx_t *ctx, const unsigned char *data, size_t l) {
+    ctx->total_len += l;
+    if (ctx->block_len > 0) {
+        size_t n = sizeof(ctx->block) - ctx->block_len;
+        if (n > l) n = l;
+        memcpy(ctx->block + ctx->block_len, data, n);
+        ctx->block_len += n;
+        data += n;
+        l -= n;
+        if (ctx->block_len < sizeof(ctx->block))
+            return;
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+    if (l >= 0x40) {
+        sha256_blocks(ctx->state, data, l / 0x40);
+        data += l & ~(size_t)0x3F;
+        l &= 0x3F;
+    }
+    memcpy(ctx->block, data, l);
+    ctx->block_len = l;
+}
+
+static void sha256_final(sha_ctx_t *ctx, unsigned char *hash) {
+    unsigned char pad[0x80];
+    size_t pad_len = ctx->block_len < 0x38 ? 0x40 : 0x80;
+    uint64_t bits = ctx->total_len * 8;
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, ctx->block, ctx->block_len);
+    pad[ctx->block_len] = 0x80;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len - 1 - i] = (unsigned char)(bits >> (i * 8));
+    sha256_blocks(ctx->state, pad, pad_len / 0x40);
+
+    for (int i = 0; i < 8; i++) {
+        hash[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        hash[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        hash[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        hash[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+static void sha256_hash_blocks_dispatch(size_t n, const void *const *ptrs, size_t l, unsigned char *digests);
+
+/* Known answers from FIPS 180-2, run against the selected implementation. */
+int sha256_self_test(void) {
+    static const struct {
+        const char *msg;
+        unsigned int repeat;
+        unsigned char hash[0x20];
+    } vectors[] = {
+        {"", 1, {0xE3, 0xB0, 0xC4, 0x42, 0x98, 0xFC, 0x1C, 0x14, 0x9A, 0xFB, 0xF4, 0xC8, 0x99, 0x6F, 0xB9, 0x24,
+                 0x27, 0xAE, 0x41, 0xE4, 0x64, 0x9B, 0x93, 0x4C, 0xA4, 0x95, 0x99, 0x1B, 0x78, 0x52, 0xB8, 0x55}},
+        {"abc", 1, {0xBA, 0x78, 0x16, 0xBF, 0x8F, 0x01, 0xCF, 0xEA, 0x41, 0x41, 0x40, 0xDE, 0x5D, 0xAE, 0x22, 0x23,
+                    0xB0, 0x03, 0x61, 0xA3, 0x96, 0x17, 0x7A, 0x9C, 0xB4, 0x10, 0xFF, 0x61, 0xF2, 0x00, 0x15, 0xAD}},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+                   {0x24, 0x8D, 0x6A, 0x61, 0xD2, 0x06, 0x38, 0xB8, 0xE5, 0xC0, 0x26, 0x93, 0x0C, 0x3E, 0x60, 0x39,
+                    0xA3, 0x3C, 0xE4, 0x59, 0x64, 0xFF, 0x21, 0x67, 0xF6, 0xEC, 0xED, 0xD4, 0x19, 0xDB, 0x06, 0xC1}},
+        {"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+                   {0xCD, 0xC7, 0x6E, 0x5C, 0x99, 0x14, 0xFB, 0x92, 0x81, 0xA1, 0xC7, 0xE2, 0x84, 0xD7, 0x3E, 0x67,
+                    0xF1, 0x80, 0x9A, 0x48, 0xA4, 0x97, 0x20, 0x0E, 0x04, 0x6D, 0x39, 0xCC, 0xC7, 0x11, 0x2C, 0xD0}},
+    };
+    sha_ctx_t ctx;
+    unsigned char hash[0x20];
+    unsigned char mb_hashes[11][0x20];
+    const void *mb_ptrs[11];
+
+    for (unsigned int i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        sha256_init(&ctx);
+        for (unsigned int j = 0; j < vectors[i].repeat; j++)
+            sha256_update(&ctx, (const unsigned char *)vectors[i].msg, strlen(vectors[i].msg));
+        sha256_final(&ctx, hash);
+        if (memcmp(hash, vectors[i].hash, sizeof(hash)) != 0)
+            return -1;
+
+        /* 11 lanes covers a full batch plus a partial one. */
+        if (vectors[i].repeat != 1)
+            continue;
+        for (unsigned int j = 0; j < 11; j++)
+            mb_ptrs[j] = vectors[i].msg;
+        sha256_hash_blocks_dispatch(11, mb_ptrs, strlen(vectors[i].msg), &mb_hashes[0][0]);
+        for (unsigned int j = 0; j < 11; j++) {
+            if (memcmp(mb_hashes[j], vectors[i].hash, sizeof(hash)) != 0)
+                return -1;
+        }
+    }
+
+    /* Whole blocks of bytes 00..FF repeating, the lengths lanes see in practice. */
+    static const struct {
+        size_t len;
+        unsigned char hash[0x20];
+    } block_vectors[] = {
+        {0x40, {0xFD, 0xEA, 0xB9, 0xAC, 0xF3, 0x71, 0x03, 0x62, 0xBD, 0x26, 0x58, 0xCD, 0xC9, 0xA2, 0x9E, 0x8F,
+                0x9C, 0x75, 0x7F, 0xCF, 0x98, 0x11, 0x60, 0x3A, 0x8C, 0x44, 0x7C, 0xD1, 0xD9, 0x15, 0x11, 0x08}},
+        {0x200, {0x11, 0x00, 0x09, 0xDC, 0xEE, 0x21, 0x62, 0x0B, 0x16, 0x6F, 0x3A, 0xBF, 0xEC, 0xB5, 0xEF, 0xF7,
+                 0xA8, 0x73, 0xBE, 0x72, 0x9D, 0x1C, 0x2D, 0x53, 0x82, 0x2E, 0x7A, 0xCC, 0x5F, 0x34, 0xEB, 0x9B}},
+        {0x1000, {0xC8, 0xF5, 0xD0, 0x34, 0x1D, 0x54, 0xD9, 0x51, 0xA7, 0x1B, 0x13, 0x6E, 0x6E, 0x2A, 0xFC, 0xB1,
+                  0x4D, 0x11, 0xED, 0x84, 0x89, 0xA7, 0xAE, 0x12, 0x6A, 0x8F, 0xEE, 0x0D, 0xF6, 0xEC, 0xF1, 0x93}},
+    };
+    unsigned char block_msg[0x1000];
+    for (unsigned int i = 0; i < sizeof(block_msg); i++)
+        block_msg[i] = (unsigned char)i;
+
+    for (unsigned int i = 0; i < sizeof(block_vectors) / sizeof(block_vectors[0]); i++) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, block_msg, block_vectors[i].len);
+        sha256_final(&ctx, hash);
+        if (memcmp(hash, block_vectors[i].hash, sizeof(hash)) != 0)
+            return -1;
+
+        for (unsigned int j = 0; j < 11; j++)
+            mb_ptrs[j] = block_msg;
+        sha256_hash_blocks_dispatch(11, mb_ptrs, block_vectors[i].len, &mb_hashes[0][0]);
+        for (unsigned int j = 0; j < 11; j++) {
+            if (memcmp(mb_hashes[j], block_vectors[i].hash, sizeof(hash)) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void sha256_hash_blocks_dispatch(size_t n, const void *const *ptrs, size_t l, unsigned char *digests) {
+#ifdef SHA_HAVE_X86
+    if (sha256_use_mb) {
+        while (n > 0) {
+            const unsigned char *lanes[SHA256_MB_LANES];
+            unsigned char lane_digests[SHA256_MB_LANES][0x20];
+            size_t count = n < SHA256_MB_LANES ? n : SHA256_MB_LANES;
+            /* Idle lanes rehash the first buffer. */
+            for (size_t i = 0; i < SHA256_MB_LANES; i++)
+                lanes[i] = ptrs[i < count ? i : 0];
+            sha256_mb_avx2(lanes, l, &lane_digests[0][0]);
+            memcpy(digests, lane_digests, count * 0x20);
+            ptrs += count;
+            digests += count * 0x20;
+            n -= count;
+        }
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < n; i++) {
+        sha_ctx_t ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, ptrs[i], l);
+        sha256_final(&ctx, digests + i * 0x20);
+    }
+}
+
+/* Hash n independent buffers of l bytes each, digests receives n consecutive hashes. */
+void sha256_hash_blocks(size_t n, const void *const *ptrs, size_t l, unsigned char *digests) {
+    sha256_dispatch();
+    sha256_hash_blocks_dispatch(n, ptrs, l, digests);
+}
+
+#define SHA_POOL_SIZE 8
+
+/* Idle contexts of the calling thread. */
+typedef struct {
+    sha_ctx_t *ctxs[SHA_POOL_SIZE];
+    unsigned int num_ctxs;
+} sha_pool_t;
+
+static pthread_key_t sha_pool_key;
+static pthread_once_t sha_pool_once = PTHREAD_ONCE_INIT;
+static int sha_pool_key_failed;
+
+static void sha_pool_destroy(void *arg) {
+    sha_pool_t *pool = arg;
+    for (unsigned int i = 0; i < pool->num_ctxs; i++) {
+        sha_ctx_cleanup(pool->ctxs[i]);
+        free(pool->ctxs[i]);
+    }
+    free(pool);
+}
+
+static void sha_pool_key_init(void) {
+    sha_pool_key_failed = pthread_key_create(&sha_pool_key, sha_pool_destroy) != 0;
+}
+
+static sha_pool_t *sha_get_pool(void) {
+    pthread_once(&sha_pool_once, sha_pool_key_init);
+    if (sha_pool_key_failed) {
+        nxci_fail("Failed to create hash context pool!");
+    }
+    sha_pool_t *pool = pthread_getspecific(sha_pool_key);
+    if (pool == NULL) {
+        if ((pool = nxci_calloc(1, sizeof(*pool))) == NULL) {
+            nxci_fail("Failed to allocate hash context pool!");
+        }
+        pthread_setspecific(sha_pool_key, pool);
+    }
+    return pool;
+}
+
+static void sha_ctx_start(sha_ctx_t *ctx) {
+    if (ctx->native) {
+        sha256_init(ctx);
+    } else if (mbedtls_md_starts(&ctx->digest)) {
+        nxci_fail("Failed to start hash context!");
+    }
+}
+
+/* Set up a caller-owned context. */
+void sha_ctx_init(sha_ctx_t *ctx, hash_type_t type, int hmac) {
     mbedtls_md_init(&ctx->digest);
-    
-    if (mbedtls_md_setup(&ctx->digest, mbedtls_md_info_from_type(type), hmac)) {
-        FATAL_ERROR("Failed to set up hash context!");
+    ctx->type = type;
+    ctx->hmac = hmac;
+    ctx->native = type == HASH_TYPE_SHA256 && !hmac;
+    if (ctx->native) {
+        sha256_dispatch();
+    } else if (mbedtls_md_setup(&ctx->digest, mbedtls_md_info_from_type(type), hmac)) {
+        mbedtls_md_free(&ctx->digest);
+        nxci_fail("Failed to set up hash context!");
+    }
+    sha_ctx_start(ctx);
+}
+
+void sha_ctx_cleanup(sha_ctx_t *ctx) {
+    mbedtls_md_free(&ctx->digest);
+}
+
+/* Get a started context, reusing an idle one of the same type when possible. */
+sha_ctx_t *new_sha_ctx(hash_type_t type, int hmac) {
+    sha_pool_t *pool = sha_get_pool();
+    sha_ctx_t *ctx;
+
+    for (unsigned int i = 0; i < pool->num_ctxs; i++) {
+        ctx = pool->ctxs[i];
+        if (ctx->type == type && ctx->hmac == hmac) {
+            pool->ctxs[i] = pool->ctxs[--pool->num_ctxs];
+            sha_ctx_start(ctx);
+            return ctx;
+        }
     }
     
-    if (mbedtls_md_starts(&ctx->digest)) {
-        FATAL_ERROR("Failed to start hash context!");
+    if ((ctx = nxci_malloc(sizeof(*ctx))) == NULL) {
+        nxci_fail("Failed to allocate sha_ctx_t!");
     }
+    nxci_cleanup_t cleanup;
+    nxci_cleanup_push(&cleanup, free, ctx);
+    sha_ctx_init(ctx, type, hmac);
+    nxci_cleanup_pop(&cleanup, 0);
     
     return ctx;
 }
 
-/* Free an allocated context. */
+/* Release a context to the pool, the oldest idle context is dropped when it's full. */
 void free_sha_ctx(sha_ctx_t *ctx) {
     /* Explicitly allow NULL. */
     if (ctx == NULL) {
         return;
     }
-    
-    mbedtls_md_free(&ctx->digest);
-    free(ctx);
+
+    sha_pool_t *pool = sha_get_pool();
+    if (pool->num_ctxs == SHA_POOL_SIZE) {
+        sha_ctx_cleanup(pool->ctxs[0]);
+        free(pool->ctxs[0]);
+        memmove(&pool->ctxs[0], &pool->ctxs[1], (SHA_POOL_SIZE - 1) * sizeof(pool->ctxs[0]));
+        pool->num_ctxs--;
+    }
+    pool->ctxs[pool->num_ctxs++] = ctx;
 }
 
 /* Update digest with new data. */
 void sha_update(sha_ctx_t *ctx, const void *data, size_t l) {
+    if (ctx->native) {
+        sha256_update(ctx, data, l);
+        return;
+    }
     mbedtls_md_update(&ctx->digest, data, l);
 }
 
 /* Read hash from context. */
 void sha_get_hash(sha_ctx_t *ctx, unsigned char *hash) {
+    if (ctx->native) {
+        sha256_final(ctx, hash);
+        return;
+    }
     mbedtls_md_finish(&ctx->digest, hash);
 }
 
 /* SHA256 digest. */
 void sha256_hash_buffer(unsigned char *digest, const void *data, size_t l) {
-    sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
-    sha_update(sha_ctx, data, l);
-    sha_get_hash(sha_ctx, digest);
-    free_sha_ctx(sha_ctx);
+    sha_ctx_t sha_ctx;
+    sha_ctx_init(&sha_ctx, HASH_TYPE_SHA256, 0);
+    sha_update(&sha_ctx, data, l);
+    sha_get_hash(&sha_ctx, digest);
+    sha_ctx_cleanup(&sha_ctx);
 }
 
 /* SHA256-HMAC digest. */
 void sha256_get_buffer_hmac(void *digest, const void *secret, size_t s_l, const void *data, size_t d_l) {
-    sha_ctx_t *ctx;
-    
-    if ((ctx = malloc(sizeof(*ctx))) == NULL) {
-        FATAL_ERROR("Failed to allocate sha_ctx_t!");
-    }
+    sha_ctx_t ctx;
+    const char *error = NULL;
     
-    mbedtls_md_init(&ctx->digest);
-    
-    if (mbedtls_md_setup(&ctx->digest, mbedtls_md_info_from_type(HASH_TYPE_SHA256), 1)) {
-        FATAL_ERROR("Failed to set up hash context!");
-    }
-    
-    if (mbedtls_md_hmac_starts(&ctx->digest, secret, s_l)) {
-        FATAL_ERROR("Failed to set up HMAC secret context!");
-    }
+    mbedtls_md_init(&ctx.digest);
     
-    if (mbedtls_md_hmac_update(&ctx->digest, data, d_l)) {
-        FATAL_ERROR("Failed processing HMAC input!");
+    if (mbedtls_md_setup(&ctx.digest, mbedtls_md_info_from_type(HASH_TYPE_SHA256), 1)) {
+        error = "Failed to set up hash context!";
+    } else if (mbedtls_md_hmac_starts(&ctx.digest, secret, s_l)) {
+        error = "Failed to set up HMAC secret context!";
+    } else if (mbedtls_md_hmac_update(&ctx.digest, data, d_l)) {
+        error = "Failed processing HMAC input!";
+    } else if (mbedtls_md_hmac_finish(&ctx.digest, digest)) {
+        error = "Failed getting HMAC output!";
     }
     
-    if (mbedtls_md_hmac_finish(&ctx->digest, digest)) {
-        FATAL_ERROR("Failed getting HMAC output!");
+    mbedtls_md_free(&ctx.digest);
+    if (error != NULL) {
+        nxci_fail("%s", error);
     }
-    
-    mbedtls_md_free(&ctx->digest);
-    free(ctx);
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #ifndef NXCI_SHA_H
 #define NXCI_SHA_H
 
+#include <stdint.h>
 #include "mbedtls/md.h"
 
 /* Enumerations. */
@@ -10,8 +11,15 @@ typedef enum {
 } hash_type_t;
 
 /* Define structs. */
-typedef struct {
-    mbedtls_md_context_t digest;
+typedef struct sha_ctx {
+    mbedtls_md_context_t digest; /* SHA-1 and HMAC. */
+    hash_type_t type;
+    int hmac;
+    int native; /* Plain SHA-256, handled by sha.c itself. */
+    uint32_t state[8];
+    unsigned char block[0x40];
+    size_t block_len;
+    uint64_t total_len;
 } sha_ctx_t;
 
 /* Function prototypes. */
@@ -20,8 +28,17 @@ void sha_update(sha_ctx_t *ctx, const void *data, size_t l);
 void sha_get_hash(sha_ctx_t *ctx, unsigned char *hash);
 void free_sha_ctx(sha_ctx_t *ctx);
 
+/* Caller-owned (e.g. stack) contexts, bypass the pool. */
+void sha_ctx_init(sha_ctx_t *ctx, hash_type_t type, int hmac);
+void sha_ctx_cleanup(sha_ctx_t *ctx);
+
 void sha256_hash_buffer(unsigned char *digest, const void *data, size_t l);
 
+void sha256_hash_blocks(size_t n, const void *const *ptrs, size_t l, unsigned char *digests);
+
+const char *sha256_get_impl_name(void);
+int sha256_self_test(void);
+
 void sha256_get_buffer_hmac(void *digest, const void *secret, size_t s_l, const void *data, size_t d_l);
 
 #endif
@@ -0,0 +1,47 @@
+#include <string.h>
+#include "signals.h"
+
+#ifndef _WIN32
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+static int signals_pipe[2] = {-1, -1};
+
+static void signals_handler(int sig) {
+    (void)sig;
+    ssize_t n = write(signals_pipe[1], "", 1);
+    (void)n;
+}
+
+int signals_init(void) {
+    if (pipe(signals_pipe) != 0)
+        return -1;
+    fcntl(signals_pipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signals_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    return signals_pipe[0];
+}
+
+void signals_block(sigset_t *old_signals) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, old_signals);
+}
+
+void signals_free(void) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    close(signals_pipe[0]);
+    close(signals_pipe[1]);
+    signals_pipe[0] = signals_pipe[1] = -1;
+}
+
+#endif
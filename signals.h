@@ -0,0 +1,14 @@
+#ifndef NXCI_SIGNALS_H
+#define NXCI_SIGNALS_H
+
+#include <signal.h>
+
+/* SIGINT and SIGTERM make the returned fd readable instead of killing the process, so a select() loop can stop cleanly.
+   Threads started with signals_block() in effect leave the signals to the loop's thread. -1 on error. */
+int signals_init(void);
+/* Block SIGINT and SIGTERM on the calling thread, old_signals (may be NULL) gets the previous mask. */
+void signals_block(sigset_t *old_signals);
+/* Default handlers again. */
+void signals_free(void);
+
+#endif
@@ -0,0 +1,442 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include "uring.h"
+#include "nca.h"
+#include "sha.h"
+#include "bufpool.h"
+#include "lib4nxci.h"
+
+static uring_stats_t uring_stats;
+static pthread_mutex_t uring_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef NXCI_HAVE_IO_URING
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Minimal ring on top of the raw syscalls, there's only ever one submitter. */
+typedef struct {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int sq_local_tail; /* Queued, not yet published. */
+    unsigned int sq_submitted;
+} uring_t;
+
+#define URING_OP_READ 0
+#define URING_OP_WRITE 1
+
+typedef struct {
+    unsigned char *data;
+    struct iovec read_iov;
+    struct iovec write_iov; /* Separate, a write and its linked read are in flight together. */
+    uint64_t chunk; /* Chunk the buffer holds or is reading. */
+    uint64_t write_chunk; /* Chunk being written, chunk moves on once the linked read is queued. */
+    int ready; /* Read completed, waiting to be hashed. */
+    int writing;
+    int read_cancelled; /* Linked read dropped because its write came up short. */
+    uint64_t read_start_ns;
+    uint64_t write_start_ns;
+} uring_buf_t;
+
+typedef struct {
+    uring_t ring;
+    nxci_io_t *in;
+    nxci_io_t *out;
+    uint64_t ofs;
+    uint64_t out_ofs;
+    uint64_t total_size;
+    uint64_t buffer_size;
+    uint64_t num_chunks;
+    unsigned int depth;
+    unsigned int in_flight;
+    unsigned char *region;
+    uring_buf_t bufs[URING_MAX_DEPTH];
+    uring_stats_t stats;
+} uring_copy_t;
+
+static atomic_int uring_warned;
+
+static uint64_t uring_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int uring_init(uring_t *ring, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -errno;
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    unsigned char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->sq_local_tail = ring->sq_submitted = *ring->sq_tail;
+    return 0;
+
+fail_cq:
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail:;
+    int err = errno;
+    close(ring->fd);
+    return -err;
+}
+
+static void uring_free(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        nxci_fail("io_uring submission queue overflow!");
+    }
+    unsigned int idx = ring->sq_local_tail++ & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    return sqe;
+}
+
+static int uring_cq_empty(uring_t *ring) {
+    return *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+/* Publish queued SQEs, then wait for a completion unless one is already there. */
+static void uring_submit(uring_copy_t *copy) {
+    uring_t *ring = &copy->ring;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = ring->sq_local_tail - ring->sq_submitted;
+    unsigned int wait_nr = uring_cq_empty(ring) ? 1 : 0;
+    if (to_submit == 0 && wait_nr == 0)
+        return;
+
+    if (to_submit != 0) {
+        copy->stats.submits++;
+        copy->stats.depth_sum += copy->in_flight;
+        if (copy->in_flight > copy->stats.max_depth)
+            copy->stats.max_depth = copy->in_flight;
+    }
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        nxci_fail("io_uring_enter failed: %s", strerror(errno));
+    }
+    ring->sq_submitted += ret;
+}
+
+static void uring_queue_read(uring_copy_t *copy, unsigned int b, uint64_t chunk) {
+    uring_buf_t *buf = &copy->bufs[b];
+    uint64_t chunk_ofs = chunk * copy->buffer_size;
+    buf->chunk = chunk;
+    buf->ready = 0;
+    buf->read_cancelled = 0;
+    buf->read_iov.iov_base = buf->data;
+    buf->read_iov.iov_len = copy->total_size - chunk_ofs < copy->buffer_size ? copy->total_size - chunk_ofs : copy->buffer_size;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&copy->ring);
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = copy->in->fd;
+    sqe->off = copy->ofs + chunk_ofs;
+    sqe->addr = (uintptr_t)&buf->read_iov;
+    sqe->len = 1;
+    sqe->user_data = ((uint64_t)b << 1) | URING_OP_READ;
+    buf->read_start_ns = uring_now_ns();
+    copy->in_flight++;
+}
+
+static void uring_queue_write(uring_copy_t *copy, unsigned int b, int link) {
+    uring_buf_t *buf = &copy->bufs[b];
+    buf->writing = 1;
+    buf->write_chunk = buf->chunk;
+    buf->write_iov = buf->read_iov;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&copy->ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = copy->out->fd;
+    sqe->off = copy->out_ofs + buf->write_chunk * copy->buffer_size;
+    sqe->addr = (uintptr_t)&buf->write_iov;
+    sqe->len = 1;
+    /* The next read into this buffer only starts once the write is done. */
+    if (link)
+        sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = ((uint64_t)b << 1) | URING_OP_WRITE;
+    buf->write_start_ns = uring_now_ns();
+    copy->in_flight++;
+}
+
+static void uring_record_latency(uring_stats_t *stats, uint64_t ns) {
+    unsigned int bucket = 0;
+    uint64_t us = ns / 1000;
+    while (us > 1 && bucket < URING_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    stats->latency_hist[bucket]++;
+    stats->latency_sum_ns += ns;
+    if (ns > stats->latency_max_ns)
+        stats->latency_max_ns = ns;
+}
+
+static void uring_reap(uring_copy_t *copy) {
+    uring_t *ring = &copy->ring;
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    uint64_t now = uring_now_ns();
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned int b = cqe->user_data >> 1;
+        uring_buf_t *buf = &copy->bufs[b];
+        int res = cqe->res;
+        copy->in_flight--;
+        /* Consumed before it's looked at, so a failure leaves the ring consistent for uring_drain. */
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if ((cqe->user_data & 1) == URING_OP_READ) {
+            if (res == -ECANCELED) {
+                buf->read_cancelled = 1;
+                continue;
+            }
+            if (res < 0) {
+                nxci_fail("Failed to read file: %s", strerror(-res));
+            }
+            /* Finish short reads synchronously, they're rare for regular files. */
+            size_t size = buf->read_iov.iov_len;
+            if ((size_t)res < size && nxci_io_read_at(copy->in, buf->data + res, size - res, copy->ofs + buf->chunk * copy->buffer_size + res) != size - res) {
+                nxci_fail("Failed to read file!");
+            }
+            copy->stats.reads++;
+            uring_record_latency(&copy->stats, now - buf->read_start_ns);
+            buf->ready = 1;
+        } else {
+            if (res < 0) {
+                nxci_fail("Failed to write file: %s", strerror(-res));
+            }
+            /* A short write fails the link, so the linked read never touched the buffer. */
+            size_t size = buf->write_iov.iov_len;
+            if ((size_t)res < size) {
+                if (nxci_io_write_at(copy->out, buf->data + res, size - res, copy->out_ofs + buf->write_chunk * copy->buffer_size + res) != size - res) {
+                    nxci_fail("Failed to write file!");
+                }
+            }
+            copy->stats.writes++;
+            uring_record_latency(&copy->stats, now - buf->write_start_ns);
+            buf->writing = 0;
+        }
+    }
+
+    /* Requeue reads dropped by a short write, now that the write is finished. */
+    for (unsigned int b = 0; b < copy->depth; b++) {
+        if (copy->bufs[b].read_cancelled && !copy->bufs[b].writing)
+            uring_queue_read(copy, b, copy->bufs[b].chunk);
+    }
+}
+
+static void uring_merge_stats(const uring_stats_t *stats) {
+    pthread_mutex_lock(&uring_stats_lock);
+    uring_stats.reads += stats->reads;
+    uring_stats.writes += stats->writes;
+    uring_stats.submits += stats->submits;
+    uring_stats.depth_sum += stats->depth_sum;
+    if (stats->max_depth > uring_stats.max_depth)
+        uring_stats.max_depth = stats->max_depth;
+    uring_stats.latency_sum_ns += stats->latency_sum_ns;
+    if (stats->latency_max_ns > uring_stats.latency_max_ns)
+        uring_stats.latency_max_ns = stats->latency_max_ns;
+    for (unsigned int i = 0; i < URING_LATENCY_BUCKETS; i++)
+        uring_stats.latency_hist[i] += stats->latency_hist[i];
+    pthread_mutex_unlock(&uring_stats_lock);
+}
+
+/* After a failure, wait out what the kernel still has in flight before the buffers go away. */
+static void uring_drain(uring_copy_t *copy) {
+    uring_t *ring = &copy->ring;
+    /* Queued but never submitted, the kernel hasn't seen them. */
+    copy->in_flight -= ring->sq_local_tail - ring->sq_submitted;
+    while (copy->in_flight != 0) {
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                break;
+            continue;
+        }
+        copy->in_flight -= tail - head;
+        __atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void uring_copy_release(void *arg) {
+    uring_copy_t *copy = arg;
+    uring_drain(copy);
+    bufpool_put(copy->region);
+    uring_free(&copy->ring);
+    free(copy);
+}
+
+/* Chunk i always lives in buffer i % depth: up to depth reads are in flight, chunks are patched and hashed
+   in order on the calling thread, and each write is linked to the read of the next chunk into its buffer. */
+int uring_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings) {
+    /* Direct I/O would need aligned offsets, which NCAs within an XCI don't have. */
+    if (in->fd < 0 || out->fd < 0 || ((in->flags | out->flags) & NXCI_IO_FLAG_DIRECT))
+        return 0;
+
+    uring_copy_t *copy = nxci_calloc(1, sizeof(*copy));
+    if (copy == NULL) {
+        nxci_fail("Failed to allocate io_uring copy!");
+    }
+    copy->in = in;
+    copy->out = out;
+    copy->ofs = ofs;
+    copy->out_ofs = out_ofs;
+    copy->total_size = total_size;
+    copy->buffer_size = align64(settings->buffer_size, NXCI_IO_DIRECT_ALIGN);
+    copy->num_chunks = (total_size + copy->buffer_size - 1) / copy->buffer_size;
+    copy->depth = settings->queue_depth;
+    if (copy->depth < 1) copy->depth = 1;
+    if (copy->depth > URING_MAX_DEPTH) copy->depth = URING_MAX_DEPTH;
+    if (copy->num_chunks < copy->depth) copy->depth = copy->num_chunks == 0 ? 1 : (unsigned int)copy->num_chunks;
+
+    /* The pool may hand out fewer or smaller buffers, chunks follow the buffer size. */
+    copy->region = bufpool_get_buffers(&copy->buffer_size, &copy->depth);
+    copy->num_chunks = (total_size + copy->buffer_size - 1) / copy->buffer_size;
+
+    int ret = uring_init(&copy->ring, copy->depth * 2);
+    if (ret < 0) {
+        if (!atomic_exchange(&uring_warned, 1))
+            fprintf(stderr, "Warning: io_uring unavailable (%s), using pread\n", strerror(-ret));
+        bufpool_put(copy->region);
+        free(copy);
+        return 0;
+    }
+    nxci_cleanup_t cleanup;
+    nxci_cleanup_push(&cleanup, uring_copy_release, copy);
+
+    for (unsigned int b = 0; b < copy->depth; b++)
+        copy->bufs[b].data = copy->region + b * copy->buffer_size;
+
+    uint64_t next_read = 0, next_hash = 0;
+    for (unsigned int b = 0; b < copy->depth && next_read < copy->num_chunks; b++)
+        uring_queue_read(copy, b, next_read++);
+
+    while (next_hash < copy->num_chunks || copy->in_flight != 0) {
+        uring_submit(copy);
+        uring_reap(copy);
+        uring_buf_t *buf;
+        while (next_hash < copy->num_chunks && (buf = &copy->bufs[next_hash % copy->depth])->ready) {
+            unsigned int b = next_hash % copy->depth;
+            uint64_t len = buf->read_iov.iov_len; /* Reused by the next read into buf. */
+            buf->ready = 0;
+            if (plan != NULL)
+                nca_patch_plan_apply(plan, buf->chunk * copy->buffer_size, buf->data, buf->read_iov.iov_len);
+            if (sha != NULL)
+                sha_update(sha, buf->data, buf->read_iov.iov_len);
+            int more = next_read < copy->num_chunks;
+            uring_queue_write(copy, b, more);
+            if (more)
+                uring_queue_read(copy, b, next_read++);
+            next_hash++;
+            nxci_job_advance(settings->job, len);
+        }
+    }
+
+    uring_merge_stats(&copy->stats);
+    nxci_cleanup_pop(&cleanup, 1);
+    return 1;
+}
+#else
+int uring_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings) {
+    (void)in; (void)ofs; (void)total_size; (void)out; (void)out_ofs; (void)plan; (void)sha; (void)settings;
+    return 0;
+}
+#endif
+
+void uring_get_stats(uring_stats_t *stats) {
+    pthread_mutex_lock(&uring_stats_lock);
+    *stats = uring_stats;
+    pthread_mutex_unlock(&uring_stats_lock);
+}
+
+/* Upper bound of the bucket holding the given fraction of completions, in microseconds. */
+static uint64_t uring_latency_percentile(const uring_stats_t *stats, uint64_t total, unsigned int percent) {
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < URING_LATENCY_BUCKETS; i++) {
+        seen += stats->latency_hist[i];
+        if (seen * 100 >= total * percent)
+            return 2ULL << i;
+    }
+    return 2ULL << (URING_LATENCY_BUCKETS - 1);
+}
+
+void uring_print_stats(FILE *f) {
+    uring_stats_t stats;
+    uring_get_stats(&stats);
+    uint64_t total = stats.reads + stats.writes;
+    if (total == 0)
+        return;
+    fprintf(f, "io_uring: %" PRIu64 " reads, %" PRIu64 " writes, queue depth avg %.1f max %u\n", stats.reads, stats.writes,
+        stats.submits ? (double)stats.depth_sum / stats.submits : 0.0, stats.max_depth);
+    fprintf(f, "io_uring completion latency: avg %" PRIu64 " us, p50 < %" PRIu64 " us, p99 < %" PRIu64 " us, max %" PRIu64 " us\n",
+        stats.latency_sum_ns / total / 1000, uring_latency_percentile(&stats, total, 50), uring_latency_percentile(&stats, total, 99),
+        stats.latency_max_ns / 1000);
+}
@@ -0,0 +1,35 @@
+#ifndef NXCI_URING_H
+#define NXCI_URING_H
+
+#include <stdio.h>
+#include "types.h"
+#include "utils.h"
+#include "io.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NXCI_HAVE_IO_URING
+#endif
+#endif
+
+#define URING_MAX_DEPTH 64
+#define URING_LATENCY_BUCKETS 24 /* log2 of completion latency in microseconds. */
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t submits;
+    uint64_t depth_sum; /* Requests in flight, summed over submits. */
+    unsigned int max_depth;
+    uint64_t latency_sum_ns;
+    uint64_t latency_max_ns;
+    uint64_t latency_hist[URING_LATENCY_BUCKETS];
+} uring_stats_t;
+
+/* Copy like copy_file_section with reads and writes queued on an io_uring.
+   Returns 0 without touching anything when the ring can't be used, so the caller can fall back. */
+int uring_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings);
+void uring_get_stats(uring_stats_t *stats);
+void uring_print_stats(FILE *f);
+
+#endif
@@ -1,13 +1,63 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #ifdef _WIN32
 #include <direct.h>
+#include <malloc.h>
 #endif
 #include "utils.h"
 #include "filepath.h"
+#include "io.h"
 #include "sha.h"
+#include "nca.h"
+#include "pipeline.h"
+#include "uring.h"
+#include "zerocopy.h"
+#include "bufpool.h"
+#include "lib4nxci.h"
+
+static atomic_uint_fast64_t nxci_alloc_count;
+
+void *nxci_malloc(size_t size) {
+    atomic_fetch_add_explicit(&nxci_alloc_count, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+void *nxci_calloc(size_t num, size_t size) {
+    atomic_fetch_add_explicit(&nxci_alloc_count, 1, memory_order_relaxed);
+    return calloc(num, size);
+}
+
+void *nxci_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&nxci_alloc_count, 1, memory_order_relaxed);
+    return realloc(ptr, size);
+}
+
+void *nxci_aligned_malloc(size_t size, size_t alignment) {
+    atomic_fetch_add_explicit(&nxci_alloc_count, 1, memory_order_relaxed);
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void *ptr;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+        return NULL;
+    return ptr;
+#endif
+}
+
+void nxci_aligned_free(void *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+uint64_t nxci_get_alloc_count(void) {
+    return atomic_load_explicit(&nxci_alloc_count, memory_order_relaxed);
+}
 
 uint32_t align(uint32_t offset, uint32_t alignment) {
     uint32_t mask = ~(alignment-1);
@@ -74,85 +124,108 @@ void save_buffer_to_directory_file(void *buf, uint64_t size, struct filepath *di
     if (filepath.valid == VALIDITY_VALID) {
         save_buffer_to_file(buf, size, &filepath);
     } else {
-        fprintf(stderr, "Failed to create filepath!\n");
-        exit(EXIT_FAILURE);
+        nxci_fail("Failed to create filepath!");
     }
 }
 
-void save_file_section(FILE *f_in, uint64_t ofs, uint64_t total_size, filepath_t *filepath) {
-    FILE *f_out = os_fopen(filepath->os_path, OS_MODE_WRITE);
-
-    if (f_out == NULL) {
-        fprintf(stderr, "Failed to open %s!\n", filepath->char_path);
+/* Copy total_size bytes at ofs in `in` to out_ofs in out in a single pass.
+   plan (may be NULL) is overlaid first, so sha (may be NULL) hashes exactly what gets written. */
+void copy_file_section(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings) {
+    nxci_io_hint(in, ofs, total_size, NXCI_IO_HINT_SEQUENTIAL);
+    if (settings != NULL && (settings->zero_copy || settings->reflink) && zerocopy_copy(in, ofs, total_size, out, out_ofs, plan, sha, settings))
+        return;
+    if (settings != NULL && in->backend == NXCI_IO_URING && uring_copy(in, ofs, total_size, out, out_ofs, plan, sha, settings))
+        return;
+    if (settings != NULL && settings->queue_depth >= 2) {
+        pipeline_copy(in, ofs, total_size, out, out_ofs, plan, sha, settings);
         return;
     }
 
-    uint64_t read_size = 0x400000; /* 4 MB buffer. */
-    unsigned char *buf = malloc(read_size);
-    if (buf == NULL) {
-        fprintf(stderr, "Failed to allocate file-save buffer!\n");
-        exit(EXIT_FAILURE);
-    }
-    memset(buf, 0xCC, read_size); /* Debug in case I fuck this up somehow... */
-    uint64_t end_ofs = ofs + total_size;
-    fseeko64(f_in, ofs, SEEK_SET);
-    while (ofs < end_ofs) {       
-        if (ofs + read_size >= end_ofs) read_size = end_ofs - ofs;
-        if (fread(buf, 1, read_size, f_in) != read_size) {
-            fprintf(stderr, "Failed to read file!\n");
-            exit(EXIT_FAILURE);
+    uint64_t read_size = settings != NULL ? settings->buffer_size : COPY_DEFAULT_BUFFER_SIZE;
+    if (read_size > total_size && total_size != 0) read_size = total_size;
+    /* Aligned, so direct I/O can skip the bounce buffer. */
+    unsigned int num_bufs = 1;
+    unsigned char *buf = bufpool_get_buffers(&read_size, &num_bufs);
+    nxci_cleanup_t cleanup;
+    nxci_cleanup_push(&cleanup, bufpool_put, buf);
+    uint64_t cur = 0;
+    while (cur < total_size) {       
+        if (cur + read_size >= total_size) read_size = total_size - cur;
+        if (nxci_io_read_at(in, buf, read_size, ofs + cur) != read_size) {
+            nxci_fail("Failed to read file!");
+        }
+        if (plan != NULL)
+            nca_patch_plan_apply(plan, cur, buf, read_size);
+        if (sha != NULL)
+            sha_update(sha, buf, read_size);
+        if (nxci_io_write_at(out, buf, read_size, out_ofs + cur) != read_size) {
+            nxci_fail("Failed to write file!");
         }
-        fwrite(buf, 1, read_size, f_out);
-        ofs += read_size;
+        cur += read_size;
+        nxci_job_advance(settings != NULL ? settings->job : NULL, read_size);
     }
 
-    fclose(f_out);
-
-    free(buf);
+    nxci_cleanup_pop(&cleanup, 1);
 }
 
-
-validity_t check_memory_hash_table(FILE *f_in, unsigned char *hash_table, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block) {
+validity_t check_memory_hash_table(nxci_io_t *in, unsigned char *hash_table, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block) {
     if (block_size == 0) {
         /* Block size of 0 is always invalid. */
         return VALIDITY_INVALID;
     }
-    unsigned char cur_hash[0x20];
-    uint64_t read_size = block_size;
-    unsigned char *block = malloc(block_size);
-    if (block == NULL) {
-        fprintf(stderr, "Failed to allocate hash block!\n");
-        exit(EXIT_FAILURE);
+    uint64_t num_blocks = (data_len + block_size - 1) / block_size;
+    uint64_t batch_blocks = HASH_TABLE_BATCH_SIZE / block_size;
+    if (batch_blocks == 0) batch_blocks = 1;
+    if (batch_blocks > num_blocks) batch_blocks = num_blocks;
+
+    /* Blocks are independent, hash a whole batch at once in SIMD lanes. Smaller batches under memory pressure. */
+    uint64_t granted;
+    unsigned char *blocks = bufpool_get(batch_blocks * block_size, block_size, &granted);
+    batch_blocks = granted / block_size;
+    const void **block_ptrs = nxci_malloc(batch_blocks * sizeof(*block_ptrs));
+    unsigned char *hashes = nxci_malloc(batch_blocks * 0x20);
+    if (block_ptrs == NULL || hashes == NULL) {
+        free(hashes);
+        free(block_ptrs);
+        bufpool_put(blocks);
+        nxci_fail("Failed to allocate hash block!");
     }
+    for (uint64_t i = 0; i < batch_blocks; i++)
+        block_ptrs[i] = blocks + i * block_size;
 
     validity_t result = VALIDITY_VALID;
-    unsigned char *cur_hash_table_entry = hash_table;
-    for (uint64_t ofs = 0; ofs < data_len; ofs += read_size) {
-        fseeko64(f_in, ofs + data_ofs, SEEK_SET);
-        if (ofs + read_size > data_len) {
-            /* Last block... */
-            memset(block, 0, read_size);
-            read_size = data_len - ofs;
+    nxci_io_hint(in, data_ofs, data_len, NXCI_IO_HINT_SEQUENTIAL);
+    for (uint64_t blk = 0; blk < num_blocks; blk += batch_blocks) {
+        uint64_t count = num_blocks - blk < batch_blocks ? num_blocks - blk : batch_blocks;
+        uint64_t read_size = data_len - blk * block_size;
+        if (read_size > count * block_size) read_size = count * block_size;
+        /* Last block... */
+        memset(blocks + read_size, 0, count * block_size - read_size);
+
+        if (nxci_io_read_at(in, blocks, read_size, data_ofs + blk * block_size) != read_size) {
+            free(hashes);
+            free(block_ptrs);
+            bufpool_put(blocks);
+            nxci_fail("Failed to read file!");
         }
-        
-        if (fread(block, 1, read_size, f_in) != read_size) {
-            fprintf(stderr, "Failed to read file!\n");
-            exit(EXIT_FAILURE);
-        }        
-        sha256_hash_buffer(cur_hash, block, full_block ? block_size : read_size);
-        if (memcmp(cur_hash, cur_hash_table_entry, 0x20) != 0) {
+        uint64_t last_size = read_size - (count - 1) * block_size;
+        uint64_t num_full = (full_block || last_size == block_size) ? count : count - 1;
+        sha256_hash_blocks(num_full, block_ptrs, block_size, hashes);
+        if (num_full < count)
+            sha256_hash_buffer(hashes + num_full * 0x20, block_ptrs[num_full], last_size);
+        if (memcmp(hashes, hash_table + blk * 0x20, count * 0x20) != 0) {
             result = VALIDITY_INVALID;
             break;
         }
-        cur_hash_table_entry += 0x20;
     }
-    free(block);
+    free(hashes);
+    free(block_ptrs);
+    bufpool_put(blocks);
 
     return result;
 
 }
-
-validity_t check_file_hash_table(FILE *f_in, uint64_t hash_ofs, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block) {
+validity_t check_file_hash_table(nxci_io_t *in, uint64_t hash_ofs, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block) {
     if (block_size == 0) {
         /* Block size of 0 is always invalid. */
         return VALIDITY_INVALID;
@@ -160,19 +233,17 @@ validity_t check_file_hash_table(FILE *f_in, uint64_t hash_ofs, uint64_t data_of
     uint64_t hash_table_size = data_len / block_size;
     if (data_len % block_size) hash_table_size++;
     hash_table_size *= 0x20;
-    unsigned char *hash_table = malloc(hash_table_size);
+    unsigned char *hash_table = nxci_malloc(hash_table_size);
     if (hash_table == NULL) {
-        fprintf(stderr, "Failed to allocate hash table!\n");
-        exit(EXIT_FAILURE);
+        nxci_fail("Failed to allocate hash table!");
     }
 
-    fseeko64(f_in, hash_ofs, SEEK_SET);
-    if (fread(hash_table, 1, hash_table_size, f_in) != hash_table_size) {
-        fprintf(stderr, "Failed to read file!\n");
-        exit(EXIT_FAILURE);
+    if (nxci_io_read_at(in, hash_table, hash_table_size, hash_ofs) != hash_table_size) {
+        free(hash_table);
+        nxci_fail("Failed to read file!");
     }
 
-    validity_t result = check_memory_hash_table(f_in, hash_table, data_ofs, data_len, block_size, full_block);
+    validity_t result = check_memory_hash_table(in, hash_table, data_ofs, data_len, block_size, full_block);
 
     free(hash_table);
 
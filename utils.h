@@ -6,6 +6,10 @@
 #include "types.h"
 
 struct filepath;
+struct nca_patch_plan;
+struct sha_ctx;
+struct nxci_io;
+struct nxci_job;
 
 #ifdef _WIN32
 #define PATH_SEPERATOR '\\'
@@ -21,10 +25,25 @@ struct filepath;
 #define MAX_PATH 1023
 #endif
 
-#define FATAL_ERROR(msg) do {\
-    fprintf(stderr, "Error: %s\n", msg);\
-    exit(EXIT_FAILURE);\
-} while (0)
+#define COPY_DEFAULT_QUEUE_DEPTH 4
+#define COPY_DEFAULT_BUFFER_SIZE 0x400000
+#define COPY_CLONE_ALIGN 0x1000 /* Block size FICLONERANGE ranges are laid out for. */
+
+typedef struct {
+    unsigned int queue_depth; /* Buffers in flight, below 2 copies on the calling thread. */
+    uint64_t buffer_size; /* Size of each copy buffer. */
+    int zero_copy; /* Let the kernel move unpatched ranges. */
+    int reflink; /* Clone block-aligned unpatched ranges instead of copying them. */
+    struct nxci_job *job; /* Told about copied bytes, may cancel the copy. NULL for none. */
+} copy_settings_t;
+
+/* Counted heap allocations, see --stats. */
+void *nxci_malloc(size_t size);
+void *nxci_calloc(size_t num, size_t size);
+void *nxci_realloc(void *ptr, size_t size);
+void *nxci_aligned_malloc(size_t size, size_t alignment);
+void nxci_aligned_free(void *ptr);
+uint64_t nxci_get_alloc_count(void);
 
 uint32_t align(uint32_t offset, uint32_t alignment);
 uint64_t align64(uint64_t offset, uint64_t alignment);
@@ -33,7 +52,7 @@ void memdump(FILE *f, const char *prefix, const void *data, size_t size);
 
 uint64_t _fsize(const char *filename);
 
-void save_file_section(FILE *f_in, uint64_t ofs, uint64_t total_size, struct filepath *filepath);
+void copy_file_section(struct nxci_io *in, uint64_t ofs, uint64_t total_size, struct nxci_io *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings);
 
 void save_buffer_to_file(void *buf, uint64_t size, struct filepath *filepath);
 void save_buffer_to_directory_file(void *buf, uint64_t size, struct filepath *dirpath, const char *filename);
@@ -42,8 +61,10 @@ void strip_ext(char *fname);
 
 FILE *open_key_file(const char *prefix);
 
-validity_t check_memory_hash_table(FILE *f_in, unsigned char *hash_table, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block);
-validity_t check_file_hash_table(FILE *f_in, uint64_t hash_ofs, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block);
+#define HASH_TABLE_BATCH_SIZE 0x400000 /* Bytes verified per multi-buffer batch. */
+
+validity_t check_memory_hash_table(struct nxci_io *in, unsigned char *hash_table, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block);
+validity_t check_file_hash_table(struct nxci_io *in, uint64_t hash_ofs, uint64_t data_ofs, uint64_t data_len, uint64_t block_size, int full_block);
 
 #ifdef __MINGW32__
     /* MINGW32 does not have 64-bit offsets even with large file support. */
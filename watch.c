@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "watch.h"
+
+#ifndef __linux__
+
+int watch_run(const nxci_settings_t *settings, const watch_options_t *options) {
+    (void)settings; (void)options;
+    fprintf(stderr, "--watch needs inotify, only available on Linux\n");
+    return -1;
+}
+
+#else
+
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/inotify.h>
+#include "scheduler.h"
+#include "batch.h"
+#include "signals.h"
+#include "utils.h"
+
+typedef struct watch watch_t;
+
+typedef struct watch_item {
+    nxci_task_t task;
+    watch_t *watch;
+    char input_path[MAX_PATH + 1];
+    char output_dir[MAX_PATH + 1]; /* Hidden directory the cart is converted in. */
+    char final_dir[MAX_PATH + 1]; /* output_dir is renamed to it once converted. */
+    const char *name; /* Of final_dir, prefixes the cart's log lines. */
+    struct watch_item *next;
+} watch_item_t;
+
+struct watch {
+    const watch_options_t *options;
+    nxci_sched_t sched;
+    pthread_mutex_t lock; /* Guards items. */
+    watch_item_t *items; /* Queued or being converted. */
+};
+
+static void watch_log(void *user, const char *text) {
+    watch_item_t *item = user;
+    batch_print(item->name, text);
+}
+
+static const char *watch_basename(const char *path) {
+    const char *base = strrchr(path, '/');
+    return base != NULL ? base + 1 : path;
+}
+
+/* Move the XCI into dir without replacing anything there, error (may be NULL) is saved next to it. */
+static void watch_move(watch_item_t *item, const char *dir, const char *error) {
+    char path[MAX_PATH * 2 + 0x20], stem[MAX_PATH + 1];
+    const char *base = watch_basename(item->input_path);
+    snprintf(stem, sizeof(stem), "%s", base);
+    strip_ext(stem);
+    const char *ext = base + strlen(stem);
+    struct stat st;
+    for (unsigned int n = 1;; n++) {
+        if (n == 1)
+            snprintf(path, sizeof(path), "%s/%s", dir, base);
+        else
+            snprintf(path, sizeof(path), "%s/%s_%u%s", dir, stem, n, ext);
+        if (lstat(path, &st) != 0)
+            break;
+    }
+    if (rename(item->input_path, path) != 0) {
+        char text[MAX_PATH * 3 + 0x80];
+        snprintf(text, sizeof(text), "unable to move %s to %s: %s\n", item->input_path, dir, strerror(errno));
+        batch_print(item->name, text);
+        return;
+    }
+    if (error != NULL) {
+        char error_path[sizeof(path) + 8];
+        snprintf(error_path, sizeof(error_path), "%s.error", path);
+        FILE *f = fopen(error_path, "w");
+        if (f != NULL) {
+            fprintf(f, "%s\n", error);
+            fclose(f);
+        }
+    }
+}
+
+static void watch_done(nxci_task_t *task, void *user) {
+    watch_item_t *item = user;
+    watch_t *watch = item->watch;
+    const watch_options_t *options = watch->options;
+    char text[NXCI_ERROR_SIZE + MAX_PATH * 2 + 0x80];
+
+    if (task->status == NXCI_OK) {
+        // Carts only show up in the output directory once complete
+        if (rename(item->output_dir, item->final_dir) == 0) {
+            snprintf(text, sizeof(text), "Done! %s/%s\n", item->final_dir, watch_basename(task->job.nsp_path));
+            batch_print(item->name, text);
+            if (options->done_dir != NULL)
+                watch_move(item, options->done_dir, NULL);
+        } else {
+            snprintf(text, sizeof(text), "unable to move %s to %s: %s\n", item->output_dir, item->final_dir, strerror(errno));
+            batch_print(item->name, text);
+        }
+    } else {
+        // The partial nsp is gone, only its directory is left
+        rmdir(item->output_dir);
+        snprintf(text, sizeof(text), "%s\n", task->job.error);
+        batch_print(item->name, text);
+        if (task->status != NXCI_CANCELLED && options->failed_dir != NULL)
+            watch_move(item, options->failed_dir, task->job.error);
+    }
+
+    pthread_mutex_lock(&watch->lock);
+    for (watch_item_t **link = &watch->items; *link != NULL; link = &(*link)->next) {
+        if (*link == item) {
+            *link = item->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch->lock);
+    nxci_job_free(&task->job);
+    free(item);
+}
+
+/* Queue the XCI file_name of the watched directory, unless it's queued already. */
+static void watch_add(watch_t *watch, const char *file_name) {
+    const watch_options_t *options = watch->options;
+    if (!batch_is_xci(file_name))
+        return;
+    char stem[MAX_PATH + 1];
+    snprintf(stem, sizeof(stem), "%s", file_name);
+    strip_ext(stem);
+    if (strlen(options->watch_dir) + strlen(file_name) + 1 > MAX_PATH || strlen(options->output_root) + strlen(stem) + 24 > MAX_PATH) {
+        fprintf(stderr, "Path too long for %s\n", file_name);
+        return;
+    }
+    watch_item_t *item = calloc(1, sizeof(watch_item_t));
+    if (item == NULL) {
+        fprintf(stderr, "Failed to allocate %s!\n", file_name);
+        return;
+    }
+    item->watch = watch;
+    snprintf(item->input_path, sizeof(item->input_path), "%s/%s", options->watch_dir, file_name);
+
+    pthread_mutex_lock(&watch->lock);
+    watch_item_t *cur;
+    for (cur = watch->items; cur != NULL; cur = cur->next) {
+        if (strcmp(cur->input_path, item->input_path) == 0)
+            break;
+    }
+    if (cur != NULL) {
+        pthread_mutex_unlock(&watch->lock);
+        free(item);
+        return;
+    }
+    // Named after the XCI, made unique against earlier carts and the ones being converted
+    for (unsigned int n = 1;; n++) {
+        char suffix[16] = "";
+        struct stat st;
+        if (n > 1)
+            snprintf(suffix, sizeof(suffix), "_%u", n);
+        snprintf(item->final_dir, sizeof(item->final_dir), "%s/%s%s", options->output_root, stem, suffix);
+        snprintf(item->output_dir, sizeof(item->output_dir), "%s/.%s%s.partial", options->output_root, stem, suffix);
+        if (lstat(item->final_dir, &st) == 0 || lstat(item->output_dir, &st) == 0)
+            continue;
+        for (cur = watch->items; cur != NULL; cur = cur->next) {
+            if (strcmp(cur->final_dir, item->final_dir) == 0)
+                break;
+        }
+        if (cur == NULL)
+            break;
+    }
+    if (mkdir(item->output_dir, 0777) != 0) {
+        pthread_mutex_unlock(&watch->lock);
+        fprintf(stderr, "unable to create %s: %s\n", item->output_dir, strerror(errno));
+        free(item);
+        return;
+    }
+    item->name = item->final_dir + strlen(options->output_root) + 1;
+    item->next = watch->items;
+    watch->items = item;
+    pthread_mutex_unlock(&watch->lock);
+
+    nxci_job_init(&item->task.job, item->input_path, item->output_dir);
+    item->task.job.log = watch_log;
+    item->task.job.user = item;
+    item->task.done = watch_done;
+    item->task.user = item;
+    batch_print(item->name, "Queued\n");
+    nxci_sched_submit(&watch->sched, &item->task);
+}
+
+static void watch_scan(watch_t *watch) {
+    DIR *dir = opendir(watch->options->watch_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "unable to open %s: %s\n", watch->options->watch_dir, strerror(errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+        watch_add(watch, entry->d_name);
+    closedir(dir);
+}
+
+static int watch_makedir(const char *dir) {
+    if (dir != NULL && mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "unable to create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int watch_run(const nxci_settings_t *settings, const watch_options_t *options) {
+    watch_t watch;
+    memset(&watch, 0, sizeof(watch));
+    watch.options = options;
+
+    if (watch_makedir(options->output_root) != 0 || watch_makedir(options->done_dir) != 0 || watch_makedir(options->failed_dir) != 0)
+        return -1;
+    // Written files are only picked up once closed, moved ones once in place
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, options->watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        fprintf(stderr, "unable to watch %s: %s\n", options->watch_dir, strerror(errno));
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        return -1;
+    }
+
+    // Conversion threads start with the signals blocked
+    sigset_t old_signals;
+    signals_block(&old_signals);
+    int stop_fd = signals_init();
+    nxci_status_t status = stop_fd >= 0 ? nxci_sched_init(&watch.sched, settings, options->num_jobs, options->per_device) : NXCI_ERROR;
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (status != NXCI_OK) {
+        fprintf(stderr, "Failed to start conversion threads!\n");
+        signals_free();
+        close(inotify_fd);
+        return -1;
+    }
+    pthread_mutex_init(&watch.lock, NULL);
+    printf("Watching %s, %u carts at once\n", options->watch_dir, watch.sched.num_threads);
+    fflush(stdout);
+
+    // Carts that landed while nobody was watching
+    watch_scan(&watch);
+    int result = 0;
+    while (result == 0) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(inotify_fd, &fds);
+        FD_SET(stop_fd, &fds);
+        if (select((inotify_fd > stop_fd ? inotify_fd : stop_fd) + 1, &fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "unable to watch %s: %s\n", options->watch_dir, strerror(errno));
+            result = -1;
+            break;
+        }
+        if (FD_ISSET(stop_fd, &fds))
+            break;
+
+        char events[0x1000] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(inotify_fd, events, sizeof(events));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            fprintf(stderr, "unable to watch %s: %s\n", options->watch_dir, strerror(errno));
+            result = -1;
+            break;
+        }
+        for (char *p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                printf("Missed events, rescanning %s\n", options->watch_dir);
+                watch_scan(&watch);
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                fprintf(stderr, "%s was moved or removed\n", options->watch_dir);
+                result = -1;
+            } else if (event->len != 0 && !(event->mask & IN_ISDIR)) {
+                watch_add(&watch, event->name);
+            }
+        }
+    }
+    printf("Stopping\n");
+    fflush(stdout);
+    close(inotify_fd);
+
+    // Carts still queued are dropped and running ones cancelled, their XCIs stay for the next run
+    watch_item_t *dropped = NULL;
+    pthread_mutex_lock(&watch.lock);
+    for (watch_item_t **link = &watch.items; *link != NULL;) {
+        watch_item_t *item = *link;
+        if (nxci_sched_cancel(&watch.sched, &item->task)) {
+            *link = item->next;
+            item->next = dropped;
+            dropped = item;
+        } else {
+            link = &item->next;
+        }
+    }
+    pthread_mutex_unlock(&watch.lock);
+    while (dropped != NULL) {
+        watch_item_t *item = dropped;
+        dropped = item->next;
+        item->task.status = NXCI_CANCELLED;
+        snprintf(item->task.job.error, sizeof(item->task.job.error), "Cancelled");
+        watch_done(&item->task, item);
+    }
+    nxci_sched_wait(&watch.sched);
+    nxci_sched_free(&watch.sched);
+    pthread_mutex_destroy(&watch.lock);
+    signals_free();
+    return result;
+}
+
+#endif
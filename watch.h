@@ -0,0 +1,20 @@
+#ifndef NXCI_WATCH_H
+#define NXCI_WATCH_H
+
+#include "types.h"
+#include "settings.h"
+
+typedef struct {
+    const char *watch_dir;
+    const char *output_root; /* Each cart is converted into its own directory there, named after the XCI. */
+    const char *done_dir; /* Converted XCIs are moved there, NULL leaves them. */
+    const char *failed_dir; /* Same for XCIs that failed, with the error in <name>.error. */
+    unsigned int num_jobs;
+    unsigned int per_device;
+} watch_options_t;
+
+/* Convert the XCIs in watch_dir, then every one written or moved into it, until SIGINT or SIGTERM.
+   Conversions still running then are cancelled and their XCIs left for the next run. Returns -1 if it couldn't start. */
+int watch_run(const nxci_settings_t *settings, const watch_options_t *options);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "workpool.h"
+#include "error.h"
+
+#define WORKPOOL_MAX_THREADS 64
+
+typedef struct {
+    workpool_func_t func;
+    void **jobs;
+    unsigned int num_jobs;
+    atomic_uint next_job;
+    /* First job to fail, no new jobs are started after it. */
+    atomic_int failed;
+    nxci_status_t status;
+    char message[NXCI_ERROR_SIZE];
+} workpool_t;
+
+unsigned int workpool_default_threads(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int)cpus : 1;
+#endif
+}
+
+static void workpool_run_job(workpool_t *pool, void *job) {
+    nxci_catch_t frame;
+    nxci_catch_enter(&frame);
+    if (setjmp(frame.env) == 0) {
+        pool->func(job);
+        nxci_catch_leave(&frame);
+    } else if (atomic_exchange(&pool->failed, 1) == 0) {
+        pool->status = frame.status;
+        memcpy(pool->message, frame.message, sizeof(pool->message));
+    }
+}
+
+static void *workpool_worker(void *arg) {
+    workpool_t *pool = arg;
+    unsigned int i;
+
+    while (!atomic_load(&pool->failed) && (i = atomic_fetch_add(&pool->next_job, 1)) < pool->num_jobs)
+        workpool_run_job(pool, pool->jobs[i]);
+    return NULL;
+}
+
+/* Run func on every job using up to num_threads threads, returns once all jobs are done.
+   A job failing is raised again on the calling thread once the jobs already running are done. */
+void workpool_run(unsigned int num_threads, workpool_func_t func, void **jobs, unsigned int num_jobs) {
+    workpool_t pool;
+    pthread_t threads[WORKPOOL_MAX_THREADS];
+
+    pool.func = func;
+    pool.jobs = jobs;
+    pool.num_jobs = num_jobs;
+    atomic_init(&pool.next_job, 0);
+    atomic_init(&pool.failed, 0);
+
+    if (num_threads > num_jobs) num_threads = num_jobs;
+    if (num_threads > WORKPOOL_MAX_THREADS) num_threads = WORKPOOL_MAX_THREADS;
+    if (num_threads <= 1) {
+        for (unsigned int i = 0; i < num_jobs; i++)
+            func(jobs[i]);
+        return;
+    }
+
+    /* Fewer threads if some can't be started, at worst the calling thread does it all. */
+    unsigned int started = 0;
+    while (started < num_threads && pthread_create(&threads[started], NULL, workpool_worker, &pool) == 0)
+        started++;
+    if (started == 0)
+        workpool_worker(&pool);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (atomic_load(&pool.failed))
+        nxci_fail_status(pool.status, "%s", pool.message);
+}
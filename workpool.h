@@ -0,0 +1,11 @@
+#ifndef NXCI_WORKPOOL_H
+#define NXCI_WORKPOOL_H
+
+#include "types.h"
+
+typedef void (*workpool_func_t)(void *job);
+
+unsigned int workpool_default_threads(void);
+void workpool_run(unsigned int num_threads, workpool_func_t func, void **jobs, unsigned int num_jobs);
+
+#endif
@@ -2,6 +2,9 @@
 #include "nsp.h"
 #include "xci.h"
 #include "rsa.h"
+#include "nca.h"
+#include "workpool.h"
+#include "lib4nxci.h"
 
 /* This RSA-PKCS1 public key is only accessible to the gamecard controller. */
 /* However, it (and other XCI keys) can be dumped with a GCD attack on two signatures. */
@@ -26,35 +29,27 @@ const unsigned char xci_header_pubk[0x100] = {
 };
 
 void xci_process(xci_ctx_t *ctx) {
-    fseeko64(ctx->file, 0, SEEK_SET);
-    if (fread(&ctx->header, 1, 0x200, ctx->file) != 0x200) {
-        fprintf(stderr, "Failed to read XCI header!\n");
-        return;
+    if (nxci_io_read_at(ctx->io, &ctx->header, 0x200, 0) != 0x200) {
+        nxci_fail("Failed to read XCI header!");
     }
     
     if (ctx->header.magic != MAGIC_HEAD) {
-        fprintf(stderr, "Error: XCI header is corrupt!\n");
-        exit(EXIT_FAILURE);
+        nxci_fail("Error: XCI header is corrupt!");
     }
 
-    ctx->hfs0_hash_validity = check_memory_hash_table(ctx->file, ctx->header.hfs0_header_hash, ctx->header.hfs0_offset, ctx->header.hfs0_header_size, ctx->header.hfs0_header_size, 0);
+    ctx->hfs0_hash_validity = check_memory_hash_table(ctx->io, ctx->header.hfs0_header_hash, ctx->header.hfs0_offset, ctx->header.hfs0_header_size, ctx->header.hfs0_header_size, 0);
     if (ctx->hfs0_hash_validity != VALIDITY_VALID) {
-        fprintf(stderr, "Error: XCI partition is corrupt!\n");
-        exit(EXIT_FAILURE);
+        nxci_fail("Error: XCI partition is corrupt!");
     }
     
-    nxci_ctx_t blank_ctx;
-    memset(&blank_ctx, 0, sizeof(blank_ctx));
-    
-    ctx->partition_ctx.file = ctx->file;
+    ctx->partition_ctx.io = ctx->io;
     ctx->partition_ctx.offset = ctx->header.hfs0_offset;
-    ctx->partition_ctx.tool_ctx = &blank_ctx;
+    ctx->partition_ctx.tool_ctx = ctx->tool_ctx;
     ctx->partition_ctx.name = "rootpt";
     hfs0_process(&ctx->partition_ctx);
     
     if (ctx->partition_ctx.header->num_files > 4) {
-        fprintf(stderr, "Error: Invalid XCI partition!\n");
-        exit(EXIT_FAILURE);    
+        nxci_fail("Error: Invalid XCI partition!");    
     }
     
     for (unsigned int i = 0; i < ctx->partition_ctx.header->num_files; i++)  {
@@ -62,41 +57,70 @@ void xci_process(xci_ctx_t *ctx) {
         
         hfs0_file_entry_t *cur_file = hfs0_get_file_entry(ctx->partition_ctx.header, i);
         char *cur_name = hfs0_get_file_name(ctx->partition_ctx.header, i);
-        if (!strcmp(cur_name, "update") && ctx->update_ctx.file == NULL) {
+        if (!strcmp(cur_name, "update") && ctx->update_ctx.io == NULL) {
             cur_ctx = &ctx->update_ctx;
-        } else if (!strcmp(cur_name, "normal") && ctx->normal_ctx.file == NULL) {
+        } else if (!strcmp(cur_name, "normal") && ctx->normal_ctx.io == NULL) {
             cur_ctx = &ctx->normal_ctx;
-        } else if (!strcmp(cur_name, "secure") && ctx->secure_ctx.file == NULL) {
+        } else if (!strcmp(cur_name, "secure") && ctx->secure_ctx.io == NULL) {
             cur_ctx = &ctx->secure_ctx;
-        } else if (!strcmp(cur_name, "logo") && ctx->logo_ctx.file == NULL) {
+        } else if (!strcmp(cur_name, "logo") && ctx->logo_ctx.io == NULL) {
             cur_ctx = &ctx->logo_ctx;
         } 
         
         if (cur_ctx == NULL) {
-            fprintf(stderr, "Unknown XCI partition: %s\n", cur_name);
-            exit(EXIT_FAILURE);
+            nxci_fail("Unknown XCI partition: %s", cur_name);
         }
         
         cur_ctx->name = cur_name;
         cur_ctx->offset = ctx->partition_ctx.offset + hfs0_get_header_size(ctx->partition_ctx.header) + cur_file->offset;
         cur_ctx->tool_ctx = ctx->tool_ctx;
-        cur_ctx->file = ctx->file;
+        cur_ctx->io = ctx->io;
         hfs0_process(cur_ctx);
     }
     
     for (unsigned int i = 0; i < 0x10; i++) {
         ctx->iv[i] = ctx->header.reversed_iv[0xF-i];
     }
-    xci_save(ctx);
+}
 
+typedef struct {
+    nca_ctx_t *nca_ctx;
+    filepath_t filepath;
+} xci_save_job_t;
+
+static void xci_save_nca(void *arg) {
+    xci_save_job_t *job = arg;
+    nxci_log(job->nca_ctx->tool_ctx, "Saving %s NCA to %s\n", nca_get_content_type(job->nca_ctx), job->filepath.char_path);
+    nca_process(job->nca_ctx, &job->filepath);
 }
 
 void xci_save(xci_ctx_t *ctx) {
+    nca_ctx_t **nca_ctxs = ctx->tool_ctx->cart->nca_ctxs;
+    uint32_t entries[4];
+    xci_save_job_t jobs[4];
+    void *job_ptrs[3];
+
     /* Save Secure Partition. */
-	printf("Saving Secure Partition...\n");
+	nxci_log(ctx->tool_ctx, "Saving Secure Partition...\n");
 	os_makedir(ctx->tool_ctx->settings.secure_dir_path.os_path);
-	for (uint32_t i = 0; i < ctx->secure_ctx.header->num_files; i++) {
-		hfs0_save_file(&ctx->secure_ctx, i, &ctx->tool_ctx->settings.secure_dir_path);
-	}
-	printf("\n");
+    hfs0_prepare_ncas(&ctx->secure_ctx, nca_ctxs, entries);
+    for (int index = 0; index < 4; index++) {
+        const char *name = hfs0_get_file_name(ctx->secure_ctx.header, entries[index]);
+        if (strlen(name) >= MAX_PATH - strlen(ctx->tool_ctx->settings.secure_dir_path.char_path) - 1) {
+            nxci_fail("Filename too long in HFS0!");
+        }
+        jobs[index].nca_ctx = nca_ctxs[index];
+        filepath_copy(&jobs[index].filepath, &ctx->tool_ctx->settings.secure_dir_path);
+        filepath_append(&jobs[index].filepath, "%s", name);
+        /* Meta NCA is rebuilt, not copied. */
+        if (index < 3) {
+            job_ptrs[index] = &jobs[index];
+            nxci_job_add_total(ctx->tool_ctx->job, nca_ctxs[index]->file_size);
+        }
+    }
+
+    /* Meta NCA needs the hashes of the others. */
+    workpool_run(ctx->tool_ctx->settings.num_workers, xci_save_nca, job_ptrs, 3);
+    xci_save_nca(&jobs[3]);
+	nxci_log(ctx->tool_ctx, "\n");
 }
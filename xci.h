@@ -33,7 +33,7 @@ typedef struct {
 } xci_header_t;
 
 typedef struct {
-    FILE *file; /* File for this NCA. */
+    nxci_io_t *io; /* XCI being converted. */
     validity_t header_sig_validity;
     validity_t cert_sig_validity;
     validity_t hfs0_hash_validity;
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE /* copy_file_range, splice */
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include "zerocopy.h"
+#include "nca.h"
+#include "sha.h"
+#include "bufpool.h"
+#include "lib4nxci.h"
+
+static atomic_uint_fast64_t zerocopy_bytes[ZEROCOPY_NUM_METHODS];
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+typedef struct {
+    nxci_io_t *in;
+    nxci_io_t *out;
+    zerocopy_method_t method; /* Best method still believed to work. */
+    int pipe_fds[2];
+    unsigned char *buf;
+    uint64_t buf_size;
+    void *map; /* Input mapping hashes are read from, when io has none. */
+    size_t map_len;
+} zerocopy_t;
+
+/* Errors meaning "not between these two files", anything else is a real I/O error. */
+static int zerocopy_unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+static uint64_t zerocopy_file_range(zerocopy_t *zc, uint64_t in_ofs, uint64_t out_ofs, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        off64_t off_in = in_ofs + done, off_out = out_ofs + done;
+        ssize_t n = copy_file_range(zc->in->fd, &off_in, zc->out->fd, &off_out, len - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && zerocopy_unsupported(errno))
+            break;
+        if (n <= 0) {
+            nxci_fail("Failed to copy file: %s", n < 0 ? strerror(errno) : "unexpected end of file");
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Write out whatever is left in the pipe from user space. */
+static void zerocopy_drain_pipe(zerocopy_t *zc, uint64_t out_ofs, uint64_t len) {
+    while (len != 0) {
+        ssize_t n = read(zc->pipe_fds[0], zc->buf, len < zc->buf_size ? len : zc->buf_size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || nxci_io_write_at(zc->out, zc->buf, n, out_ofs) != (size_t)n) {
+            nxci_fail("Failed to write file!");
+        }
+        out_ofs += n;
+        len -= n;
+    }
+}
+
+static uint64_t zerocopy_splice(zerocopy_t *zc, uint64_t in_ofs, uint64_t out_ofs, uint64_t len) {
+    if (zc->pipe_fds[0] < 0) {
+        if (pipe(zc->pipe_fds) != 0)
+            return 0;
+        fcntl(zc->pipe_fds[1], F_SETPIPE_SZ, ZEROCOPY_PIPE_SIZE);
+    }
+
+    uint64_t done = 0;
+    while (done < len) {
+        off64_t off_in = in_ofs + done;
+        ssize_t n = splice(zc->in->fd, &off_in, zc->pipe_fds[1], NULL, len - done < ZEROCOPY_PIPE_SIZE ? len - done : ZEROCOPY_PIPE_SIZE, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && zerocopy_unsupported(errno))
+            break;
+        if (n <= 0) {
+            nxci_fail("Failed to read file: %s", n < 0 ? strerror(errno) : "unexpected end of file");
+        }
+
+        size_t left = n;
+        while (left != 0) {
+            off64_t off_out = out_ofs + done;
+            ssize_t m = splice(zc->pipe_fds[0], NULL, zc->out->fd, &off_out, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && zerocopy_unsupported(errno)) {
+                zerocopy_drain_pipe(zc, out_ofs + done, left);
+                return done + left;
+            }
+            if (m <= 0) {
+                nxci_fail("Failed to write file: %s", m < 0 ? strerror(errno) : "no progress");
+            }
+            left -= m;
+            done += m;
+        }
+    }
+    return done;
+}
+
+static void zerocopy_user(zerocopy_t *zc, uint64_t in_ofs, uint64_t out_ofs, uint64_t len) {
+    while (len != 0) {
+        uint64_t n = len < zc->buf_size ? len : zc->buf_size;
+        if (nxci_io_read_at(zc->in, zc->buf, n, in_ofs) != n) {
+            nxci_fail("Failed to read file!");
+        }
+        if (nxci_io_write_at(zc->out, zc->buf, n, out_ofs) != n) {
+            nxci_fail("Failed to write file!");
+        }
+        in_ofs += n;
+        out_ofs += n;
+        len -= n;
+    }
+}
+
+/* Copy an unmodified range with the best method that works, stepping down when one isn't supported. */
+static void zerocopy_range(zerocopy_t *zc, uint64_t in_ofs, uint64_t out_ofs, uint64_t len) {
+    uint64_t done = 0, n;
+    if (zc->method <= ZEROCOPY_COPY_FILE_RANGE) {
+        n = zerocopy_file_range(zc, in_ofs, out_ofs, len);
+        atomic_fetch_add(&zerocopy_bytes[ZEROCOPY_COPY_FILE_RANGE], n);
+        done += n;
+        if (done < len)
+            zc->method = ZEROCOPY_SPLICE;
+    }
+    if (done < len && zc->method == ZEROCOPY_SPLICE) {
+        n = zerocopy_splice(zc, in_ofs + done, out_ofs + done, len - done);
+        atomic_fetch_add(&zerocopy_bytes[ZEROCOPY_SPLICE], n);
+        done += n;
+        if (done < len)
+            zc->method = ZEROCOPY_USER;
+    }
+    if (done < len) {
+        zerocopy_user(zc, in_ofs + done, out_ofs + done, len - done);
+        atomic_fetch_add(&zerocopy_bytes[ZEROCOPY_USER], len - done);
+    }
+}
+
+/* Share the blocks of len bytes with the source, returns 0 if the filesystem can't. */
+static int zerocopy_clone(zerocopy_t *zc, uint64_t in_ofs, uint64_t out_ofs, uint64_t len) {
+#ifdef FICLONERANGE
+    struct file_clone_range range = {zc->in->fd, in_ofs, len, out_ofs};
+    while (ioctl(zc->out->fd, FICLONERANGE, &range) != 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno == ENOTTY || errno == EPERM || zerocopy_unsupported(errno))
+            return 0;
+        nxci_fail("Failed to clone file: %s", strerror(errno));
+    }
+    return 1;
+#else
+    (void)zc; (void)in_ofs; (void)out_ofs; (void)len;
+    return 0;
+#endif
+}
+
+/* Clone the whole blocks of an unmodified range, the unaligned head and tail are copied.
+   Only possible when both sides sit at the same offset within a block, which the NSP layout arranges. */
+static void zerocopy_clone_range(zerocopy_t *zc, uint64_t in_ofs, uint64_t out_ofs, uint64_t len) {
+    uint64_t mask = COPY_CLONE_ALIGN - 1;
+    uint64_t head = (COPY_CLONE_ALIGN - (in_ofs & mask)) & mask, body = 0;
+    if (((in_ofs ^ out_ofs) & mask) == 0 && head < len)
+        body = (len - head) & ~mask;
+    if (body == 0) {
+        zerocopy_range(zc, in_ofs, out_ofs, len);
+        return;
+    }
+    zerocopy_range(zc, in_ofs, out_ofs, head);
+    if (zerocopy_clone(zc, in_ofs + head, out_ofs + head, body)) {
+        atomic_fetch_add(&zerocopy_bytes[ZEROCOPY_CLONE], body);
+    } else {
+        zc->method = ZEROCOPY_COPY_FILE_RANGE;
+        zerocopy_range(zc, in_ofs + head, out_ofs + head, body);
+    }
+    zerocopy_range(zc, in_ofs + head + body, out_ofs + head + body, len - head - body);
+}
+
+static void zerocopy_release(void *arg) {
+    zerocopy_t *zc = arg;
+    if (zc->pipe_fds[0] >= 0) {
+        close(zc->pipe_fds[0]);
+        close(zc->pipe_fds[1]);
+    }
+    bufpool_put(zc->buf);
+    if (zc->map != NULL)
+        munmap(zc->map, zc->map_len);
+}
+
+int zerocopy_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings) {
+    /* Needs fds on both sides, direct I/O would need aligned offsets. */
+    if (in->fd < 0 || out->fd < 0 || ((in->flags | out->flags) & NXCI_IO_FLAG_DIRECT))
+        return 0;
+
+    /* Hashing needs the bytes, read them through a mapping instead of copying them out. */
+    const unsigned char *src = NULL;
+    void *map = NULL;
+    size_t map_len = 0;
+    if (sha != NULL && total_size != 0) {
+        if (in->map != NULL) {
+            src = in->map + ofs;
+        } else {
+            uint64_t map_ofs = ofs & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+            map_len = total_size + ofs - map_ofs;
+            if ((map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, in->fd, map_ofs)) == MAP_FAILED)
+                return 0;
+            madvise(map, map_len, MADV_SEQUENTIAL);
+            src = (const unsigned char *)map + (ofs - map_ofs);
+        }
+    }
+
+    zerocopy_t zc;
+    memset(&zc, 0, sizeof(zc));
+    zc.in = in;
+    zc.out = out;
+    zc.method = settings->reflink ? ZEROCOPY_CLONE : ZEROCOPY_COPY_FILE_RANGE;
+    zc.pipe_fds[0] = zc.pipe_fds[1] = -1;
+    zc.buf_size = settings->buffer_size;
+    unsigned int num_bufs = 1;
+    zc.buf = bufpool_get_buffers(&zc.buf_size, &num_bufs);
+    zc.map = map;
+    zc.map_len = map_len;
+    nxci_cleanup_t cleanup;
+    nxci_cleanup_push(&cleanup, zerocopy_release, &zc);
+
+    uint64_t cur = 0;
+    unsigned int p = 0;
+    while (cur < total_size) {
+        while (plan != NULL && p < plan->num_patches && plan->patches[p].offset + plan->patches[p].size <= cur)
+            p++;
+        uint64_t next = total_size;
+        if (plan != NULL && p < plan->num_patches && plan->patches[p].offset < total_size)
+            next = plan->patches[p].offset > cur ? plan->patches[p].offset : cur;
+
+        if (next > cur) {
+            /* Unmodified, the kernel copies it. */
+            if (zc.method == ZEROCOPY_CLONE)
+                zerocopy_clone_range(&zc, ofs + cur, out_ofs + cur, next - cur);
+            else
+                zerocopy_range(&zc, ofs + cur, out_ofs + cur, next - cur);
+            if (src != NULL)
+                sha_update(sha, src + cur, next - cur);
+            nxci_job_advance(settings->job, next - cur);
+            cur = next;
+            continue;
+        }
+
+        /* Patched, goes through user space. */
+        uint64_t end = plan->patches[p].offset + plan->patches[p].size;
+        if (end > total_size) end = total_size;
+        while (cur < end) {
+            uint64_t len = end - cur < zc.buf_size ? end - cur : zc.buf_size;
+            if (src != NULL) {
+                memcpy(zc.buf, src + cur, len);
+            } else if (nxci_io_read_at(in, zc.buf, len, ofs + cur) != len) {
+                nxci_fail("Failed to read file!");
+            }
+            nca_patch_plan_apply(plan, cur, zc.buf, len);
+            if (src != NULL)
+                sha_update(sha, zc.buf, len);
+            if (nxci_io_write_at(out, zc.buf, len, out_ofs + cur) != len) {
+                nxci_fail("Failed to write file!");
+            }
+            atomic_fetch_add(&zerocopy_bytes[ZEROCOPY_USER], len);
+            nxci_job_advance(settings->job, len);
+            cur += len;
+        }
+    }
+
+    nxci_cleanup_pop(&cleanup, 1);
+    return 1;
+}
+#else
+int zerocopy_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings) {
+    (void)in; (void)ofs; (void)total_size; (void)out; (void)out_ofs; (void)plan; (void)sha; (void)settings;
+    return 0;
+}
+#endif
+
+uint64_t zerocopy_get_bytes(zerocopy_method_t method) {
+    return atomic_load(&zerocopy_bytes[method]);
+}
+
+void zerocopy_print_stats(FILE *f) {
+    uint64_t clone = zerocopy_get_bytes(ZEROCOPY_CLONE);
+    uint64_t cfr = zerocopy_get_bytes(ZEROCOPY_COPY_FILE_RANGE);
+    uint64_t spl = zerocopy_get_bytes(ZEROCOPY_SPLICE);
+    uint64_t user = zerocopy_get_bytes(ZEROCOPY_USER);
+    if (clone + cfr + spl + user == 0)
+        return;
+    fprintf(f, "Zero-copy: %" PRIu64 " bytes cloned, %" PRIu64 " by copy_file_range, %" PRIu64 " by splice, %" PRIu64 " from user space\n", clone, cfr, spl, user);
+}
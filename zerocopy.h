@@ -0,0 +1,25 @@
+#ifndef NXCI_ZEROCOPY_H
+#define NXCI_ZEROCOPY_H
+
+#include <stdio.h>
+#include "types.h"
+#include "utils.h"
+#include "io.h"
+
+#define ZEROCOPY_PIPE_SIZE 0x100000
+
+typedef enum {
+    ZEROCOPY_CLONE = 0, /* FICLONERANGE, the NSP shares extents with the source. */
+    ZEROCOPY_COPY_FILE_RANGE,
+    ZEROCOPY_SPLICE,
+    ZEROCOPY_USER, /* Patched ranges, and everything once the kernel paths are unsupported. */
+    ZEROCOPY_NUM_METHODS
+} zerocopy_method_t;
+
+/* Copy like copy_file_section, moving the ranges plan leaves alone inside the kernel.
+   sha is fed from a read-only mapping of the source. Returns 0 when it can't be used, so the caller can fall back. */
+int zerocopy_copy(nxci_io_t *in, uint64_t ofs, uint64_t total_size, nxci_io_t *out, uint64_t out_ofs, struct nca_patch_plan *plan, struct sha_ctx *sha, const copy_settings_t *settings);
+uint64_t zerocopy_get_bytes(zerocopy_method_t method);
+void zerocopy_print_stats(FILE *f);
+
+#endif